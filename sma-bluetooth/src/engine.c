@@ -0,0 +1,353 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "sma_struct.h"
+#include "transport.h"
+#include "sb_commands.h"
+#include "engine.h"
+
+#define MAX_EVENTS 16
+
+/* What an epoll event is for, with the session and lane index above it */
+#define EV_LINK   0             /* a lane's link became readable */
+#define EV_TIMER  1             /* a lane's timer fired */
+#define EV_PUMP   2             /* pipelined, the shared link became readable */
+
+#define EV_DATA( session, lane, kind ) ((( (uint64_t)(session) << 16 | (lane) ) << 2 ) | (kind) )
+
+/*
+ * Get a session ready to run commands over tp, one at a time unless the
+ * caller sets window.  The data lists are shared with the caller, like for
+ * InverterCommands.
+ */
+void SessionInit( SessionType * session, const char ** commands, ConfType * conf, FlagType * flag, UnitType **unit, TransportType *tp, CommandFileType * cmdfile, ArchDataType **archdatalist, int *archdatalen , LiveDataType **livedatalist, int *livedatalen )
+{
+  memset( session, 0, sizeof(SessionType) );
+  session->cmd.conf = conf;
+  session->cmd.flag = flag;
+  session->cmd.unit = unit;
+  session->cmd.tp = tp;
+  session->cmd.cmdfile = cmdfile;
+  session->cmd.archdatalist = archdatalist;
+  session->cmd.archdatalen = archdatalen;
+  session->cmd.livedatalist = livedatalist;
+  session->cmd.livedatalen = livedatalen;
+  session->commands = commands;
+  session->command = 0;
+  session->state = SESSION_RUNNING;
+  session->window = 1;
+}
+
+/*
+ * Give the session a lane for each command it may have in flight.  With
+ * more than one they are sent one after the other without waiting for the
+ * replies, which the link hands to their lanes by packet id, and each
+ * times out and is sent again on its own.
+ * Returns 0 on success and -1 on error
+ */
+int session_lanes( SessionType * session )
+{
+  FlagType * flag = session->cmd.flag;
+  TransportType * tp = session->cmd.tp;
+  LaneType * lane;
+  int i, num;
+
+  for( num=0; ( num < session->window )&&( session->commands[num] != NULL ); num++ );
+  if( num < 1 ) num = 1;
+  if(( session->lanes = (LaneType *)malloc( sizeof(LaneType) * num )) == NULL ) {
+    printf("ERROR: Out of memory\n" );
+    return( -1 );
+  }
+  if( num > 1 ) {
+    if((( session->links = (TransportType *)malloc( sizeof(TransportType) * num )) == NULL )||( transport_lanes( tp, session->links, num, flag ) < 0 )) {
+      // carry on one command at a time
+      free( session->links );
+      session->links = NULL;
+      num = 1;
+    }
+  }
+  session->num_lanes = num;
+  for( i=0; i<num; i++ ) {
+    lane = session->lanes+i;
+    lane->cmd = session->cmd;
+    lane->cmd.send_count = &tp->send_count;
+    if( session->links != NULL )
+      lane->cmd.tp = session->links+i;
+    lane->command = -1;
+    lane->waiting = 0;
+    lane->timer = -1;
+  }
+  if(( num > 1 )&&( flag->verbose == 1 )) printf("Pipelining %d commands on %s\n", num, tp->address );
+  return( 0 );
+}
+
+/* Arm the lane timer, 0 ms fires at once and -1 stops it */
+void session_timer( LaneType * lane, int ms )
+{
+  struct itimerspec its;
+
+  memset( &its, 0, sizeof(its) );
+  if( ms >= 0 ) {
+    its.it_value.tv_sec = ms/1000;
+    its.it_value.tv_nsec = (ms%1000)*1000000L + 1;
+  }
+  timerfd_settime( lane->timer, 0, &its, NULL );
+}
+
+/* Only listen to the link while the lane waits for it */
+void session_listen( int epfd, LaneType * lane, int index, int l, int on )
+{
+  struct epoll_event ev;
+
+  memset( &ev, 0, sizeof(ev) );
+  ev.events = on ? EPOLLIN : 0;
+  ev.data.u64 = EV_DATA( index, l, EV_LINK );
+  epoll_ctl( epfd, EPOLL_CTL_MOD, lane->cmd.tp->fd, &ev );
+}
+
+/*
+ * Act on what a command step returned: park the lane until its link or
+ * timer fires, or move on to the next command in the session's list.  The
+ * session is done once every command has finished, and fails with the
+ * first that does.
+ */
+void session_advance( int epfd, SessionType * session, int index, int l, int status )
+{
+  LaneType * lane = session->lanes+l;
+  int i;
+
+  for(;;) {
+    switch( status ) {
+      case CMD_WAIT_READ:
+      case CMD_WAIT_TIME:
+        lane->waiting = status;
+        session_listen( epfd, lane, index, l, status == CMD_WAIT_READ );
+        session_timer( lane, lane->cmd.wait_ms );
+        return;
+
+      case CMD_DONE:
+        if( lane->command >= 0 )
+          CommandEnd( &lane->cmd );
+        lane->command = -1;
+        lane->waiting = 0;
+        if( session->commands[session->command] == NULL ) {
+          for( i=0; i<session->num_lanes; i++ )
+            if( session->lanes[i].command >= 0 )
+              return;
+          session->state = SESSION_DONE;
+          return;
+        }
+        lane->command = session->command++;
+        if( lane->cmd.flag->debug == 1) printf("Executing command %s\n", session->commands[lane->command]);
+        if( CommandStart( &lane->cmd, session->commands[lane->command] ) < 0 ) {
+          printf("ERROR executing command %s\n", session->commands[lane->command]);
+          lane->command = -1;
+          session->state = SESSION_FAILED;
+          return;
+        }
+        status = CommandStep( &lane->cmd );
+        break;
+
+      default:
+        printf("ERROR: Cannot process Command %s\n", session->commands[lane->command]);
+        printf("ERROR executing command %s\n", session->commands[lane->command]);
+        CommandEnd( &lane->cmd );
+        lane->command = -1;
+        session->state = SESSION_FAILED;
+        return;
+    }
+  }
+}
+
+/*
+ * The shared link of a pipelined session has data: hand it out to the
+ * lanes.  If the link failed, the lanes waiting on it find out now
+ */
+void session_pump( int epfd, SessionType * session, int index )
+{
+  LaneType * lane;
+  int l;
+
+  if( transport_pump( session->cmd.tp ) == 0 )
+    return;
+  epoll_ctl( epfd, EPOLL_CTL_DEL, session->cmd.tp->fd, NULL );
+  for( l=0; ( l<session->num_lanes )&&( session->state == SESSION_RUNNING ); l++ ) {
+    lane = session->lanes+l;
+    if(( lane->command >= 0 )&&( lane->waiting == CMD_WAIT_READ )) {
+      session_timer( lane, -1 );
+      session_advance( epfd, session, index, l, CommandStep( &lane->cmd ));
+    }
+  }
+}
+
+/*
+ * Fail the sessions still running once their deadline has passed, however
+ * busy their links are.  Returns ms to the nearest deadline still ahead,
+ * -1 if none
+ */
+int session_deadline( SessionType * sessions, int num_sessions )
+{
+  SessionType * session;
+  long now = monotonic_ms();
+  long deadline, wait = -1;
+  int i, l;
+
+  for( i=0; i<num_sessions; i++ ) {
+    session = sessions+i;
+    if(( session->state != SESSION_RUNNING )||(( deadline = session->cmd.conf->deadline ) <= 0 ))
+      continue;
+    if( now >= deadline ) {
+      for( l=0; ( l<session->num_lanes )&&( session->lanes[l].command < 0 ); l++ );
+      if( session->cmd.flag->verbose == 1 ) printf("Cycle budget used up running %s on %s\n", ( l < session->num_lanes ) ? session->commands[session->lanes[l].command] : "commands", session->cmd.tp->address );
+      session->state = SESSION_FAILED;
+      session->overran = 1;
+      continue;
+    }
+    if(( wait < 0 )||( deadline - now < wait ))
+      wait = deadline - now;
+  }
+  return( wait );
+}
+
+/*
+ * Run the sessions until each has finished its command list, failed, or
+ * run past conf->deadline.  One thread serves them all: a session only
+ * runs when its link has data or its timer fires, so a slow inverter does
+ * not hold up the others.
+ * Returns 0 if every session succeeded and -1 otherwise
+ */
+int RunSessions( SessionType * sessions, int num_sessions )
+{
+  struct epoll_event ev, events[MAX_EVENTS];
+  SessionType * session;
+  LaneType * lane;
+  uint64_t expirations;
+  int epfd, i, l, n, index, wait, running=0, result=0;
+
+  if(( epfd = epoll_create1( EPOLL_CLOEXEC )) < 0 ) {
+    printf("ERROR: Cannot create epoll instance\n");
+    return( -1 );
+  }
+  for( i=0; i<num_sessions; i++ ) {
+    session = sessions+i;
+    if( session_lanes( session ) < 0 ) {
+      session->state = SESSION_FAILED;
+      continue;
+    }
+    if( session->links != NULL ) {
+      memset( &ev, 0, sizeof(ev) );
+      ev.events = EPOLLIN;
+      ev.data.u64 = EV_DATA( i, 0, EV_PUMP );
+      epoll_ctl( epfd, EPOLL_CTL_ADD, session->cmd.tp->fd, &ev );
+    }
+    for( l=0; l<session->num_lanes; l++ ) {
+      lane = session->lanes+l;
+      if(( lane->timer = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC )) < 0 ) {
+        printf("ERROR: Cannot create session timer\n");
+        session->state = SESSION_FAILED;
+        break;
+      }
+      memset( &ev, 0, sizeof(ev) );
+      ev.data.u64 = EV_DATA( i, l, EV_LINK );
+      epoll_ctl( epfd, EPOLL_CTL_ADD, lane->cmd.tp->fd, &ev );
+      ev.events = EPOLLIN;
+      ev.data.u64 = EV_DATA( i, l, EV_TIMER );
+      epoll_ctl( epfd, EPOLL_CTL_ADD, lane->timer, &ev );
+    }
+    // every lane sends its first request before any reply is read
+    for( l=0; ( l<session->num_lanes )&&( session->state == SESSION_RUNNING ); l++ )
+      session_advance( epfd, session, i, l, CMD_DONE );
+  }
+  for(;;) {
+    // checked on every turn, a link that keeps sending does not hold a session up
+    wait = session_deadline( sessions, num_sessions );
+    for( running=0, i=0; i<num_sessions; i++ )
+      if( sessions[i].state == SESSION_RUNNING ) running++;
+    if( running == 0 )
+      break;
+    if(( n = epoll_wait( epfd, events, MAX_EVENTS, wait )) < 0 ) {
+      if( errno == EINTR )
+        continue;
+      printf("ERROR: epoll_wait failed\n");
+      break;
+    }
+    for( i=0; i<n; i++ ) {
+      index = events[i].data.u64 >> 18;
+      l = ( events[i].data.u64 >> 2 ) & 0xffff;
+      session = sessions+index;
+      if( session->state != SESSION_RUNNING )
+        continue;
+      lane = session->lanes+l;
+      switch( events[i].data.u64 & 3 ) {
+        case EV_PUMP:
+          session_pump( epfd, session, index );
+          break;
+
+        case EV_TIMER:
+          // it may have been re-armed since this event was queued
+          if( read( lane->timer, &expirations, sizeof(expirations) ) != sizeof(expirations) )
+            break;
+          if( lane->waiting == CMD_WAIT_READ )
+            session_advance( epfd, session, index, l, CommandTimeout( &lane->cmd ));
+          else
+            session_advance( epfd, session, index, l, CommandStep( &lane->cmd ));
+          break;
+
+        default:
+          if(( lane->command >= 0 )&&( lane->waiting == CMD_WAIT_READ )) {
+            session_timer( lane, -1 );
+            session_advance( epfd, session, index, l, CommandStep( &lane->cmd ));
+          }
+      }
+    }
+  }
+  for( i=0; i<num_sessions; i++ ) {
+    session = sessions+i;
+    for( l=0; l<session->num_lanes; l++ ) {
+      lane = session->lanes+l;
+      if( lane->timer >= 0 ) {
+        epoll_ctl( epfd, EPOLL_CTL_DEL, lane->cmd.tp->fd, NULL );
+        close( lane->timer );
+        lane->timer = -1;
+      }
+      if( lane->command >= 0 )
+        CommandEnd( &lane->cmd );
+    }
+    if( session->links != NULL ) {
+      epoll_ctl( epfd, EPOLL_CTL_DEL, session->cmd.tp->fd, NULL );
+      transport_unlane( session->cmd.tp, session->cmd.flag );
+      free( session->links );
+      session->links = NULL;
+    }
+    free( session->lanes );
+    session->lanes = NULL;
+    session->num_lanes = 0;
+    if( session->state != SESSION_DONE )
+      result = -1;
+  }
+  close( epfd );
+  return( result );
+}
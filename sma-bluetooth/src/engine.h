@@ -0,0 +1,55 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef H_ENGINE
+  #define H_ENGINE
+
+#include "sma_struct.h"
+#include "transport.h"
+#include "sb_commands.h"
+
+#define SESSION_RUNNING 0
+#define SESSION_DONE    1
+#define SESSION_FAILED  2
+
+/* A command of a session being run, several at once when pipelined */
+typedef struct{
+  CommandContext cmd;           /* the command being run */
+  int  command;                 /* its index in the session's list, -1 when free */
+  int  waiting;                 /* CMD_WAIT_READ or CMD_WAIT_TIME while parked */
+  int  timer;                   /* timerfd for read timeouts and pauses */
+} LaneType;
+
+/* One inverter link working through a list of sma.in commands */
+typedef struct{
+  CommandContext cmd;           /* what the commands are run with */
+  const char ** commands;       /* NULL terminated list of commands to run */
+  int  command;                 /* index of the next one to start */
+  int  state;                   /* SESSION_* */
+  int  overran;                 /* failed as conf->deadline passed */
+  int  window;                  /* commands in flight at once, 1 runs them one by one */
+  LaneType * lanes;             /* the commands in flight, while running */
+  int  num_lanes;
+  TransportType * links;        /* pipelined, the link split into a lane per command */
+} SessionType;
+
+extern void SessionInit( SessionType * session, const char ** commands, ConfType * conf, FlagType * flag, UnitType **unit, TransportType *tp, CommandFileType * cmdfile, ArchDataType **archdatalist, int *archdatalen , LiveDataType **livedatalist, int *livedatalen );
+
+extern int  RunSessions( SessionType * sessions, int num_sessions );
+
+#endif
@@ -0,0 +1,104 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * The 7D byte stuffing of the frames on the link: 7D, 7E and 11-13 are sent
+ * as 7D and the byte ^ 0x20.
+ */
+
+#include <string.h>
+#include "escape.h"
+
+/* Bytes sent as 7D and the byte ^ 0x20 */
+static const unsigned char escaped[256] = { [0x11]=1, [0x12]=1, [0x13]=1, [0x7d]=1, [0x7e]=1 };
+
+/*
+ * Escape len bytes of in into out, which has room for max, in one pass:
+ * a run without anything to escape is copied in one go.
+ * Returns the length written, or -1 if it does not fit
+ */
+int escape_frame(unsigned char *out, int max, unsigned char *in, int len)
+{
+    int i=0, run, n=0;
+
+    while( i < len ) {
+      for( run=i; ( i<len )&&( escaped[in[i]] == 0 ); i++ );
+      if( n+(i-run) > max )
+        return( -1 );
+      memcpy( out+n, in+run, i-run );
+      n += i-run;
+      if( i < len ) {
+        if( n+2 > max )
+          return( -1 );
+        out[n++] = 0x7d;
+        out[n++] = in[i++]^0x20;
+      }
+    }
+    return( n );
+}
+
+/*
+ * Strip escapes (7D) as they aren't includes in fcs, from len bytes of in
+ * into out, which has room for max.  Runs up to the next 7D are copied in
+ * one go; a 7D at the very end, with nothing after it, is dropped.
+ * Returns the length written, or -1 if it does not fit
+ */
+int unescape_frame(unsigned char *out, int max, unsigned char *in, int len)
+{
+    unsigned char *esc;
+    int i=0, run, n=0;
+
+    while( i < len ) {
+      esc = (unsigned char *)memchr( in+i, 0x7d, len-i );
+      run = ( esc != NULL ) ? esc-(in+i) : len-i;
+      if( n+run > max )
+        return( -1 );
+      memcpy( out+n, in+i, run );
+      n += run;
+      i += run;
+      if( i+1 < len ) { /*Found escape character. Need to convert*/
+        if( n+1 > max )
+          return( -1 );
+        out[n++] = in[i+1]^0x20;
+      }
+      if( i < len )
+        i += 2;
+    }
+    return( n );
+}
+
+/*
+ * Add escapes (7D) as they are required, after the 7e that starts the
+ * Data2+ packet at 18, in the frame of *len bytes cp has room for max of
+ * Returns 0, or -1 if the escaped frame would not fit
+ */
+int add_escapes(unsigned char *cp, int *len, int max)
+{
+    unsigned char out[2048];
+    int i, n;
+
+    // up to the first byte to escape the frame stays as it is
+    for( i=19; ( i<(*len) )&&( escaped[cp[i]] == 0 ); i++ );
+    if( i >= (*len) )
+      return( 0 );
+    if((( n = escape_frame( out, sizeof(out), cp+i, (*len)-i )) < 0 )||( i+n > max ))
+      return( -1 );
+    memcpy( cp+i, out, n );
+    (*len) = i+n;
+    return( 0 );
+}
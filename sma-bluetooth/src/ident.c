@@ -0,0 +1,152 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Who we were to each inverter at the last login that worked, kept in
+ * StateDir/identity: our SUSyID and serial, and per BTAddress and Transport
+ * the NetID, our address as it knows it and its devices.  With those a run
+ * logs straight in instead of going through init first, and goes through
+ * it again only if the inverter does not answer that login.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sma_struct.h"
+#include "pool.h"
+#include "ident.h"
+
+/* Transport of entry for the file, one word */
+const char * ident_transport( PoolEntryType * entry )
+{
+  return(( strlen( entry->conf.Transport ) > 0 ) ? entry->conf.Transport : "-" );
+}
+
+/* The entry of the inverter at address, reached the same way, or NULL */
+PoolEntryType * ident_entry( PoolType * pool, const char * address, const char * transport )
+{
+  int i;
+
+  for( i=0; i<pool->num_entries; i++ )
+    if(( strcmp( pool->entries[i].conf.BTAddress, address ) == 0 )&&( strcmp( ident_transport( pool->entries+i ), transport ) == 0 ))
+      return( pool->entries+i );
+  return( NULL );
+}
+
+/* The devices of entry from the rest of its line, returns how many */
+int ident_units( PoolEntryType * entry, char * devices )
+{
+  UnitType *unit;
+  unsigned int susyid[2], serial[4];
+  int i, n, num=0;
+
+  while( sscanf( devices, " %2x%2x:%2x%2x%2x%2x%n", &susyid[0], &susyid[1], &serial[0], &serial[1], &serial[2], &serial[3], &n ) == 6 ) {
+    devices += n;
+    if(( num > 0 )&&(( unit = (UnitType *)realloc( entry->unit, sizeof(UnitType)*(num+1) )) == NULL ))
+      break;
+    if( num > 0 )
+      entry->unit = unit;
+    unit = entry->unit+num;
+    memset( unit, 0, sizeof(UnitType) );
+    for( i=0; i<2; i++ )
+      unit->SUSyID[i] = susyid[i];
+    for( i=0; i<4; i++ )
+      unit->Serial[i] = serial[i];
+    sprintf( unit->SerialStr, "%llu", (unsigned long long)(( unit->Serial[0]<<24 ) + ( unit->Serial[1]<<16 ) + ( unit->Serial[2]<<8 ) + unit->Serial[3] ));
+    num++;
+  }
+  return( num );
+}
+
+/* Read StateDir/identity if there is one, after PoolInit */
+void IdentLoad( PoolType * pool )
+{
+  ConfType *conf = pool->conf;
+  PoolEntryType *entry;
+  FILE *fp;
+  char path[200];
+  char line[400];
+  char address[20], transport[80];
+  unsigned int a[6], netid;
+  int i, n, num=0;
+
+  sprintf( path, "%s/identity", conf->StateDir );
+  if(( fp = fopen( path, "r" )) == NULL )
+    return;
+  while( fgets( line, sizeof(line), fp ) != NULL ) {
+    if( line[0] == '#' )
+      continue;
+    if( sscanf( line, "client %x %x %x %x %x %x", &a[0], &a[1], &a[2], &a[3], &a[4], &a[5] ) == 6 ) {
+      // the inverters know us by these, keep them instead of new ones
+      for( i=0; i<2; i++ )
+        conf->MySUSyID[i] = a[i];
+      for( i=0; i<4; i++ )
+        conf->MySerial[i] = a[i+2];
+      continue;
+    }
+    if( sscanf( line, "%19s %79s %x %x:%x:%x:%x:%x:%x%n", address, transport, &netid, &a[0], &a[1], &a[2], &a[3], &a[4], &a[5], &n ) < 9 )
+      continue;
+    // our address is that of the link, another Transport has another
+    if(( entry = ident_entry( pool, address, transport )) == NULL )
+      continue;
+    entry->conf.NetID = netid;
+    for( i=0; i<6; i++ )
+      entry->conf.MyBTAddress[i] = a[i];
+    if(( entry->conf.num_units = ident_units( entry, line+n )) == 0 )
+      continue;
+    entry->known = 1;
+    num++;
+  }
+  fclose( fp );
+  if( pool->flag->debug == 1 ) printf("Loaded the identity for %d inverters from %s\n", num, path );
+}
+
+/* Write StateDir/identity */
+void IdentSave( PoolType * pool )
+{
+  ConfType *conf = pool->conf;
+  PoolEntryType *entry;
+  UnitType *unit;
+  FILE *fp;
+  char path[200], tmppath[210];
+  int i, u;
+
+  sprintf( path, "%s/identity", conf->StateDir );
+  sprintf( tmppath, "%s.tmp", path );
+  if(( fp = fopen( tmppath, "w" )) == NULL ) {
+    if( pool->flag->debug == 1 ) printf("Cannot write %s, not keeping the identity\n", tmppath );
+    return;
+  }
+  fprintf( fp, "# client susyid serial\n" );
+  fprintf( fp, "client %02x %02x %02x %02x %02x %02x\n", conf->MySUSyID[0], conf->MySUSyID[1], conf->MySerial[0], conf->MySerial[1], conf->MySerial[2], conf->MySerial[3] );
+  fprintf( fp, "# BTAddress Transport netid our_address devices(susyid:serial)\n" );
+  for( i=0; i<pool->num_entries; i++ ) {
+    entry = pool->entries+i;
+    if( !entry->known )
+      continue;
+    fprintf( fp, "%s %s %02x %02x:%02x:%02x:%02x:%02x:%02x", entry->conf.BTAddress, ident_transport( entry ), entry->conf.NetID, entry->conf.MyBTAddress[0], entry->conf.MyBTAddress[1], entry->conf.MyBTAddress[2], entry->conf.MyBTAddress[3], entry->conf.MyBTAddress[4], entry->conf.MyBTAddress[5] );
+    for( u=0; u<entry->conf.num_units; u++ ) {
+      unit = entry->unit+u;
+      fprintf( fp, " %02x%02x:%02x%02x%02x%02x", unit->SUSyID[0], unit->SUSyID[1], unit->Serial[0], unit->Serial[1], unit->Serial[2], unit->Serial[3] );
+    }
+    fprintf( fp, "\n" );
+  }
+  fclose( fp );
+  if( rename( tmppath, path ) < 0 )
+    printf("ERROR: Cannot update %s\n", path );
+}
@@ -0,0 +1,219 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Cache of the metadata of each device, by its serial from the login:
+ * the type label and start up time, which hardly ever change.  A metadata
+ * command whose values are all still fresh for every device of the
+ * inverter is served from the cache instead of asking the inverter, and a
+ * code once looked up in the XML is not looked up again.  Labels are kept
+ * MetadataTTL hours and times until the end of the day they were read.
+ * Another SUSyID from the login, or a label that reads differently, voids
+ * what was kept for the device.  The cache is kept in StateDir/metadata.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sma_struct.h"
+#include "sched.h"
+#include "meta.h"
+
+extern int sched_class( const char * command );
+
+/* Is meta what command read for the device unit */
+int MetaMatch( MetaType * meta, UnitType * unit, const char * command )
+{
+  return(( strcmp( meta->serial, unit->SerialStr ) == 0 )&&( strcmp( meta->command, command ) == 0 ));
+}
+
+MetaType * meta_find( MetaCacheType * cache, UnitType * unit, const char * command, unsigned char key1, unsigned char key2 )
+{
+  int i;
+
+  for( i=0; i<cache->num; i++ )
+    if( MetaMatch( cache->list+i, unit, command )&&( cache->list[i].key1 == key1 )&&( cache->list[i].key2 == key2 ))
+      return( cache->list+i );
+  return( NULL );
+}
+
+/* Local midnight after t */
+time_t meta_midnight( time_t t )
+{
+  struct tm tm;
+
+  localtime_r( &t, &tm );
+  tm.tm_mday++;
+  tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+  tm.tm_isdst = -1;
+  return( mktime( &tm ));
+}
+
+/* Read StateDir/metadata if there is one */
+void MetaLoad( ConfType * conf, FlagType * flag )
+{
+  FILE *fp;
+  char path[200];
+  char line[400];
+  MetaType tmp, *list;
+  unsigned int susyid[2], key[2];
+  long date, expires;
+  int n;
+
+  if(( conf->metacache = (MetaCacheType *)calloc( 1, sizeof(MetaCacheType) )) == NULL ) {
+    printf("ERROR: Out of memory\n" );
+    return;
+  }
+  sprintf( path, "%s/metadata", conf->StateDir );
+  if(( conf->metadata_ttl <= 0 )||(( fp = fopen( path, "r" )) == NULL ))
+    return;
+  while( fgets( line, sizeof(line), fp ) != NULL ) {
+    if( line[0] == '#' )
+      continue;
+    memset( &tmp, 0, sizeof(tmp) );
+    // the value is the rest of the line and may have spaces
+    if( sscanf( line, "%19s %x %x %39s %x %x %ld %ld %d %n", tmp.serial, &susyid[0], &susyid[1], tmp.command, &key[0], &key[1], &date, &expires, &tmp.index, &n ) < 9 )
+      continue;
+    tmp.SUSyID[0] = susyid[0];
+    tmp.SUSyID[1] = susyid[1];
+    tmp.key1 = key[0];
+    tmp.key2 = key[1];
+    tmp.date = date;
+    tmp.expires = expires;
+    strncpy( tmp.value, line+n, sizeof(tmp.value)-1 );
+    tmp.value[strcspn( tmp.value, "\n" )] = '\0';
+    if(( list = (MetaType *)realloc( conf->metacache->list, sizeof(MetaType)*(conf->metacache->num+1))) == NULL )
+      break;
+    conf->metacache->list = list;
+    list[conf->metacache->num++] = tmp;
+  }
+  fclose( fp );
+  if( flag->debug == 1 ) printf("Loaded %d metadata values from %s\n", conf->metacache->num, path );
+}
+
+/* Write StateDir/metadata */
+void MetaSave( ConfType * conf, FlagType * flag )
+{
+  MetaType *meta;
+  FILE *fp;
+  char path[200], tmppath[210];
+  int i;
+
+  if(( conf->metacache == NULL )||( conf->metacache->num == 0 )||( conf->metadata_ttl <= 0 ))
+    return;
+  sprintf( path, "%s/metadata", conf->StateDir );
+  sprintf( tmppath, "%s.tmp", path );
+  if(( fp = fopen( tmppath, "w" )) == NULL ) {
+    if( flag->debug == 1 ) printf("Cannot write %s, not keeping the metadata\n", tmppath );
+    return;
+  }
+  fprintf( fp, "# serial susyid command key date expires xml_code value\n" );
+  for( i=0; i<conf->metacache->num; i++ ) {
+    meta = conf->metacache->list+i;
+    fprintf( fp, "%s %02x %02x %s %02x %02x %ld %ld %d %s\n", meta->serial, meta->SUSyID[0], meta->SUSyID[1], meta->command, meta->key1, meta->key2, (long)meta->date, (long)meta->expires, meta->index, meta->value );
+  }
+  fclose( fp );
+  if( rename( tmppath, path ) < 0 )
+    printf("ERROR: Cannot update %s\n", path );
+}
+
+/*
+ * Can command be served from the cache for the device unit: it read values
+ * for it before, all of them still fresh and for the same SUSyID.
+ * Returns how many, 0 if the command has to run
+ */
+int MetaFresh( ConfType * conf, UnitType * unit, const char * command )
+{
+  MetaCacheType *cache = conf->metacache;
+  time_t now = time(NULL);
+  int i, n=0;
+
+  if(( cache == NULL )||( conf->metadata_ttl <= 0 ))
+    return( 0 );
+  for( i=0; i<cache->num; i++ ) {
+    if( !MetaMatch( cache->list+i, unit, command ))
+      continue;
+    if(( cache->list[i].expires <= now )||( memcmp( cache->list[i].SUSyID, unit->SUSyID, 2 ) != 0 ))
+      return( 0 );
+    n++;
+  }
+  return( n );
+}
+
+/*
+ * Keep a value a metadata command read for the device unit.  Labels (XML
+ * codes and strings) are kept MetadataTTL hours, times for the day; a
+ * value of another kind, or NULL, means the command always runs
+ */
+void MetaPut( ConfType * conf, UnitType * unit, const char * command, unsigned char key1, unsigned char key2, time_t date, int decimal, int index, const char * value )
+{
+  MetaCacheType *cache = conf->metacache;
+  MetaType *meta, *list;
+  time_t now = time(NULL);
+  int i;
+
+  if(( cache == NULL )||( conf->metadata_ttl <= 0 )||( sched_class( command ) != SCHED_META )||( unit->SerialStr[0] == '\0' ))
+    return;
+  if(( meta = meta_find( cache, unit, command, key1, key2 )) == NULL ) {
+    if(( list = (MetaType *)realloc( cache->list, sizeof(MetaType)*(cache->num+1))) == NULL )
+      return;
+    cache->list = list;
+    meta = list+cache->num++;
+    memset( meta, 0, sizeof(MetaType) );
+    strcpy( meta->serial, unit->SerialStr );
+    strncpy( meta->command, command, sizeof(meta->command)-1 );
+    meta->key1 = key1;
+    meta->key2 = key2;
+  } else if(( decimal != 97 )&&( value != NULL )&&( strcmp( meta->value, value ) != 0 )) {
+    // the device is not what it was, read the rest of it again too
+    for( i=0; i<cache->num; i++ )
+      if( strcmp( cache->list[i].serial, unit->SerialStr ) == 0 )
+        cache->list[i].expires = 0;
+  }
+  memcpy( meta->SUSyID, unit->SUSyID, 2 );
+  meta->date = date;
+  meta->index = index;
+  strncpy( meta->value, ( value != NULL ) ? value : "", sizeof(meta->value)-1 );
+  if(( value == NULL )||( decimal < 97 ))
+    meta->expires = 0;
+  else if( decimal == 97 )
+    meta->expires = meta_midnight( now );
+  else
+    meta->expires = now + conf->metadata_ttl * 3600L;
+}
+
+/* The label an XML code of key was looked up as before, NULL if not yet */
+const char * MetaCode( ConfType * conf, unsigned char key1, unsigned char key2, int index )
+{
+  MetaCacheType *cache = conf->metacache;
+  int i;
+
+  for( i=0; ( cache != NULL )&&( i<cache->num ); i++ )
+    if(( cache->list[i].key1 == key1 )&&( cache->list[i].key2 == key2 )&&( cache->list[i].index == index )&&( cache->list[i].value[0] != '\0' ))
+      return( cache->list[i].value );
+  return( NULL );
+}
+
+void MetaFree( ConfType * conf )
+{
+  if( conf->metacache != NULL )
+    free( conf->metacache->list );
+  free( conf->metacache );
+  conf->metacache = NULL;
+}
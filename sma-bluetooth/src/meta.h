@@ -0,0 +1,32 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef H_META
+  #define H_META
+
+#include "sma_struct.h"
+
+extern void MetaLoad( ConfType * conf, FlagType * flag );
+extern void MetaSave( ConfType * conf, FlagType * flag );
+extern int  MetaFresh( ConfType * conf, UnitType * unit, const char * command );
+extern int  MetaMatch( MetaType * meta, UnitType * unit, const char * command );
+extern void MetaPut( ConfType * conf, UnitType * unit, const char * command, unsigned char key1, unsigned char key2, time_t date, int decimal, int index, const char * value );
+extern const char * MetaCode( ConfType * conf, unsigned char key1, unsigned char key2, int index );
+extern void MetaFree( ConfType * conf );
+
+#endif
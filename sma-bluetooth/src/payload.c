@@ -0,0 +1,153 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * The payload of a reply that takes several frames, e.g. the records of a
+ * $DATA or $ARCHIVEDATA1 range.  Each frame is unescaped once by
+ * read_bluetooth into a slot of its own and the payload is the list of the
+ * data parts of those frames, so it can be as long as the inverter likes
+ * without being copied together.  Records are read in place, only one cut
+ * in two by a frame boundary is put together in record.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "transport.h"
+#include "payload.h"
+
+void PayloadInit( PayloadType * pl )
+{
+  memset( pl, 0, sizeof(PayloadType) );
+}
+
+void PayloadFree( PayloadType * pl )
+{
+  free( pl->frames );
+  free( pl->segs );
+  PayloadInit( pl );
+}
+
+/* Start a new reply, first is the frame it began with, the slots are reused */
+void PayloadStart( PayloadType * pl, unsigned char * first )
+{
+  pl->first = first;
+  pl->num_frames = 0;
+  pl->num_segs = 0;
+  pl->len = 0;
+  pl->seg = 0;
+}
+
+/*
+ * Slot to read the next frame of the reply into, doubling the slots when
+ * they run out.  NULL if out of memory
+ */
+unsigned char * PayloadFrame( PayloadType * pl )
+{
+  unsigned char * frames;
+  PayloadSegType * segs;
+  int max;
+
+  if( pl->num_frames == pl->max_frames ) {
+    max = ( pl->max_frames > 0 ) ? pl->max_frames*2 : 4;
+    if(( frames = (unsigned char *)realloc( pl->frames, (size_t)max*RXMAXFRAME )) == NULL )
+      return( NULL );
+    pl->frames = frames;
+    if(( segs = (PayloadSegType *)realloc( pl->segs, sizeof(PayloadSegType)*(max+1) )) == NULL )
+      return( NULL );
+    pl->segs = segs;
+    pl->max_frames = max;
+  }
+  return( pl->frames + (size_t)RXMAXFRAME*(pl->num_frames++) );
+}
+
+/* Bytes start up to end of the frame read last are payload, -1 if out of memory */
+int PayloadAdd( PayloadType * pl, int start, int end )
+{
+  PayloadSegType * seg;
+
+  if( end <= start )
+    return( 0 );
+  if( pl->segs == NULL ) {
+    // the first frame came on its own, nothing to grow yet
+    if(( pl->segs = (PayloadSegType *)malloc( sizeof(PayloadSegType) )) == NULL )
+      return( -1 );
+  }
+  seg = pl->segs + pl->num_segs++;
+  seg->slot = pl->num_frames-1;
+  seg->start = start;
+  seg->len = end-start;
+  seg->offset = pl->len;
+  pl->len += seg->len;
+  return( 0 );
+}
+
+static unsigned char * payload_bytes( PayloadType * pl, PayloadSegType * seg )
+{
+  if( seg->slot < 0 )
+    return( pl->first + seg->start );
+  return( pl->frames + (size_t)RXMAXFRAME*seg->slot + seg->start );
+}
+
+/*
+ * The len bytes of payload at offset, where they lie if they are in one
+ * frame, otherwise put together in pl->record.  Bytes past the end of the
+ * payload read as 0.  Going through the records in order finds each
+ * segment without a search
+ */
+unsigned char * PayloadRecord( PayloadType * pl, int offset, int len )
+{
+  PayloadSegType * seg;
+  int s, n, done;
+
+  if( len > PAYLOAD_RECORD )
+    len = PAYLOAD_RECORD;
+  s = pl->seg;
+  if(( s >= pl->num_segs )||( pl->segs[s].offset > offset ))
+    s = 0;
+  while(( s < pl->num_segs )&&( offset >= pl->segs[s].offset+pl->segs[s].len ))
+    s++;
+  if( s >= pl->num_segs ) {
+    memset( pl->record, 0, sizeof(pl->record) );
+    return( pl->record );
+  }
+  pl->seg = s;
+  seg = pl->segs+s;
+  if( offset+len <= seg->offset+seg->len )
+    return( payload_bytes( pl, seg ) + offset-seg->offset );
+  memset( pl->record, 0, sizeof(pl->record) );
+  for( done=0; ( done < len )&&( s < pl->num_segs ); s++ ) {
+    seg = pl->segs+s;
+    n = seg->offset+seg->len-(offset+done);
+    if( n > len-done )
+      n = len-done;
+    memcpy( pl->record+done, payload_bytes( pl, seg ) + offset+done-seg->offset, n );
+    done += n;
+  }
+  return( pl->record );
+}
+
+/*
+ * Leave the last frame of the reply in received, as if it had been read
+ * there, for a command that extracts without reading a reply of its own
+ */
+void PayloadLast( PayloadType * pl, unsigned char * received, int rr )
+{
+  if(( pl->num_frames > 0 )&&( rr > 0 )&&( rr <= RXMAXFRAME ))
+    memcpy( received, pl->frames + (size_t)RXMAXFRAME*(pl->num_frames-1), rr );
+}
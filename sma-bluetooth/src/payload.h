@@ -0,0 +1,55 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef H_PAYLOAD
+  #define H_PAYLOAD
+
+#define PAYLOAD_FIRST   59      /* data starts here in the first frame of a reply */
+#define PAYLOAD_NEXT    18      /* and here in the frames after it */
+#define PAYLOAD_RECORD  64      /* longest record PayloadRecord hands out */
+
+/* The part of one frame that is payload */
+typedef struct{
+  int  slot;                    /* frame in frames, -1 for the first one */
+  int  start;                   /* first payload byte in the frame */
+  int  len;                     /* payload bytes in the frame */
+  int  offset;                  /* of the first of them in the payload */
+} PayloadSegType;
+
+/* A reply spread over several frames, read where the frames were unescaped */
+typedef struct{
+  unsigned char * first;        /* the first frame, in the caller's received */
+  unsigned char * frames;       /* the frames after it, RXMAXFRAME apart */
+  int  num_frames;
+  int  max_frames;              /* room in frames, segs has one more */
+  PayloadSegType * segs;
+  int  num_segs;
+  int  len;                     /* payload bytes in all segments */
+  int  seg;                     /* segment the last record started in */
+  unsigned char record[PAYLOAD_RECORD+1]; /* a record cut by a frame boundary, put together */
+} PayloadType;
+
+extern void PayloadInit( PayloadType * pl );
+extern void PayloadFree( PayloadType * pl );
+extern void PayloadStart( PayloadType * pl, unsigned char * first );
+extern unsigned char * PayloadFrame( PayloadType * pl );
+extern int PayloadAdd( PayloadType * pl, int start, int end );
+extern unsigned char * PayloadRecord( PayloadType * pl, int offset, int len );
+extern void PayloadLast( PayloadType * pl, unsigned char * received, int rr );
+
+#endif
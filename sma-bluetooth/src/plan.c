@@ -0,0 +1,362 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Query planner.  Most live values are read by sma.in commands that differ
+ * only in the LRI range their S line asks for, e.g. getacvoltage and
+ * getgridfreq.  Commands whose ranges lie at most MergeGap LRIs apart and
+ * whose first keys have the same record layout in the unit conversions
+ * table are read with one made up request for the span of their ranges,
+ * if they have the same Schedule.
+ * Records of the reply outside those ranges are dropped by $DATA, so what
+ * is stored is what the commands would have stored one by one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "sma_struct.h"
+#include "sched.h"
+#include "plan.h"
+
+extern int GetLine( const char * command, CommandFileType * cmdfile );
+extern int sched_class( const char * command );
+
+/* A command of the poll that reads one LRI range with $DATA */
+typedef struct{
+  const char * command;
+  int  order;                   /* in the commands of the poll */
+  char * lines[3];              /* its S, R and E lines */
+  char * shape;                 /* the three with the range left out, equal for commands that can merge */
+  int  range;                   /* token of the S line the range starts at */
+  unsigned int first;           /* LRI range, key2<<8 | key1 */
+  unsigned int last;
+  int  recordgap;               /* of the first key, $DATA reads every record with it */
+  int  datalength;
+  int  interval;                /* its Schedule, only commands read as often merge */
+  int  plan;                    /* merged request it is read with, -1 for none, -2 once in the poll */
+} PlanCandType;
+
+/* Split a copy of line in buf into at most max tokens */
+static int plan_tokens( const char * line, char * buf, size_t size, char ** tokens, int max )
+{
+  char *token, *saveptr;
+  int n=0;
+
+  strncpy( buf, line, size-1 );
+  buf[size-1] = '\0';
+  for( token = strtok_r( buf, " \t\r\n", &saveptr ); token != NULL; token = strtok_r( NULL, " \t\r\n", &saveptr )) {
+    if( n == max )
+      return( -1 );
+    tokens[n++] = token;
+  }
+  return( n );
+}
+
+/* Append token to shape, bytes in lower case so 1E and 1e are the same */
+static void plan_shape( char * shape, size_t size, const char * token )
+{
+  size_t len = strlen( shape );
+  int i;
+
+  if( len+strlen( token )+2 > size )
+    return;
+  for( i=0; token[i] != '\0'; i++ )
+    shape[len++] = ( strlen( token ) == 2 ) ? tolower( token[i] ) : token[i];
+  shape[len++] = ' ';
+  shape[len] = '\0';
+}
+
+static ReturnType * plan_key( ConfType * conf, unsigned int lri )
+{
+  int i;
+
+  for( i=0; i<conf->num_return_keys; i++ )
+    if(( conf->returnkeylist[i].key1 == ( lri & 0xff ))&&( conf->returnkeylist[i].key2 == ( lri >> 8 )))
+      return( conf->returnkeylist+i );
+  return( NULL );
+}
+
+/*
+ * Is command an S, R and E $DATA line asking for one range, i.e. an S line
+ * ending "80 00 02 xx cc 00 k1 k2 00 FF k1 k2 00 $CRC", with its first key
+ * in the unit conversions.  Fills in cand, returns 0 if so
+ */
+static int plan_parse( ConfType * conf, CommandFileType * cmdfile, const char * command, PlanCandType * cand )
+{
+  char buf[1024];
+  char *tokens[PLAN_MAX_TOKENS];
+  char shape[3072];
+  ReturnType *key;
+  int linenum, n=0, num, i, c, l;
+
+  if(( sched_class( command ) != SCHED_LIVE )||(( linenum = GetLine( command, cmdfile )) == 0 ))
+    return( -1 );
+  for( ; ( linenum < cmdfile->num_lines )&&( cmdfile->lines[linenum][0] != ':' ); linenum++ ) {
+    if(( cmdfile->lines[linenum][0] == '#' )||( strspn( cmdfile->lines[linenum], " \t\r\n" ) == strlen( cmdfile->lines[linenum] )))
+      continue;
+    if( n == 3 )
+      return( -1 );
+    cand->lines[n++] = cmdfile->lines[linenum];
+  }
+  if(( n != 3 )||( strncmp( cand->lines[0], "S ", 2 ) != 0 )||( strncmp( cand->lines[1], "R ", 2 ) != 0 ))
+    return( -1 );
+  if(( plan_tokens( cand->lines[2], buf, sizeof(buf), tokens, PLAN_MAX_TOKENS ) != 3 )||( strcmp( tokens[1], "$DATA" ) != 0 )||( strncmp( tokens[2], "$END", 4 ) != 0 ))
+    return( -1 );
+  if(( num = plan_tokens( cand->lines[0], buf, sizeof(buf), tokens, PLAN_MAX_TOKENS )) < 0 )
+    return( -1 );
+  for( c=0; ( c < num )&&( strcmp( tokens[c], "$CRC" ) != 0 ); c++ );
+  if(( c == num )||( c < 14 ))
+    return( -1 );
+  if(( strcmp( tokens[c-13], "80" ) != 0 )||( strcmp( tokens[c-12], "00" ) != 0 )||( strcmp( tokens[c-11], "02" ) != 0 )
+   ||( strcmp( tokens[c-8], "00" ) != 0 )||( strcmp( tokens[c-5], "00" ) != 0 )||( strcasecmp( tokens[c-4], "ff" ) != 0 )||( strcmp( tokens[c-1], "00" ) != 0 ))
+    return( -1 );
+  cand->range = c-7;
+  cand->first = ( strtoul( tokens[c-6], NULL, 16 ) << 8 ) | strtoul( tokens[c-7], NULL, 16 );
+  cand->last = ( strtoul( tokens[c-2], NULL, 16 ) << 8 ) | strtoul( tokens[c-3], NULL, 16 );
+  if(( cand->last < cand->first )||(( key = plan_key( conf, cand->first )) == NULL )||( key->recordgap <= 0 ))
+    return( -1 );
+  cand->recordgap = key->recordgap;
+  cand->datalength = key->datalength;
+  shape[0] = '\0';
+  for( i=0; i<num; i++ )
+    plan_shape( shape, sizeof(shape), (( i == c-7 )||( i == c-6 )||( i == c-3 )||( i == c-2 )) ? "*" : tokens[i] );
+  for( l=1; l<3; l++ ) {
+    num = plan_tokens( cand->lines[l], buf, sizeof(buf), tokens, PLAN_MAX_TOKENS );
+    for( i=0; i<num; i++ )
+      plan_shape( shape, sizeof(shape), tokens[i] );
+  }
+  if(( cand->shape = strdup( shape )) == NULL )
+    return( -1 );
+  cand->command = command;
+  cand->interval = SchedInterval( conf, command );
+  cand->plan = -1;
+  return( 0 );
+}
+
+/*
+ * A capture replays the requests it was made with, never merge while making
+ * one or playing one back
+ */
+static int plan_replay( ConfType * conf )
+{
+  int i;
+
+  if( strlen( conf->Capture ) > 0 )
+    return( 1 );
+  if( strncmp( conf->Transport, "replay:", 7 ) == 0 )
+    return( 1 );
+  for( i=0; i<conf->num_inverters; i++ )
+    if( strncmp( conf->inverterlist[i].Transport, "replay:", 7 ) == 0 )
+      return( 1 );
+  return( 0 );
+}
+
+/* Commands that can merge next to each other, by range */
+static int plan_compare( const void * a, const void * b )
+{
+  const PlanCandType *x = a, *y = b;
+  int diff;
+
+  if(( diff = strcmp( x->shape, y->shape )) != 0 )
+    return( diff );
+  if( x->recordgap != y->recordgap )
+    return( x->recordgap - y->recordgap );
+  if( x->datalength != y->datalength )
+    return( x->datalength - y->datalength );
+  if( x->interval != y->interval )
+    return( x->interval - y->interval );
+  return(( x->first > y->first ) - ( x->first < y->first ));
+}
+
+static int plan_line( CommandFileType * cmdfile, char * line )
+{
+  char **lines;
+
+  if( line == NULL )
+    return( -1 );
+  if(( lines = (char **)realloc( cmdfile->lines, sizeof(char *)*(cmdfile->num_lines+1))) == NULL ) {
+    free( line );
+    return( -1 );
+  }
+  cmdfile->lines = lines;
+  cmdfile->lines[cmdfile->num_lines++] = line;
+  return( 0 );
+}
+
+/*
+ * Add a request reading the ranges of the num commands in cands, sorted by
+ * range, to cmdfile: the S line of the first with the span of all of them,
+ * its R and E lines.  It is named after the one that comes first in the poll
+ */
+static int plan_add( FlagType * flag, CommandFileType * cmdfile, PlanCandType * cands, int num )
+{
+  char buf[1024];
+  char line[1024];
+  char *tokens[PLAN_MAX_TOKENS];
+  char bytes[4][3];
+  PlanType *plans, *plan;
+  int n, i, earliest=0;
+
+  if(( plans = (PlanType *)realloc( cmdfile->plans, sizeof(PlanType)*(cmdfile->num_plans+1))) == NULL )
+    return( -1 );
+  cmdfile->plans = plans;
+  plan = plans+cmdfile->num_plans;
+  if(( plan->ranges = (PlanRangeType *)malloc( sizeof(PlanRangeType)*num )) == NULL )
+    return( -1 );
+  plan->num_ranges = num;
+  plan->interval = cands[0].interval;
+  for( i=0; i<num; i++ ) {
+    plan->ranges[i].first = cands[i].first;
+    plan->ranges[i].last = cands[i].last;
+    cands[i].plan = cmdfile->num_plans;
+    if( cands[i].order < cands[earliest].order )
+      earliest = i;
+  }
+  cmdfile->num_plans++;
+  snprintf( plan->command, sizeof(plan->command), "%s+%d", cands[earliest].command, num-1 );
+
+  n = plan_tokens( cands[0].lines[0], buf, sizeof(buf), tokens, PLAN_MAX_TOKENS );
+  sprintf( bytes[0], "%02x", cands[0].first & 0xff );
+  sprintf( bytes[1], "%02x", ( cands[0].first >> 8 ) & 0xff );
+  sprintf( bytes[2], "%02x", cands[num-1].last & 0xff );
+  sprintf( bytes[3], "%02x", ( cands[num-1].last >> 8 ) & 0xff );
+  tokens[cands[0].range] = bytes[0];
+  tokens[cands[0].range+1] = bytes[1];
+  tokens[cands[0].range+4] = bytes[2];
+  tokens[cands[0].range+5] = bytes[3];
+  line[0] = '\0';
+  for( i=0; i<n; i++ ) {
+    strcat( line, tokens[i] );
+    strcat( line, ( i < n-1 ) ? " " : "\n" );
+  }
+  snprintf( buf, sizeof(buf), ":%s %%END\n", plan->command );
+  if(( plan_line( cmdfile, strdup( buf )) < 0 )||( plan_line( cmdfile, strdup( line )) < 0 )
+   ||( plan_line( cmdfile, strdup( cands[0].lines[1] )) < 0 )||( plan_line( cmdfile, strdup( cands[0].lines[2] )) < 0 ))
+    return( -1 );
+  if( flag->verbose == 1 ) {
+    printf( "Reading" );
+    for( i=0; i<num; i++ )
+      printf( " %s", cands[i].command );
+    printf( " with one request %s for LRI %04x-%04x\n", plan->command, cands[0].first, cands[num-1].last );
+  }
+  return( 0 );
+}
+
+/*
+ * Plan the commands of a poll: merge what can be read with one request and
+ * return the commands to run, kept in cmdfile->commands.  NULL if out of
+ * memory
+ */
+const char ** PlanCommands( ConfType * conf, FlagType * flag, CommandFileType * cmdfile, const char ** commands )
+{
+  PlanCandType *cands;
+  const char **planned;
+  int num_commands, num=0, i, j, k, l;
+  unsigned int last;
+
+  for( num_commands=0; commands[num_commands] != NULL; num_commands++ );
+  if(( cands = (PlanCandType *)malloc( sizeof(PlanCandType)*(num_commands+1))) == NULL )
+    return( NULL );
+  if(( planned = (const char **)malloc( sizeof(const char *)*(num_commands+1))) == NULL ) {
+    free( cands );
+    return( NULL );
+  }
+  if(( conf->merge_gap > 0 )&&( plan_replay( conf ) == 0 )) {
+    for( i=0; i<num_commands; i++ ) {
+      cands[num].order = i;
+      if( plan_parse( conf, cmdfile, commands[i], cands+num ) == 0 )
+        num++;
+    }
+    qsort( cands, num, sizeof(PlanCandType), plan_compare );
+    for( i=0; i<num; i=j ) {
+      last = cands[i].last;
+      for( j=i+1; j<num; j++ ) {
+        if(( strcmp( cands[j].shape, cands[i].shape ) != 0 )||( cands[j].recordgap != cands[i].recordgap )||( cands[j].datalength != cands[i].datalength )||( cands[j].interval != cands[i].interval ))
+          break;
+        // never read a range twice, or so much the reply no longer fits
+        if(( cands[j].first <= last )||( cands[j].first-last > conf->merge_gap ))
+          break;
+        if(( cands[j].last-cands[i].first+1 )*cands[i].recordgap > PLAN_MAX_PAYLOAD )
+          break;
+        last = cands[j].last;
+      }
+      if(( j-i > 1 )&&( plan_add( flag, cmdfile, cands+i, j-i ) < 0 )) {
+        printf( "ERROR: Out of memory\n" );
+        num = 0;
+        break;
+      }
+    }
+  }
+  // each merged request where the first of its commands was
+  for( i=0, k=0; i<num_commands; i++ ) {
+    for( j=0; ( j<num )&&( cands[j].order != i ); j++ );
+    if(( j == num )||( cands[j].plan == -1 ))
+      planned[k++] = commands[i];
+    else if( cands[j].plan >= 0 ) {
+      planned[k++] = cmdfile->plans[cands[j].plan].command;
+      for( l=0; l<num; l++ )
+        if( cands[l].plan == cands[j].plan )
+          cands[l].plan = -2;
+    }
+  }
+  planned[k] = NULL;
+  for( i=0; i<num; i++ )
+    free( cands[i].shape );
+  free( cands );
+  cmdfile->commands = planned;
+  return( planned );
+}
+
+/* The merged request named command, NULL for an sma.in command */
+PlanType * PlanFind( CommandFileType * cmdfile, const char * command )
+{
+  int i;
+
+  for( i=0; i<cmdfile->num_plans; i++ )
+    if( strcmp( cmdfile->plans[i].command, command ) == 0 )
+      return( cmdfile->plans+i );
+  return( NULL );
+}
+
+/* Does one of the commands of plan read the record with this key */
+int PlanKeep( PlanType * plan, unsigned char key1, unsigned char key2 )
+{
+  unsigned int lri = ( key2 << 8 ) | key1;
+  int i;
+
+  for( i=0; i<plan->num_ranges; i++ )
+    if(( lri >= plan->ranges[i].first )&&( lri <= plan->ranges[i].last ))
+      return( 1 );
+  return( 0 );
+}
+
+void PlanFree( CommandFileType * cmdfile )
+{
+  int i;
+
+  for( i=0; i<cmdfile->num_plans; i++ )
+    free( cmdfile->plans[i].ranges );
+  free( cmdfile->plans );
+  cmdfile->plans = NULL;
+  cmdfile->num_plans = 0;
+  free( cmdfile->commands );
+  cmdfile->commands = NULL;
+}
@@ -0,0 +1,32 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef H_PLAN
+  #define H_PLAN
+
+#include "sma_struct.h"
+
+#define PLAN_MAX_TOKENS  128    /* in an S line */
+#define PLAN_MAX_PAYLOAD 980    /* bytes of records a merged reply may come to, one Data2+ packet */
+
+extern const char ** PlanCommands( ConfType * conf, FlagType * flag, CommandFileType * cmdfile, const char ** commands );
+extern PlanType * PlanFind( CommandFileType * cmdfile, const char * command );
+extern int PlanKeep( PlanType * plan, unsigned char key1, unsigned char key2 );
+extern void PlanFree( CommandFileType * cmdfile );
+
+#endif
@@ -0,0 +1,350 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Connection pool for plants with more inverters than the Bluetooth
+ * adapter holds links.  Each inverter keeps its own copy of the settings
+ * (BTAddress, Transport and what init and login learn: NetID, our address,
+ * its devices) and stays connected and logged in between polls until
+ * PoolSize others are and it is the one used longest ago.  Once that is
+ * known (see ident.c) it logs straight in again, without init.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sma_struct.h"
+#include "transport.h"
+#include "sb_commands.h"
+#include "engine.h"
+#include "rtt.h"
+#include "pool.h"
+
+/*
+ * Bring the entry's settings up to date with the shared ones (date range,
+ * round trip times ...), keeping what belongs to this inverter
+ */
+void pool_enter( PoolType * pool, PoolEntryType * entry )
+{
+  ConfType own = entry->conf;
+
+  entry->conf = *pool->conf;
+  strcpy( entry->conf.BTAddress, own.BTAddress );
+  strcpy( entry->conf.Transport, own.Transport );
+  strcpy( entry->conf.Password, own.Password );
+  memcpy( entry->conf.MyBTAddress, own.MyBTAddress, sizeof(own.MyBTAddress) );
+  entry->conf.NetID = own.NetID;
+  entry->conf.num_units = own.num_units;
+  entry->conf.retransmits = 0;
+}
+
+/* Hand back what the commands learnt for everyone */
+void pool_leave( PoolType * pool, PoolEntryType * entry )
+{
+  pool->conf->rttlist = entry->conf.rttlist;
+  pool->conf->num_rtt = entry->conf.num_rtt;
+  pool->conf->retransmits += entry->conf.retransmits;
+  entry->conf.retransmits = 0;
+}
+
+/* The link is gone or logged off */
+void pool_disconnect( PoolType * pool, PoolEntryType * entry )
+{
+  transport_close( &entry->tp );
+  entry->connected = 0;
+  pool->open--;
+}
+
+/*
+ * One entry per Inverter line, or just BTAddress/Transport without any.
+ * Returns 0 on success and -1 on error
+ */
+int PoolInit( PoolType * pool, ConfType * conf, FlagType * flag, CommandFileType * cmdfile, const char ** login, const char ** relogin, const char ** logoff )
+{
+  PoolEntryType *entry;
+  int i;
+
+  memset( pool, 0, sizeof(PoolType) );
+  pool->conf = conf;
+  pool->flag = flag;
+  pool->cmdfile = cmdfile;
+  pool->login = login;
+  pool->relogin = relogin;
+  pool->logoff = logoff;
+  pool->num_entries = ( conf->num_inverters > 0 ) ? conf->num_inverters : 1;
+  if(( pool->entries = (PoolEntryType *)calloc( pool->num_entries, sizeof(PoolEntryType) )) == NULL ) {
+    printf("ERROR: Out of memory\n" );
+    return( -1 );
+  }
+  for( i=0; i<pool->num_entries; i++ ) {
+    entry = pool->entries+i;
+    entry->conf = *conf;
+    if( conf->num_inverters > 0 ) {
+      strcpy( entry->conf.BTAddress, conf->inverterlist[i].BTAddress );
+      if( strlen( conf->inverterlist[i].Transport ) > 0 )
+        strcpy( entry->conf.Transport, conf->inverterlist[i].Transport );
+      if( strlen( conf->inverterlist[i].Password ) > 0 )
+        strcpy( entry->conf.Password, conf->inverterlist[i].Password );
+    }
+    entry->conf.num_units = 0;
+    if(( entry->unit = (UnitType *)calloc( 1, sizeof(UnitType) )) == NULL ) {
+      printf("ERROR: Out of memory\n" );
+      return( -1 );
+    }
+    entry->unit->SUSyID[0] = 0xFF;
+    entry->unit->SUSyID[1] = 0xFF;
+    entry->tp.fd = -1;
+  }
+  return( 0 );
+}
+
+/*
+ * The least recently used connected inverter not in use, or NULL
+ */
+PoolEntryType * pool_lru( PoolType * pool )
+{
+  PoolEntryType *entry, *lru=NULL;
+  int i;
+
+  for( i=0; i<pool->num_entries; i++ ) {
+    entry = pool->entries+i;
+    if(( !entry->busy )&&( entry->connected )&&(( lru == NULL )||( entry->last_used < lru->last_used )))
+      lru = entry;
+  }
+  return( lru );
+}
+
+/* Log off and disconnect an inverter that is connected */
+int pool_logoff( PoolType * pool, PoolEntryType * entry, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen )
+{
+  int result;
+
+  pool_enter( pool, entry );
+  result = InverterCommands( pool->logoff, &entry->conf, pool->flag, &entry->unit, &entry->tp, pool->cmdfile, archdatalist, archdatalen, livedatalist, livedatalen );
+  pool_leave( pool, entry );
+  pool_disconnect( pool, entry );
+  return( result );
+}
+
+/* A capture replays the requests it was made with, so always through init */
+int pool_direct( PoolType * pool, PoolEntryType * entry )
+{
+  return(( entry->known )&&( strlen( pool->conf->Capture ) == 0 )&&( strncmp( entry->conf.Transport, "replay:", 7 ) != 0 ));
+}
+
+/*
+ * Connect and log in all at once those of entries that are not yet, an
+ * inverter whose identity is known from the last session without init.
+ * One that does not answer such a login is disconnected and its retry set,
+ * to go through init next time; one that cannot be reached is set to NULL.
+ * Returns how many were logged in
+ */
+int pool_connect( PoolType * pool, PoolEntryType ** entries, int num, int * retry, TransportType ** tps, SessionType * sessions, int * slot, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen )
+{
+  PoolEntryType *entry;
+  FlagType *flag = pool->flag;
+  int i, n, ready=0;
+
+  for( n=0, i=0; i<num; i++ ) {
+    slot[i] = -1;
+    if(( entry = entries[i] ) == NULL || entry->connected )
+      continue;
+    if (flag->verbose == 1) printf("Connecting to inverter address %s\n", entry->conf.BTAddress );
+    if( transport_init( &entry->tp, &entry->conf, flag ) < 0 ) {
+      printf("ERROR: Cannot connect to socket\n");
+      entries[i] = NULL;
+      continue;
+    }
+    tps[n++] = &entry->tp;
+  }
+  if( n == 0 )
+    return( 0 );
+  transport_connect( tps, n, flag );
+  for( n=0, i=0; i<num; i++ ) {
+    if(( entry = entries[i] ) == NULL || entry->connected )
+      continue;
+    if( entry->tp.fd < 0 ) {
+      printf("ERROR: Cannot connect to socket\n");
+      entries[i] = NULL;
+      continue;
+    }
+    entry->connected = 1;
+    pool->open++;
+    slot[i] = n;
+    if( pool_direct( pool, entry )) {
+      entry->conf.retries = 0; // going through init is the retry
+      SessionInit( sessions+n++, pool->relogin, &entry->conf, flag, &entry->unit, &entry->tp, pool->cmdfile, archdatalist, archdatalen, livedatalist, livedatalen );
+    } else
+      SessionInit( sessions+n++, pool->login, &entry->conf, flag, &entry->unit, &entry->tp, pool->cmdfile, archdatalist, archdatalen, livedatalist, livedatalen );
+  }
+  RunSessions( sessions, n );
+  for( i=0; i<num; i++ ) {
+    if( slot[i] < 0 )
+      continue;
+    entry = entries[i];
+    entry->conf.retries = pool->conf->retries;
+    if( sessions[slot[i]].state == SESSION_DONE ) {
+      entry->known = 1;
+      ready++;
+    } else if(( retry != NULL )&&( pool_direct( pool, entry ))&&( !sessions[slot[i]].overran )) {
+      if( flag->verbose == 1 ) printf("No answer to the login on %s, going through init\n", entry->conf.BTAddress );
+      entry->known = 0;
+      pool_disconnect( pool, entry );
+      retry[i] = 1;
+    } else
+      entries[i] = NULL;
+  }
+  return( ready );
+}
+
+/*
+ * The inverters at indexes, connected and logged in, to run commands on
+ * with entry->conf, entry->unit and entry->tp.  Those that are not yet are
+ * connected and logged in all at once, after logging off the least
+ * recently used others to keep within PoolSize.  Hand each back with
+ * PoolPut.  entries[i] is left NULL if that inverter cannot be reached.
+ * Returns the number that can be used
+ */
+int PoolGetMany( PoolType * pool, int * indexes, PoolEntryType ** entries, int num, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen )
+{
+  PoolEntryType *entry, *lru;
+  FlagType *flag = pool->flag;
+  TransportType **tps;
+  SessionType *sessions;
+  int *slot, *retry;
+  long start = monotonic_ms();
+  int i, n=0, again=0, ready=0;
+
+  tps = (TransportType **)malloc( sizeof(TransportType *) * num );
+  sessions = (SessionType *)malloc( sizeof(SessionType) * num );
+  slot = (int *)malloc( sizeof(int) * num );
+  retry = (int *)calloc( num, sizeof(int) );
+  if(( tps == NULL )||( sessions == NULL )||( slot == NULL )||( retry == NULL )) {
+    printf("ERROR: Out of memory\n" );
+    free( tps );
+    free( sessions );
+    free( slot );
+    free( retry );
+    return( 0 );
+  }
+  for( i=0; pool->login[i] != NULL; i++ )
+    RttAdd( pool->conf, pool->login[i] );
+  for( i=0; i<num; i++ ) {
+    entry = entries[i] = pool->entries+indexes[i];
+    entry->busy = 1;
+    entry->last_used = start;
+    if( entry->connected ) {
+      pool->hits++;
+      ready++;
+    } else {
+      pool->misses++;
+      n++;
+    }
+  }
+  while(( pool->open + n > pool->conf->pool_size )&&(( lru = pool_lru( pool )) != NULL )) {
+    if( flag->verbose == 1 ) printf("Logging off %s to make room\n", lru->conf.BTAddress );
+    pool_logoff( pool, lru, archdatalist, archdatalen, livedatalist, livedatalen );
+    pool->evictions++;
+  }
+  for( i=0; i<num; i++ )
+    pool_enter( pool, entries[i] );
+  if( n > 0 ) {
+    ready += pool_connect( pool, entries, num, retry, tps, sessions, slot, archdatalist, archdatalen, livedatalist, livedatalen );
+    for( i=0; i<num; i++ )
+      again += retry[i];
+    if( again > 0 )
+      ready += pool_connect( pool, entries, num, NULL, tps, sessions, slot, archdatalist, archdatalen, livedatalist, livedatalen );
+    if( flag->verbose == 1 ) printf("Connect and login took %ld ms\n", monotonic_ms() - start );
+  }
+  for( i=0; i<num; i++ ) {
+    entry = pool->entries+indexes[i];
+    if( entries[i] == NULL ) {
+      pool_leave( pool, entry );
+      if( entry->connected )
+        pool_disconnect( pool, entry );
+      entry->busy = 0;
+    }
+  }
+  free( tps );
+  free( sessions );
+  free( slot );
+  free( retry );
+  return( ready );
+}
+
+/* PoolGetMany for one inverter, NULL if it cannot be reached */
+PoolEntryType * PoolGet( PoolType * pool, int index, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen )
+{
+  PoolEntryType *entry;
+
+  PoolGetMany( pool, &index, &entry, 1, archdatalist, archdatalen, livedatalist, livedatalen );
+  return( entry );
+}
+
+/* Done with entry for now, ok is 0 if its link failed */
+void PoolPut( PoolType * pool, PoolEntryType * entry, int ok )
+{
+  pool_leave( pool, entry );
+  entry->busy = 0;
+  if( !ok )
+    pool_disconnect( pool, entry );
+}
+
+/* Keep the idle links up, dropping those that do not answer */
+void PoolKeepalive( PoolType * pool, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen )
+{
+  PoolEntryType *entry;
+  int i, result;
+
+  for( i=0; i<pool->num_entries; i++ ) {
+    entry = pool->entries+i;
+    if( !entry->connected )
+      continue;
+    pool_enter( pool, entry );
+    result = InverterCommand( "keepalive", &entry->conf, pool->flag, &entry->unit, &entry->tp, pool->cmdfile, archdatalist, archdatalen, livedatalist, livedatalen );
+    if( result < 0 )
+      printf("ERROR: Keepalive to %s failed, reconnecting next cycle\n", entry->conf.BTAddress );
+    PoolPut( pool, entry, result >= 0 );
+  }
+}
+
+/*
+ * Log off and disconnect every inverter.
+ * Returns 0, or -1 if a logoff failed
+ */
+int PoolClose( PoolType * pool, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen )
+{
+  int i, result=0;
+
+  for( i=0; i<pool->num_entries; i++ ) {
+    if( pool->entries[i].connected && ( pool_logoff( pool, pool->entries+i, archdatalist, archdatalen, livedatalist, livedatalen ) < 0 ))
+      result = -1;
+  }
+  return( result );
+}
+
+void PoolFree( PoolType * pool )
+{
+  int i;
+
+  for( i=0; i<pool->num_entries; i++ )
+    free( pool->entries[i].unit );
+  free( pool->entries );
+  pool->entries = NULL;
+  pool->num_entries = 0;
+}
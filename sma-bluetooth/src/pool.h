@@ -0,0 +1,63 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef H_POOL
+  #define H_POOL
+
+#include "sma_struct.h"
+#include "transport.h"
+
+/* One inverter from the Inverter lines, with its link when it has one */
+typedef struct{
+  ConfType conf;              /* settings, with this inverter's BTAddress, Transport and NetID */
+  UnitType * unit;            /* devices on its NetID */
+  TransportType tp;
+  int  connected;             /* link up and logged in */
+  int  known;                 /* NetID, our address and devices known, login needs no init */
+  int  busy;                  /* handed out by PoolGet, not to be logged off */
+  long last_used;             /* ms, when PoolGet last handed it out */
+} PoolEntryType;
+
+/*
+ * Logged-in links to at most PoolSize inverters, a Bluetooth adapter only
+ * holds a few.  The least recently used is logged off to make room.
+ */
+typedef struct{
+  ConfType * conf;            /* settings shared by all inverters */
+  FlagType * flag;
+  CommandFileType * cmdfile;
+  const char ** login;        /* sma.in commands to log in */
+  const char ** relogin;      /* and to log in with what an earlier login learnt */
+  const char ** logoff;       /* and to log off */
+  PoolEntryType * entries;    /* one per inverter */
+  int  num_entries;
+  int  open;                  /* entries connected */
+  unsigned long hits;         /* PoolGet found the inverter logged in */
+  unsigned long misses;       /* PoolGet had to connect and log in */
+  unsigned long evictions;    /* another inverter was logged off to make room */
+} PoolType;
+
+extern int  PoolInit( PoolType * pool, ConfType * conf, FlagType * flag, CommandFileType * cmdfile, const char ** login, const char ** relogin, const char ** logoff );
+extern int  PoolGetMany( PoolType * pool, int * indexes, PoolEntryType ** entries, int num, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen );
+extern PoolEntryType * PoolGet( PoolType * pool, int index, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen );
+extern void PoolPut( PoolType * pool, PoolEntryType * entry, int ok );
+extern void PoolKeepalive( PoolType * pool, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen );
+extern int  PoolClose( PoolType * pool, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen );
+extern void PoolFree( PoolType * pool );
+
+#endif
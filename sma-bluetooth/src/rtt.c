@@ -0,0 +1,217 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Round trip times per sma.in command, so each wait for the inverter can be
+ * as long as that command needs instead of BTTimeout for everything.  A
+ * moving average and a histogram are kept per command and saved in
+ * StateDir/rtt between runs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sma_struct.h"
+#include "rtt.h"
+
+/* Upper bound in ms of each histogram bucket, the last one takes the rest */
+static const long rtt_bounds[RTT_BUCKETS] = {
+  5, 10, 20, 35, 50, 75, 100, 150, 200, 300,
+  500, 750, 1000, 1500, 2000, 3000, 5000, 10000, 20000, 60000 };
+
+/* Find label in the list, adding it if create is set */
+RttType * RttFind( ConfType * conf, const char * label, int create )
+{
+  RttType *rtt;
+  int i;
+
+  for( i=0; i<conf->num_rtt; i++ )
+    if( strcmp( conf->rttlist[i].label, label ) == 0 )
+      return( conf->rttlist+i );
+  if( !create )
+    return( NULL );
+  conf->rttlist = (RttType *)realloc( conf->rttlist, sizeof(RttType)*(conf->num_rtt+1));
+  rtt = conf->rttlist+conf->num_rtt;
+  memset( rtt, 0, sizeof(RttType) );
+  strncpy( rtt->label, label, sizeof(rtt->label)-1 );
+  conf->num_rtt++;
+  return( rtt );
+}
+
+/* Read StateDir/rtt if there is one */
+void RttLoad( ConfType * conf, FlagType * flag )
+{
+  FILE *fp;
+  char path[200];
+  char line[400];
+  char *token;
+  RttType tmp, *rtt;
+  int i;
+
+  conf->rttlist = NULL;
+  conf->num_rtt = 0;
+  sprintf( path, "%s/rtt", conf->StateDir );
+  if(( fp = fopen( path, "r" )) == NULL )
+    return;
+  while( fgets( line, sizeof(line), fp ) != NULL ) {
+    if( line[0] == '#' )
+      continue;
+    memset( &tmp, 0, sizeof(tmp) );
+    if(( token = strtok( line, " \t\n" )) == NULL )
+      continue;
+    strncpy( tmp.label, token, sizeof(tmp.label)-1 );
+    if(( token = strtok( NULL, " \t\n" )) == NULL )
+      continue;
+    tmp.samples = atol( token );
+    if(( token = strtok( NULL, " \t\n" )) == NULL )
+      continue;
+    tmp.ewma = atof( token );
+    tmp.backoff = 0;
+    if(( token = strtok( NULL, " \t\n" )) == NULL )
+      continue;
+    tmp.retries = atol( token );
+    for( i=0; i<RTT_BUCKETS; i++ ) {
+      if(( token = strtok( NULL, " \t\n" )) == NULL )
+        break;
+      tmp.hist[i] = atol( token );
+    }
+    rtt = RttFind( conf, tmp.label, 1 );
+    memcpy( rtt, &tmp, sizeof(tmp) );
+  }
+  fclose( fp );
+  if( flag->debug == 1 ) printf("Loaded round trip times for %d commands from %s\n", conf->num_rtt, path );
+}
+
+/* Write StateDir/rtt */
+void RttSave( ConfType * conf, FlagType * flag )
+{
+  FILE *fp;
+  char path[200], tmppath[210];
+  int i, j;
+
+  if( conf->num_rtt == 0 )
+    return;
+  sprintf( path, "%s/rtt", conf->StateDir );
+  sprintf( tmppath, "%s.tmp", path );
+  if(( fp = fopen( tmppath, "w" )) == NULL ) {
+    if( flag->debug == 1 ) printf("Cannot write %s, not keeping round trip times\n", tmppath );
+    return;
+  }
+  fprintf( fp, "# command samples ewma_ms retries then replies per bucket up to" );
+  for( j=0; j<RTT_BUCKETS; j++ )
+    fprintf( fp, " %ld", rtt_bounds[j] );
+  fprintf( fp, " ms\n" );
+  for( i=0; i<conf->num_rtt; i++ ) {
+    fprintf( fp, "%s %ld %.1f %ld", conf->rttlist[i].label, conf->rttlist[i].samples, conf->rttlist[i].ewma, conf->rttlist[i].retries );
+    for( j=0; j<RTT_BUCKETS; j++ )
+      fprintf( fp, " %ld", conf->rttlist[i].hist[j] );
+    fprintf( fp, "\n" );
+  }
+  fclose( fp );
+  if( rename( tmppath, path ) < 0 )
+    printf("ERROR: Cannot update %s\n", path );
+}
+
+/*
+ * Make sure label and the rest of its replies have an entry, so the copies
+ * of conf of inverters polled at once, which share the list, never grow it
+ */
+void RttAdd( ConfType * conf, const char * label )
+{
+  char stream[sizeof(conf->rttlist->label)+8];
+
+  RttFind( conf, label, 1 );
+  snprintf( stream, sizeof(stream), "%s/stream", label );
+  RttFind( conf, stream, 1 );
+}
+
+/* A reply to label took ms */
+void RttSample( ConfType * conf, const char * label, long ms )
+{
+  RttType *rtt = RttFind( conf, label, 1 );
+  long count=0;
+  int i;
+
+  if( rtt->samples == 0 )
+    rtt->ewma = ms;
+  else
+    rtt->ewma += ( ms - rtt->ewma )/8;
+  rtt->samples++;
+  rtt->backoff = 0;
+  for( i=0; i<RTT_BUCKETS-1; i++ )
+    if( ms <= rtt_bounds[i] )
+      break;
+  rtt->hist[i]++;
+  for( i=0; i<RTT_BUCKETS; i++ )
+    count += rtt->hist[i];
+  if( count > RTT_MAX_COUNT )
+    for( i=0; i<RTT_BUCKETS; i++ )
+      rtt->hist[i] /= 2;
+}
+
+/*
+ * No reply to label in time.  Like TCP, wait twice as long next time until
+ * a reply is timed again; the late reply itself is not a sample
+ */
+void RttTimedOut( ConfType * conf, const char * label )
+{
+  RttType *rtt = RttFind( conf, label, 0 );
+
+  if(( rtt != NULL )&&( rtt->backoff < 8 ))
+    rtt->backoff++;
+}
+
+/* A request for label had to be sent again */
+void RttRetry( ConfType * conf, const char * label )
+{
+  RttFind( conf, label, 1 )->retries++;
+  conf->retransmits++;
+}
+
+/*
+ * How long to wait for a reply to label: twice the larger of the moving
+ * average and the 95th percentile, doubled for each timeout since the last
+ * reply, but no more than BTTimeout
+ */
+long RttTimeout( ConfType * conf, FlagType * flag, const char * label )
+{
+  RttType *rtt = RttFind( conf, label, 0 );
+  long ceiling = conf->bt_timeout*1000L;
+  long count=0, sum=0, p95, timeout;
+  int i;
+
+  if(( rtt == NULL )||( rtt->samples < RTT_MIN_SAMPLES ))
+    return( ceiling );
+  for( i=0; i<RTT_BUCKETS; i++ )
+    count += rtt->hist[i];
+  for( i=0; i<RTT_BUCKETS-1; i++ ) {
+    sum += rtt->hist[i];
+    if( sum*100 >= count*95 )
+      break;
+  }
+  p95 = rtt_bounds[i];
+  timeout = 2*( p95 > rtt->ewma ? p95 : (long)rtt->ewma );
+  if( timeout < RTT_MIN_TIMEOUT )
+    timeout = RTT_MIN_TIMEOUT;
+  timeout <<= rtt->backoff;
+  if( timeout > ceiling )
+    timeout = ceiling;
+  if( flag->debug == 1 ) printf("%s timeout %ld ms (ewma %.1f p95 %ld backoff %d)\n", label, timeout, rtt->ewma, p95, rtt->backoff );
+  return( timeout );
+}
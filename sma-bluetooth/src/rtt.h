@@ -0,0 +1,36 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef H_RTT
+  #define H_RTT
+
+#include "sma_struct.h"
+
+#define RTT_MIN_SAMPLES 8       /* use BTTimeout until a label has this many */
+#define RTT_MIN_TIMEOUT 200     /* ms, never wait less than this */
+#define RTT_MAX_COUNT   1000    /* halve the histogram past this, so it follows the link */
+
+extern void RttLoad( ConfType * conf, FlagType * flag );
+extern void RttSave( ConfType * conf, FlagType * flag );
+extern void RttAdd( ConfType * conf, const char * label );
+extern void RttSample( ConfType * conf, const char * label, long ms );
+extern void RttTimedOut( ConfType * conf, const char * label );
+extern void RttRetry( ConfType * conf, const char * label );
+extern long RttTimeout( ConfType * conf, FlagType * flag, const char * label );
+
+#endif
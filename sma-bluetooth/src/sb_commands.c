@@ -26,11 +26,16 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <time.h>
-#include <bluetooth/bluetooth.h>
-#include <bluetooth/rfcomm.h>
 #include <errno.h>
 #include "sma_struct.h"
 #include "sma_mysql.h"
+#include "transport.h"
+#include "sb_commands.h"
+#include "engine.h"
+#include "rtt.h"
+#include "plan.h"
+#include "meta.h"
+#include "escape.h"
 
 // From smatool.c
 extern char * return_xml_data( ConfType *,int );
@@ -40,49 +45,17 @@ extern long ConvertStreamtoLong( unsigned char *, int, unsigned long * );
 extern float ConvertStreamtoFloat( unsigned char *, int, float * );
 extern char * ConvertStreamtoString( unsigned char *, int );
 extern time_t ConvertStreamtoTime( unsigned char * stream, int length, time_t * value, int *day, int *month, int *year, int *hour, int *minute, int *second );
-extern unsigned char *ReadStream( ConfType * conf, FlagType * flag, ReadRecordType * readRecord, int * s, unsigned char * stream, int * streamlen, unsigned char * datalist, int * datalen, unsigned char * last_sent, int cc, int * terminated, int * togo );
+extern int ReadStream( ConfType * conf, FlagType * flag, ReadRecordType * readRecord, TransportType * tp, unsigned char * stream, int * streamlen, PayloadType * payload, unsigned char * last_sent, int cc, int * terminated, int * togo );
 
 extern unsigned char conv( char * );
 extern void tryfcs16(FlagType * flag, unsigned char *cp, int len, unsigned char *fl, int * cc);
-extern void add_escapes(unsigned char *cp, int *len);
 extern void fix_length_send( FlagType * flag, unsigned char *cp, int *len);
 extern char *debugdate();
 extern int select_str(FlagType * flag, char *s);
-extern int read_bluetooth( ConfType * conf, FlagType * flag, ReadRecordType * readRecord, int *s, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated );
-extern int empty_read_bluetooth(  ConfType * conf, FlagType * flag, ReadRecordType * readRecord, int *s, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated );
+extern int read_bluetooth( ConfType * conf, FlagType * flag, ReadRecordType * readRecord, TransportType *tp, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated );
+int GetLine( const char * command, CommandFileType * cmdfile );
 
 
-int ConnectSocket ( ConfType * conf )
-{
-  struct sockaddr_rc addr = { 0 };
-  int i;
-  int s=0;
-  int status=-1; //connection status
-   
-  //Try a few connects
-  for( i=1; i<20; i++ ){
-    // allocate a socket
-    if(( (s) = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM)) > 0 ) {
-      // set the connection parameters (who to connect to)
-      addr.rc_family = AF_BLUETOOTH;
-      addr.rc_channel = (uint8_t) 1;
-      str2ba( conf->BTAddress, &addr.rc_bdaddr );
-
-      // connect to server
-      status = connect((s), (struct sockaddr *)&addr, sizeof(addr));
-      if (status < 0) {
-        printf("Trying to connect to %s (%d/20)\n",conf->BTAddress, i);
-        close( (s) );
-      } else
-        //connected
-        break;
-    } else {
-      //Can't open socket, try again
-      close((s));
-    }
-  }
-  return( s );
-}
 /*
  * Update internal running list with live data for later processing
  */
@@ -124,83 +97,518 @@ int UpdateLiveList( ConfType * conf, FlagType * flag,  UnitType *unit, char * fo
 }
 
 
-int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, FILE * fp, int *linenum, ArchDataType **archdatalist, int *archdatalen , LiveDataType **livedatalist, int *livedatalen)
-// Returns 0 on success and -1 on error
+/*
+ * Read sma.in into memory so every session can run commands from it at
+ * its own pace.  Lines are kept as read, newline included.
+ * Returns 0 on success and -1 if the file cannot be read
+ */
+int ReadCommandFile( CommandFileType * cmdfile, const char * filename )
 {
-  char  *line;
+  FILE *fp;
+  char *line = NULL;
   size_t len=0;
-  ssize_t read;
-  int   i, j, cc, rr;
+
+  cmdfile->lines = NULL;
+  cmdfile->num_lines = 0;
+  cmdfile->plans = NULL;
+  cmdfile->num_plans = 0;
+  cmdfile->commands = NULL;
+  if(( fp = fopen( filename, "r" )) == NULL )
+    return( -1 );
+  while( getline( &line, &len, fp ) != -1 ) {
+    cmdfile->lines = (char **)realloc( cmdfile->lines, sizeof(char *)*(cmdfile->num_lines+1));
+    cmdfile->lines[cmdfile->num_lines++] = strdup( line );
+  }
+  free( line );
+  fclose( fp );
+  return( 0 );
+}
+
+void FreeCommandFile( CommandFileType * cmdfile )
+{
+  int i;
+
+  for( i=0; i<cmdfile->num_lines; i++ )
+    free( cmdfile->lines[i] );
+  free( cmdfile->lines );
+  cmdfile->lines = NULL;
+  cmdfile->num_lines = 0;
+  PlanFree( cmdfile );
+}
+
+/*
+ * Does this E line pull a multi-frame reply through ReadStream
+ */
+int StreamLine( const char * line )
+{
+  static const char * stream_strings[] = { "$POW", "$TESTDATA", "$ARCHIVEDATA1", "$INVERTERDATA", "$DATA" };
+  char buf[1024];
+  char *token, *saveptr;
+  int i;
+
+  // strtok_r, the caller is in the middle of its own strtok
+  strncpy( buf, line, sizeof(buf)-1 );
+  buf[sizeof(buf)-1] = '\0';
+  if((( token = strtok_r( buf, " ;", &saveptr )) == NULL )||( strcmp( token, "E" ) != 0 ))
+    return( 0 );
+  while(( token = strtok_r( NULL, " ;", &saveptr )) != NULL ) {
+    for( i=0; i<sizeof(stream_strings)/sizeof(*stream_strings); i++ )
+      if( strcmp( token, stream_strings[i] ) == 0 )
+        return( 1 );
+  }
+  return( 0 );
+}
+
+/*
+ * The device a command reading $ARCHIVEDATA1 asks first on a NetID with
+ * several: its reply comes in packets that would mix with the others', so
+ * the request goes to one device after the other instead of to all of
+ * them.  -1 to send it as it is
+ */
+int ArchiveUnit( CommandContext * ctx )
+{
+  char buf[1024];
+  char *token, *saveptr;
+  int i;
+
+  if(( ctx->conf->NetID <= 1 )||( ctx->conf->num_units <= 1 ))
+    return( -1 );
+  for( i=ctx->linenum; i<ctx->cmdfile->num_lines; i++ ) {
+    strncpy( buf, ctx->cmdfile->lines[i], sizeof(buf)-1 );
+    buf[sizeof(buf)-1] = '\0';
+    if(( token = strtok_r( buf, " ;", &saveptr )) == NULL )
+      continue;
+    if( token[0] == ':' )
+      break;
+    if( strcmp( token, "E" ) != 0 )
+      continue;
+    while(( token = strtok_r( NULL, " ;", &saveptr )) != NULL )
+      if( strcmp( token, "$ARCHIVEDATA1" ) == 0 )
+        return( 0 );
+  }
+  return( -1 );
+}
+
+/*
+ * Address the Data2+ request in fl, before its FCS and escapes, to device
+ * to_unit if it is to all of them
+ */
+void AddressUnit( CommandContext * ctx )
+{
+  UnitType * dev = (*ctx->unit)+ctx->to_unit;
+  unsigned char * fl = ctx->fl;
+
+  if(( ctx->cc < 31 )||( memcmp( fl+18, "\x7e\xff\x03\x60\x65", 5 ) != 0 )||( memcmp( fl+25, "\xff\xff\xff\xff\xff\xff", 6 ) != 0 ))
+    return;
+  fl[25] = dev->SUSyID[0];
+  fl[26] = dev->SUSyID[1];
+  fl[27] = dev->Serial[3];
+  fl[28] = dev->Serial[2];
+  fl[29] = dev->Serial[1];
+  fl[30] = dev->Serial[0];
+  if( ctx->flag->verbose == 1 ) printf("%s for device %s\n", ctx->command, dev->SerialStr );
+}
+
+/*
+ * Print and list the values of a metadata command from the cache, as $DATA
+ * would, if they are fresh for every device of the inverter.
+ * Returns 1 if they were, 0 if the command has to run
+ */
+int CommandCached( CommandContext * ctx )
+{
+  ConfType * conf = ctx->conf;
+  MetaType * meta;
+  UnitType * dev;
+  ReturnType * key;
+  struct tm tm;
+  int i, j, k;
+
+  if( conf->num_units == 0 )
+    return( 0 );
+  for( i=0; i<conf->num_units; i++ )
+    if( MetaFresh( conf, (*ctx->unit)+i, ctx->command ) == 0 )
+      return( 0 );
+  if( ctx->flag->verbose == 1 ) printf("%s from the metadata cache\n", ctx->command );
+  for( i=0; i<conf->num_units; i++ ) {
+    dev = (*ctx->unit)+i;
+    for( j=0; j<conf->metacache->num; j++ ) {
+      meta = conf->metacache->list+j;
+      if( !MetaMatch( meta, dev, ctx->command ))
+        continue;
+      for( k=0; ( k<conf->num_return_keys )&&(( conf->returnkeylist[k].key1 != meta->key1 )||( conf->returnkeylist[k].key2 != meta->key2 )); k++ );
+      if( k == conf->num_return_keys )
+        continue;
+      key = conf->returnkeylist+k;
+      gmtime_r( &meta->date, &tm );
+      if( key->decimal == 97 )
+        printf("                    %-30s = %s\n", key->description, meta->value );
+      else
+        printf("%4d-%02d-%02d %02d:%02d:%02d %-30s = '%s' '%-20s'\n", tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, key->description, meta->value, key->units );
+      UpdateLiveList( conf, ctx->flag, dev, "%s", meta->date, key->description, -1.0, -1, meta->value, key->units, key->persistent, ctx->livedatalen, ctx->livedatalist );
+      if(( meta->key1 == 0x20 )&&( meta->key2 == 0x82 ))
+        strcpy( dev->Inverter, meta->value );
+    }
+  }
+  return( 1 );
+}
+
+/*
+ * Set up ctx to run sma.in command, e.g. "login"
+ * Returns 0 on success and -1 on error
+ */
+int CommandStart( CommandContext * ctx, const char * command )
+{
+  char BTAddressBuf[20];
+  static const unsigned char timeset[4] = { 0x30,0xfe,0x7e,0x00 };
+
+  if(( ctx->linenum = GetLine( command, ctx->cmdfile )) == 0 ) {
+    //Command not found in config
+    printf("ERROR: Command %s not found in config!\n", command );
+    return( -1 );
+  }
+  strncpy( ctx->command, command, sizeof(ctx->command)-1 );
+  ctx->command[sizeof(ctx->command)-1] = '\0';
+  ctx->plan = PlanFind( ctx->cmdfile, command );
+  //convert address
+  strncpy( BTAddressBuf, ctx->conf->BTAddress, 20);
+  ctx->dest_address[5] = conv(strtok( BTAddressBuf,":"));
+  ctx->dest_address[4] = conv(strtok(NULL,":"));
+  ctx->dest_address[3] = conv(strtok(NULL,":"));
+  ctx->dest_address[2] = conv(strtok(NULL,":"));
+  ctx->dest_address[1] = conv(strtok(NULL,":"));
+  ctx->dest_address[0] = conv(strtok(NULL,":"));
+  /* get the report time - used in various places */
+  ctx->reporttime = time(NULL);  //get time in seconds since epoch (1/1/1970)
+  memset( ctx->fl, 0, sizeof(ctx->fl) );
+  memset( ctx->tzhex, 0, sizeof(ctx->tzhex) );
+  memset( ctx->timestr, 0, sizeof(ctx->timestr) );
+  memcpy( ctx->timeset, timeset, sizeof(ctx->timeset) );
+  // received, rr and terminated carry over, some commands (TypeLabel,
+  // DeviceStatus) extract without an R line of their own
+  ctx->cc = 0;
+  ctx->already_read = 0;
+  ctx->togo = 0;
+  ctx->packets = 0;
+  ctx->next_packet = 0;
+  ctx->arch_from = 0;
+  ctx->to_unit = ArchiveUnit( ctx );
+  ctx->failedbluetooth = 0;
+  ctx->wait_for = WAIT_NONE;
+  ctx->wait_ms = 0;
+  ctx->waited = 0;
+  ctx->expired = 0;
+  ctx->sent_ms = 0;
+  ctx->timed = 0;
+  ctx->send_line = -1;
+  ctx->sent_cnt = -1;
+  ctx->retries = 0;
+  ctx->resend = 0;
+  ctx->expect = 1;
+  ctx->replies = 0;
+  ctx->reply_line = -1;
+  ctx->after_line = -1;
+  ctx->tp->timeout = ctx->conf->bt_timeout;
+  PayloadInit( &ctx->payload );
+
+  ctx->last_sent = (unsigned  char *)malloc( sizeof( unsigned char ));
+  if ( ctx->last_sent == NULL ) {
+    printf("ERROR: Out of memory\n" );
+    return( -1 );
+  }
+  // nothing to send if the cache still has what it reads
+  if( CommandCached( ctx ) == 1 )
+    ctx->linenum = ctx->cmdfile->num_lines;
+  return( 0 );
+}
+
+void CommandEnd( CommandContext * ctx )
+{
+  free( ctx->last_sent );
+  ctx->last_sent = NULL;
+  PayloadFree( &ctx->payload );
+}
+
+/*
+ * Does the frame in received start as the R line in fl asks?  The first
+ * frame of a reply in several is marked 08 where a whole one has 01
+ */
+int ReplyMatches( CommandContext * ctx, unsigned char * fl, unsigned char * received )
+{
+  if(( ctx->cc > 17 )&&( fl[16] == 0x01 )&&( received[16] == 0x08 ))
+    return(( memcmp( fl+4, received+4, 12 ) == 0 )&&( memcmp( fl+17, received+17, ctx->cc-17 ) == 0 ));
+  return( memcmp( fl+4, received+4, ctx->cc-4 ) == 0 );
+}
+
+/*
+ * Is the SMA data frame in received the late answer to an earlier request:
+ * an earlier copy of a retransmitted one, one a device on a NetID with
+ * several answered late, or the rest of a reply in several packets that
+ * the command before did not wait for?  Replies carry the $CNT packet id
+ * of the request at 45, each copy had the next id
+ */
+int StaleReply( CommandContext * ctx )
+{
+  if(( ctx->sent_cnt < 0 )||( ctx->rr < 47 ))
+    return( 0 );
+  if( memcmp( ctx->received+18, "\x7e\xff\x03\x60\x65", 5 ) != 0 )
+    return( 0 );
+  return( ctx->received[45] != ctx->sent_cnt );
+}
+
+/*
+ * Read the first frame of the next packet of a reply that comes in several
+ * (togo more after each), the inverter sends them one after the other
+ * unasked.  Frames that are not part of it are dropped.  Returns 0 when it
+ * is in received, 1 if the link has nothing more yet and -1 on error
+ */
+int NextPacket( CommandContext * ctx )
+{
+  int status, dropped;
+
+  while(( status = transport_pending( ctx->tp )) > 0 ) {
+    if(( dropped = read_bluetooth( ctx->conf, ctx->flag, &ctx->readRecord, ctx->tp, &ctx->rr, ctx->received, ctx->cc, ctx->last_sent, &ctx->terminated )) < 0 )
+      return( -1 );
+    if( dropped > 0 )
+      continue;
+    if(( ctx->rr >= 47 )&&( memcmp( ctx->received+18, "\x7e\xff\x03\x60\x65", 5 ) == 0 )&&( StaleReply( ctx ) == 0 ))
+      return( 0 );
+    if( ctx->flag->debug == 1 ) printf("%s frame that is not the next packet dropped\n", ctx->command );
+  }
+  return(( status < 0 ) ? -1 : 1 );
+}
+
+/*
+ * How many replies the request in fl will get: one from every device on
+ * the NetID for a Data2+ request to the broadcast address, -1 when we do
+ * not know yet how many devices there are (take them until they stop),
+ * otherwise 1.  NetID 1 is an inverter on its own
+ */
+int ExpectedReplies( CommandContext * ctx )
+{
+  unsigned char head[8];
+  int i, n=0;
+
+  if(( ctx->cc < 32 )||( memcmp( ctx->fl+18, "\x7e\xff\x03\x60\x65", 5 ) != 0 )||( ctx->conf->NetID <= 1 ))
+    return( 1 );
+  // longwords, control and destination, which may be escaped
+  for( i=23; ( i<ctx->cc )&&( n<8 ); i++ )
+    head[n++] = ( ctx->fl[i] == 0x7d ) ? ctx->fl[++i]^0x20 : ctx->fl[i];
+  if(( n < 8 )||( memcmp( head+2, "\xff\xff\xff\xff\xff\xff", 6 ) != 0 ))
+    return( 1 );
+  return( ctx->conf->num_units > 0 ? ctx->conf->num_units : -1 );
+}
+
+/*
+ * The device on the NetID the Data2+ reply in received comes from, found
+ * by its SUSyID and serial.  With add (the $LOGIN reply) a device not seen
+ * before is added to the unit list, otherwise NULL if we cannot place it.
+ * Replies that are not Data2+ are put down to the first unit
+ */
+UnitType * ReplyUnit( CommandContext * ctx, int add )
+{
+  unsigned char * received = ctx->received;
+  UnitType * unit;
+  int i;
+
+  if(( ctx->rr < 39 )||( memcmp( received+18, "\x7e\xff\x03\x60\x65", 5 ) != 0 ))
+    return( *ctx->unit );
+  for( i=0; i<ctx->conf->num_units; i++ ) {
+    unit = (*ctx->unit)+i;
+    if(( unit->SUSyID[0] == received[33] )&&( unit->SUSyID[1] == received[34] )&&( unit->Serial[3] == received[35] )&&( unit->Serial[2] == received[36] )&&( unit->Serial[1] == received[37] )&&( unit->Serial[0] == received[38] ))
+      return( unit );
+  }
+  if( add == 0 )
+    return( NULL );
+  if( ctx->conf->num_units > 0 ) {
+    (*ctx->unit) = (UnitType *)realloc( (*ctx->unit), sizeof(UnitType)*(ctx->conf->num_units+1));
+    memset( (*ctx->unit)+ctx->conf->num_units, 0, sizeof(UnitType) );
+  }
+  unit = (*ctx->unit)+ctx->conf->num_units;
+  ctx->conf->num_units++;
+  return( unit );
+}
+
+/*
+ * Every device that is going to has answered the request, or we have
+ * waited long enough for the rest: carry on after the E line.
+ * Returns like CommandStep
+ */
+int CommandCollected( CommandContext * ctx )
+{
+  if(( ctx->flag->verbose == 1 )&&( ctx->expect > ctx->replies ))
+    printf("Only %d of %d devices answered %s\n", ctx->replies, ctx->expect, ctx->command );
+  ctx->linenum = ctx->after_line;
+  ctx->after_line = -1;
+  ctx->wait_for = WAIT_NONE;
+  ctx->waited = 0;
+  return( CommandStep( ctx ) );
+}
+
+/* Round trip times of the rest of a multi-frame reply are kept apart */
+void StreamLabel( CommandContext * ctx, char * label )
+{
+  sprintf( label, "%s/stream", ctx->command );
+}
+
+/*
+ * How long the wait about to start may take: as long as replies to label
+ * usually take, or what is left of BTTimeout once that has run out
+ */
+int CommandWaitMs( CommandContext * ctx, const char * label )
+{
+  if( ctx->waited == 0 )
+    return( RttTimeout( ctx->conf, ctx->flag, label ));
+  return( ctx->conf->bt_timeout*1000 - ctx->waited );
+}
+
+/*
+ * No reply to the last S frame in time: send it again with a new $CNT, the
+ * wait doubled by RttTimedOut, at most Retries times.  After that the link
+ * is taken to be gone.  Returns like CommandStep
+ */
+int CommandRetransmit( CommandContext * ctx )
+{
+  RttTimedOut( ctx->conf, ctx->command );
+  if( ctx->retries >= ctx->conf->retries ) {
+    printf("ERROR: No reply to %s after %d retries\n", ctx->command, ctx->retries );
+    return( CMD_ERROR );
+  }
+  ctx->retries++;
+  RttRetry( ctx->conf, ctx->command );
+  if( ctx->flag->verbose == 1 ) printf("No reply to %s after %d ms, retransmitting (%d/%d)\n", ctx->command, ctx->waited, ctx->retries, ctx->conf->retries );
+  ctx->linenum = ctx->send_line;
+  ctx->resend = 1;
+  ctx->wait_for = WAIT_NONE;
+  ctx->waited = 0;
+  ctx->already_read = 0;
+  return( CommandStep( ctx ) );
+}
+
+/*
+ * A CMD_WAIT_READ ran out of time before the link became readable
+ * Returns like CommandStep
+ */
+int CommandTimeout( CommandContext * ctx )
+{
+  char label[50];
+
+  if( ctx->wait_for == WAIT_STREAM )
+    StreamLabel( ctx, label );
+  else
+    strcpy( label, ctx->command );
+  if((( ctx->wait_for == WAIT_REPLY )||(( ctx->wait_for == WAIT_STREAM )&&( ctx->rr == 0 )))&&( ctx->after_line < 0 )&&( transport_busy( ctx->tp, ctx->wait_ms ))) {
+    // pipelined behind requests still being answered, not late yet
+    if( ctx->flag->debug == 1 ) printf("%s queued behind other replies, waiting on\n", label );
+    return( CMD_WAIT_READ );
+  }
+  ctx->waited += ctx->wait_ms;
+  if(( ctx->wait_for == WAIT_REPLY )&&( ctx->after_line >= 0 ))
+    return( CommandCollected( ctx ));
+  // nothing at all came back, an E line without R waits for the reply as a stream
+  // (not so between the packets of a reply, rr is 0 there after a dropped frame)
+  if((( ctx->wait_for == WAIT_REPLY )||(( ctx->wait_for == WAIT_STREAM )&&( ctx->rr == 0 )&&( ctx->next_packet == 0 )))&&( ctx->send_line >= 0 ))
+    return( CommandRetransmit( ctx ));
+  if(( ctx->wait_for != WAIT_DRAIN )&&( ctx->waited < ctx->conf->bt_timeout*1000 )) {
+    // slower than usual, but BTTimeout is not up yet
+    RttTimedOut( ctx->conf, label );
+    if( ctx->flag->debug == 1 ) printf("%s no reply after %d ms, waiting on\n", label, ctx->waited );
+    ctx->wait_ms = ctx->conf->bt_timeout*1000 - ctx->waited;
+    return( CMD_WAIT_READ );
+  }
+  switch( ctx->wait_for ) {
+    case WAIT_STREAM: // run the E line on what we have
+      ctx->expired = 1;
+      return( CommandStep( ctx ) );
+
+    case WAIT_DRAIN:
+      printf("ERROR: Timeout reading bluetooth socket (read_bluetooth)\n");
+      if (ctx->flag->verbose == 1) printf("BT error, returning -1\n");        
+      return( CMD_ERROR );
+
+    default:
+      printf("ERROR: Timeout reading bluetooth socket (read_bluetooth)\n");
+      return( CMD_ERROR );
+  }
+}
+
+/*
+ * Run the lines of the command in ctx until it has to wait for the inverter.
+ * Returns CMD_DONE at the end of the command and CMD_ERROR on error.
+ * CMD_WAIT_READ means call again once the link is readable, or
+ * CommandTimeout after ctx->wait_ms; CMD_WAIT_TIME means call again after
+ * ctx->wait_ms.  A line that has to wait is run again from its start.
+ */
+int CommandStep( CommandContext * ctx )
+{
+  ConfType * conf = ctx->conf;
+  FlagType * flag = ctx->flag;
+  UnitType ** unit = ctx->unit;
+  UnitType * dev;
+  TransportType * tp = ctx->tp;
+  ArchDataType ** archdatalist = ctx->archdatalist;
+  int * archdatalen = ctx->archdatalen;
+  LiveDataType ** livedatalist = ctx->livedatalist;
+  int * livedatalen = ctx->livedatalen;
+  unsigned char * fl = ctx->fl;
+  unsigned char * received = ctx->received;
+  unsigned char * dest_address = ctx->dest_address;
+  unsigned char * timestr = ctx->timestr;
+  unsigned char * timeset = ctx->timeset;
+  unsigned char * tzhex = ctx->tzhex;
+  char  *line = NULL;
+  int   linenum;
+  int   i, j;
   int  datalen=0;
-  int   failedbluetooth=0;
-  int   togo=0;
-  int   status, finished;
-  time_t reporttime;
+  int   status;
   time_t fromtime;
   time_t totime;
   time_t idate;
   time_t prev_idate;
-  unsigned char tzhex[2] = { 0 };
-  unsigned char timeset[4] = { 0x30,0xfe,0x7e,0x00 };
   struct tm tm;
   int day,month,year,hour,minute,second;
-  unsigned char fl[1024] = { 0 };
-  unsigned char received[1024];
-  unsigned char datarecord[1024];
-  unsigned char dest_address[6] = { 0 };
-  unsigned char timestr[25] = { 0 };
-  ReadRecordType readRecord;
   char  *lineread;
-  unsigned char * last_sent;
+  PayloadType * payload = &ctx->payload;
+  unsigned char head[4];           /* first bytes of a payload, say how long its records are */
   unsigned char * data;
-  char BTAddressBuf[20];
   char tt[10] = {48,48,48,48,48,48,48,48,48,48}; 
   char ti[3]; 
   char *datastring;
+  const char *cached;
   float currentpower_total;
   float dtotal;
   float gtotal;
   float ptotal;
   float strength;
-  int   found, already_read, terminated;
+  int   found;
   int   gap=0, return_key, datalength=0;
-  int  pass_i, send_count = 0;
+  int  pass_i;
   int  persistent;
   int index;
   unsigned long long inverter_serial;
   char valuebuf[30];
+  char label[50];
+  int  collect;
+  int  pause_ms=0;                 /* wait this long after the line, without holding up the other sessions */
+  int  unit_done=0;                /* $ARCHIVEDATA1 has all of to_unit's reply */
 
-  //convert address
-  strncpy( BTAddressBuf, conf->BTAddress, 20);
-  dest_address[5] = conv(strtok( BTAddressBuf,":"));
-  dest_address[4] = conv(strtok(NULL,":"));
-  dest_address[3] = conv(strtok(NULL,":"));
-  dest_address[2] = conv(strtok(NULL,":"));
-  dest_address[1] = conv(strtok(NULL,":"));
-  dest_address[0] = conv(strtok(NULL,":"));
-  /* get the report time - used in various places */
-  reporttime = time(NULL);  //get time in seconds since epoch (1/1/1970)
-
-  while (( read = getline(&line,&len,fp) ) != -1) { //read line from sma.in
-    (*linenum)++;
-    last_sent = (unsigned  char *)malloc( sizeof( unsigned char ));
-    if ( last_sent == NULL ) {
-      printf("ERROR: Out of memory\n" );
-      return( -1 );
-    }
+  while( ctx->linenum < ctx->cmdfile->num_lines ) { //next line from sma.in
+    linenum = ctx->linenum+1;
+    free( line );
+    line = strdup( ctx->cmdfile->lines[ctx->linenum] );
     lineread = strtok(line," ;");
     if( lineread[0] == ':') {  // Start of new command
       if( flag->debug == 1 ) printf( "Reached new command (%s), so returning\n\n", line ); 
-      return( 0 );
-      // Was: break;
+      break;
     }
-    if( flag->debug == 1 ) printf( "ProcessCommand - processing command line %s\n", line);
+    if( flag->debug == 1 ) printf( "CommandStep - processing command line %s\n", line);
+    collect = 0;
     if(!strcmp(lineread,"R")) {  //See if line is something we need to receive
-      if (flag->debug == 1) printf("[%d] %s Receiving (waiting for) string\n",(*linenum), debugdate() );
-      cc = 0;
+      ctx->reply_line = ctx->linenum;
+      if (flag->debug == 1) printf("[%d] %s Receiving (waiting for) string\n",linenum, debugdate() );
+      ctx->cc = 0;
       do {
         lineread = strtok(NULL," ;");
-        if( flag->debug == 1 ) printf( "ProcessCommand - processing command %s\n", lineread);
+        if( flag->debug == 1 ) printf( "CommandStep - processing command %s\n", lineread);
         switch(select_str(flag, lineread)) {
           case 0: // $END
             //do nothing
@@ -208,81 +616,108 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
 
           case 1: // $ADDR
             for (i=0;i<6;i++) {
-              fl[cc] = dest_address[i];
-              cc++;
+              fl[ctx->cc] = dest_address[i];
+              ctx->cc++;
             }
             break; 
 
           case 3: // $SERIAL
             for (i=0;i<4;i++) {
-              fl[cc] = unit[0]->Serial[i];
-              cc++;
+              fl[ctx->cc] = unit[0]->Serial[i];
+              ctx->cc++;
             }
             break; 
       
           case 7: // $ADD2
             for (i=0;i<6;i++) {
-              fl[cc] = conf->MyBTAddress[i];
-              cc++;
+              fl[ctx->cc] = conf->MyBTAddress[i];
+              ctx->cc++;
             }
             break; 
 
           default:
-            fl[cc] = conv(lineread);
-            cc++;
+            fl[ctx->cc] = conv(lineread);
+            ctx->cc++;
         }
       } while (strcmp(lineread,"$END"));
       if (flag->debug == 1) { 
-        printf("[%d] %s Waiting for: ", (*linenum), debugdate() );
-        for (i=0;i<cc;i++) printf("%02x ",fl[i]);
+        printf("[%d] %s Waiting for: ", linenum, debugdate() );
+        for (i=0;i<ctx->cc;i++) printf("%02x ",fl[i]);
         printf("\n");
       }
-      if (flag->debug == 1) printf("[%d] %s Waiting for data on rfcomm\n", (*linenum), debugdate());
+      if (flag->debug == 1) printf("[%d] %s Waiting for data on %s\n", linenum, debugdate(), tp->ops->scheme);
       found = 0;
       do {
-        if( already_read == 0 )
-          rr=0;
-        if(( already_read == 0 )&&( read_bluetooth( conf, flag, &readRecord, s, &rr, &received, cc, last_sent, &terminated ) != 0 )) {
-          already_read=0;
-          found=0;
-          strcpy( lineread, "" );
-          sleep(10);
-          failedbluetooth++;
-          if( failedbluetooth > 3 ) {
-            if (flag->debug == 1) printf("Failed BT more than 3 times, returning error\n");
-            return( -1 );
+        if( ctx->already_read == 0 ) {
+          ctx->rr=0;
+          if(( status = transport_pending( tp )) == 0 ) {
+            // nothing there yet, come back when the link is readable
+            ctx->wait_for = WAIT_REPLY;
+            ctx->wait_ms = CommandWaitMs( ctx, ctx->command );
+            free( line );
+            return( CMD_WAIT_READ );
           }
-        } else {
-          already_read=0;
-          if (flag->debug == 1) { 
-            printf( "[%d] %s Looking for: ",(*linenum), debugdate());
-            for (i=0;i<cc;i++) printf("%02x ",fl[i]);
-            printf( "\n" );
-            printf( "[%d] %s Received:    ",(*linenum), debugdate());
-            for (i=0;i<rr;i++) printf("%02x ",received[i]);
-            printf("\n");
+          if(( status < 0 )||(( status = read_bluetooth( conf, flag, &ctx->readRecord, tp, &ctx->rr, received, ctx->cc, ctx->last_sent, &ctx->terminated )) < 0 )) {
+            printf("ERROR: Lost the link reading the reply to %s\n", ctx->command );
+            free( line );
+            return( CMD_ERROR );
           }
-          if (memcmp(fl+4,received+4,cc-4) == 0) {
-            found = 1;
-            if (flag->debug == 1) printf("[%d] %s Found string we are waiting for\n",(*linenum), debugdate()); 
-          } else {
-            if (flag->debug == 1) printf("[%d] %s Did not find string\n", (*linenum),debugdate()); 
+          if( status > 0 )
+            continue; // dropped, wait for the next frame
+        }
+        ctx->already_read=0;
+        if (flag->debug == 1) { 
+          printf( "[%d] %s Looking for: ",linenum, debugdate());
+          for (i=0;i<ctx->cc;i++) printf("%02x ",fl[i]);
+          printf( "\n" );
+          printf( "[%d] %s Received:    ",linenum, debugdate());
+          for (i=0;i<ctx->rr;i++) printf("%02x ",received[i]);
+          printf("\n");
+        }
+        if(( ReplyMatches( ctx, fl, received ) )&&( StaleReply( ctx ) )) {
+          if (flag->debug == 1) printf("[%d] %s Reply to packet %02x, not %02x, ignored\n", linenum, debugdate(), received[45], ctx->sent_cnt );
+        } else if( ReplyMatches( ctx, fl, received ) ) {
+          found = 1;
+          ctx->replies++;
+          if(( ctx->sent_ms > 0 )&&(( ctx->timed & 1 ) == 0 )) {
+            RttSample( conf, ctx->command, monotonic_ms() - ctx->sent_ms );
+            ctx->timed |= 1;
           }
+          if (flag->debug == 1) printf("[%d] %s Found string we are waiting for\n",linenum, debugdate()); 
+        } else {
+          if (flag->debug == 1) printf("[%d] %s Did not find string\n", linenum,debugdate()); 
         }
       } while (found == 0);
       if (flag->debug == 2) {
-        for (i=0;i<cc;i++) printf("%02x ",fl[i]);
+        for (i=0;i<ctx->cc;i++) printf("%02x ",fl[i]);
         printf("\n");
       }
     } // if lineread R
     if(!strcmp(lineread,"S")){  //See if line is something we need to send
+      ctx->send_line = ctx->linenum;
+      ctx->sent_cnt = -1;
+      if( ctx->resend == 0 )
+        ctx->retries = 0;
+      ctx->resend = 0;
+      ctx->replies = 0;
+      ctx->reply_line = -1;
+      ctx->after_line = -1;
+      ctx->packets = 0;
+      ctx->next_packet = 0;
       //Empty the receive data ready for new command
-      while( ((*linenum)>22)&&( empty_read_bluetooth( conf, flag, &readRecord, s, &rr, &received, cc, last_sent, &terminated ) >= 0 ));
-      if (flag->debug == 1) printf("[%d] %s Sending\n", (*linenum),debugdate());
-      cc = 0;
+      if( linenum > 22 ) {
+        ctx->rr = 0;
+        ctx->terminated = 0;
+        if( transport_drain( tp, flag ) > 0 ) {
+          ctx->readRecord.Status[0] = 0;
+          ctx->readRecord.Status[1] = 0;
+        }
+      }
+      if (flag->debug == 1) printf("[%d] %s Sending\n", linenum,debugdate());
+      ctx->cc = 0;
       do {
         lineread = strtok(NULL," ;");
-        if( flag->debug == 1 ) printf( "ProcessCommand - processing command %s\n", lineread);
+        if( flag->debug == 1 ) printf( "CommandStep - processing command %s\n", lineread);
         switch(select_str(flag, lineread)) {
 
           case 0: // $END
@@ -291,71 +726,77 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
 
           case 1: // $ADDR
             for (i=0;i<6;i++) {
-              fl[cc] = dest_address[i];
-              cc++;
+              fl[ctx->cc] = dest_address[i];
+              ctx->cc++;
             }
             break;
 
           case 3: // $SERIAL
             for (i=0;i<4;i++){
-              fl[cc] = unit[0]->Serial[i];
-              cc++;
+              fl[ctx->cc] = unit[0]->Serial[i];
+              ctx->cc++;
             }
             break; 
 
           case 7: // $ADD2
             for (i=0;i<6;i++){
-              fl[cc] = conf->MyBTAddress[i];
-              cc++;
+              fl[ctx->cc] = conf->MyBTAddress[i];
+              ctx->cc++;
             }
             break;
 
           case 2: // $TIME 
             // get report time and convert
-            sprintf(tt,"%x",(int)reporttime); //convert to a hex in a string
+            sprintf(tt,"%x",(int)ctx->reporttime); //convert to a hex in a string
             for (i=7;i>0;i=i-2){ //change order and convert to integer
               ti[1] = tt[i];
               ti[0] = tt[i-1]; 
               ti[2] = '\0';
-              fl[cc] = conv(ti);
-              cc++;  
+              fl[ctx->cc] = conv(ti);
+              ctx->cc++;  
             }
             break;
 
           case 11: // $TMPLUS 
              // get report time and convert
-            sprintf(tt,"%x",(int)reporttime+1); //convert to a hex in a string
+            sprintf(tt,"%x",(int)ctx->reporttime+1); //convert to a hex in a string
             for (i=7;i>0;i=i-2){ //change order and convert to integer
               ti[1] = tt[i];
               ti[0] = tt[i-1]; 
               ti[2] = '\0';
-              fl[cc] = conv(ti);
-              cc++;  
+              fl[ctx->cc] = conv(ti);
+              ctx->cc++;  
             }
             break;
 
           case 10: // $TMMINUS
             // get report time and convert
-            sprintf(tt,"%x",(int)reporttime-1); //convert to a hex in a string
+            sprintf(tt,"%x",(int)ctx->reporttime-1); //convert to a hex in a string
             for (i=7;i>0;i=i-2){ //change order and convert to integer
               ti[1] = tt[i];
               ti[0] = tt[i-1]; 
               ti[2] = '\0';
-              fl[cc] = conv(ti);
-              cc++;  
+              fl[ctx->cc] = conv(ti);
+              ctx->cc++;  
             }
             break;
 
           case 4: //$crc
-            tryfcs16(flag, fl+19, cc -19,fl,&cc);
-            add_escapes(fl,&cc);
-            fix_length_send(flag,fl,&cc);
+            if( ctx->to_unit >= 0 )
+              AddressUnit( ctx );
+            tryfcs16(flag, fl+19, ctx->cc -19,fl,&ctx->cc);
+            if( add_escapes(fl,&ctx->cc,sizeof(ctx->fl)) < 0 ) {
+              printf("ERROR: Frame for %s too long to escape\n", ctx->command );
+              free( line );
+              return( CMD_ERROR );
+            }
+            fix_length_send(flag,fl,&ctx->cc);
             break;
 
            case 12: // $TIMESTRING
             for (i=0;i<25;i++){
-              fl[cc] = timestr[i];
-              cc++;
+              fl[ctx->cc] = timestr[i];
+              ctx->cc++;
             }
             break;
 
@@ -364,7 +805,8 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
             if( flag->daterange == 1 ) {
               if( strptime( conf->datefrom, "%Y-%m-%d %H:%M:%S", &tm) == 0 ) {
                 printf("ERROR: Time Conversion Error\n" );
-                return(-1);
+                free( line );
+                return( CMD_ERROR );
               } else {
                 if( flag->debug==1 ) printf( "datefrom %s\n", conf->datefrom );
               }
@@ -380,13 +822,14 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
               fromtime=0;
             }
             if( flag->debug==1 ) printf( "fromtime %d, entering %03x\n", fromtime, (int)fromtime-300);
-            sprintf(tt,"%03x",(int)fromtime-300); //convert to a hex in a string and start 5 mins before for dummy read.
+            ctx->arch_from = fromtime;
+            sprintf(tt,"%03x",(int)fromtime-300); //convert to a hex in a string and start 5 mins before for the baseline
             for (i=7;i>0;i=i-2){ //change order and convert to integer
               ti[1] = tt[i];
               ti[0] = tt[i-1]; 
               ti[2] = '\0';
-              fl[cc] = conv(ti);
-              cc++;  
+              fl[ctx->cc] = conv(ti);
+              ctx->cc++;  
             }
             break;
 
@@ -395,7 +838,8 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
               if( strptime( conf->dateto, "%Y-%m-%d %H:%M:%S", &tm) == 0 ) {
                 if( flag->debug==1 ) printf( "dateto %s\n", conf->dateto );
                 printf("ERROR: Time Coversion error\n" );
-                return(-1);
+                free( line );
+                return( CMD_ERROR );
               } else {
                 if( flag->debug==1 ) printf( "dateto %s\n", conf->dateto );
               }
@@ -417,8 +861,8 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
               ti[1] = tt[i];
               ti[0] = tt[i-1]; 
               ti[2] = '\0';
-              fl[cc] = conv(ti);
-              cc++;  
+              fl[ctx->cc] = conv(ti);
+              ctx->cc++;  
             }
             break;
 
@@ -441,8 +885,8 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
               ti[1] = tt[i];
               ti[0] = tt[i-1]; 
               ti[2] = '\0';
-              fl[cc] = conv(ti);
-              cc++;  
+              fl[ctx->cc] = conv(ti);
+              ctx->cc++;  
             }
             break;
 
@@ -463,8 +907,8 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
               ti[1] = tt[i];
               ti[0] = tt[i-1]; 
               ti[2] = '\0';
-              fl[cc] = conv(ti);
-              cc++;  
+              fl[ctx->cc] = conv(ti);
+              ctx->cc++;  
             }
             break;
 
@@ -472,70 +916,73 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
             j=0;
             for(i=0;i<12;i++) {
               if( conf->Password[j] == '\0' )
-                fl[cc] = 0x88;
+                fl[ctx->cc] = 0x88;
               else {
                 pass_i = conf->Password[j];
-                fl[cc] = (( pass_i+0x88 )%0xff);
+                fl[ctx->cc] = (( pass_i+0x88 )%0xff);
                 j++;
               }
-              cc++;
+              ctx->cc++;
             }
             break; 
 
           case 21: // $SUSyID
             for( i=0; i<2; i++ ) {
-              fl[cc] = unit[0]->SUSyID[i];
-              cc++;
+              fl[ctx->cc] = unit[0]->SUSyID[i];
+              ctx->cc++;
             }
             break;
 
           case 22: // $INVCODE
-            fl[cc] = conf->NetID;
-            cc++;
+            fl[ctx->cc] = conf->NetID;
+            ctx->cc++;
             break;
 
           case 25: // $CNT send counter
-            send_count++;
-            fl[cc] = send_count;
-            cc++;
+            (*ctx->send_count)++;
+            if(( (*ctx->send_count) & 0xff ) == 0 )
+              (*ctx->send_count)++;
+            ctx->sent_cnt = (*ctx->send_count) & 0xff;
+            fl[ctx->cc] = (*ctx->send_count);
+            ctx->cc++;
             break;
 
           case 26: // $TIMEZONE timezone in seconds, reverse endian
-            fl[cc] = tzhex[0];
-            fl[cc+1] = tzhex[1];
-            cc+=2;
+            fl[ctx->cc] = tzhex[0];
+            fl[ctx->cc+1] = tzhex[1];
+            ctx->cc+=2;
             break;
 
           case 27: // $TIMESET unknown setting
             for( i=0; i<4; i++ ) {
-              fl[cc] = timeset[i];
-              cc++;
+              fl[ctx->cc] = timeset[i];
+              ctx->cc++;
             }
             break;
 
           case 29: // $MYSUSYID
             for( i=0; i<2; i++ ) {
-              fl[cc] = conf->MySUSyID[i];
-              cc++;
+              fl[ctx->cc] = conf->MySUSyID[i];
+              ctx->cc++;
             }
             break;
 
           case 30: // $MYSERIAL
             for( i=0; i<4; i++ ) {
-              fl[cc] = conf->MySerial[i];
-              cc++;
+              fl[ctx->cc] = conf->MySerial[i];
+              ctx->cc++;
             }
             break;
 
           default:
-            fl[cc] = conv(lineread);
-            cc++;
+            fl[ctx->cc] = conv(lineread);
+            ctx->cc++;
         } // switch select
       } while (strcmp(lineread,"$END"));
       if (flag->debug == 1){ 
         int last_decoded;
 
-        printf(" cc=%d",cc);
+        printf(" cc=%d",ctx->cc);
         printf( "\n-----------------------------------------------------------" );
         printf( "\nSEND:");
         //Start byte
@@ -551,7 +998,7 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
         printf("                      checkbit:          %d", fl[j] );
         printf("\n   " );
         //Source Address
-        for( i=++j; i<cc; i++ ) {
+        for( i=++j; i<ctx->cc; i++ ) {
           if( i > j+5 ) break;
           printf("%02x ",fl[i]);
         }
@@ -559,7 +1006,7 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
         j=j+5;
         printf("\n   " );
         //Destination Address
-        for( i=++j; i<cc; i++ ) {
+        for( i=++j; i<ctx->cc; i++ ) {
           if( i > j+5 ) break;
           printf("%02x ",fl[i]);
         }
@@ -567,7 +1014,7 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
         j=j+5;
         printf("\n   " );
         //Destination Address
-        for( i=++j; i<cc; i++ ) {
+        for( i=++j; i<ctx->cc; i++ ) {
           if( i > j+1 ) break;
           printf("%02x ",fl[i]);
         }
@@ -577,47 +1024,47 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
         j++;
         if( memcmp( fl+j, "\x7e\xff\x03\x60\x65", 5 ) == 0 ){
           printf("\n");
-          for( i=j; i<cc; i++ ) {
+          for( i=j; i<ctx->cc; i++ ) {
             if( i > j+4 ) break;
             printf("%02x ",fl[i]);
           }
           printf("             SMA Data2+ header: %02x:%02x:%02x:%02x:%02x", fl[j+4], fl[j+3], fl[j+2], fl[j+1], fl[j] );
           j+=5;
           printf("\n   " );
-          for( i=++j; i<cc; i++ ) {
+          for( i=++j; i<ctx->cc; i++ ) {
             if( i > j ) break;
             printf("%02x ",fl[i]);
           }
           printf("                      data packet size:  %02d", fl[j] );
           printf("\n   " );
-          for( i=++j; i<cc; i++ ) {
+          for( i=++j; i<ctx->cc; i++ ) {
             if( i > j ) break;
             printf("%02x ",fl[i]);
           }
           printf("                      SUSYId:            %02x:%02x", fl[j], fl[j+1] );
           j++;
           printf("\n   " );
-          for( i=++j; i<cc; i++ ) {
+          for( i=++j; i<ctx->cc; i++ ) {
             if( i > j+3 ) break;
             printf("%02x ",fl[i]);
           }
           printf("             Serial:            %02x:%02x:%02x:%02x",  fl[j+3], fl[j+2], fl[j+1], fl[j] );
           j=j+3;
           printf("\n   " );
-          for( i=++j; i<cc; i++ ) {
+          for( i=++j; i<ctx->cc; i++ ) {
             if( i > j+1 ) break;
             printf("%02x ",fl[i]);
           }
           printf("                   unknown:           %02x %02x", fl[j+1], fl[j] );
           j++;
           printf("\n   " );
-          for( i=++j; i<cc; i++ ) {
+          for( i=++j; i<ctx->cc; i++ ) {
             if( i > j+1 ) break;
             printf("%02x ",fl[i]);
           }
           printf("                   MySUSId:           %02x:%02x", fl[j+1], fl[j] );
           printf("\n   " );
-          for( i=++j; i<cc; i++ ) {
+          for( i=++j; i<ctx->cc; i++ ) {
             if( i > j+3 ) break;
             printf("%02x ",fl[i]);
           }
@@ -628,72 +1075,122 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
         } // memcompare
         printf("\n   " );
         j=0;
-        for (i=last_decoded;i<cc;i++) {
+        for (i=last_decoded;i<ctx->cc;i++) {
           if( j%16== 0 )
             printf( "\n   %08x: ",j);
           printf("%02x ",fl[i]);
           j++;
         }
-        printf(" rr=%d",(cc+3));
+        printf(" rr=%d",(ctx->cc+3));
         printf("\n\n");
       } // if debug
-      last_sent = (unsigned  char *)realloc( last_sent, sizeof( unsigned char )*(cc));
-      memcpy(last_sent,fl,cc);
-      write((*s),fl,cc);
-      already_read=0;
+      ctx->last_sent = (unsigned  char *)realloc( ctx->last_sent, sizeof( unsigned char )*(ctx->cc));
+      memcpy(ctx->last_sent,fl,ctx->cc);
+      ctx->expect = ExpectedReplies( ctx );
+      transport_send( tp, fl, ctx->cc );
+      ctx->sent_ms = monotonic_ms();
+      ctx->timed = 0;
+      ctx->already_read=0;
     } // if need to Send
 
     if(!strcmp(lineread,"E")) {  //See if line is something we need to extract
-      if( readRecord.Status[0]==0xe0 ) {
-        if (flag->debug == 1) printf("\n%s There is no data currently available, reading remaining records\n", debugdate());
-        // Read the rest of the records
+      if( ctx->readRecord.Status[0]==0xe0 ) {
+        if(( flag->debug == 1 )&&( ctx->wait_for != WAIT_DRAIN )) printf("\n%s There is no data currently available, reading remaining records\n", debugdate());
+        // Read the rest of the records, until the link goes quiet
         do {
+          if(( status = transport_pending( tp )) == 0 ) {
+            ctx->wait_for = WAIT_DRAIN;
+            ctx->wait_ms = tp->timeout*1000;
+            free( line );
+            return( CMD_WAIT_READ );
+          }
           if (flag->debug == 1) printf("Reading Bluetooth data\n");        
-          status = read_bluetooth( conf, flag, &readRecord, s, &rr, &received, cc, last_sent, &terminated );
-        } while(status == 0);
-        if(status < 0) {
-          if (flag->verbose == 1) printf("BT error, returning -1\n");        
-          return(-1);
-        } else {
-          if (flag->debug == 1) printf("Data found, continuing\n");        
-        }
+          if( status > 0 )
+            status = read_bluetooth( conf, flag, &ctx->readRecord, tp, &ctx->rr, received, ctx->cc, ctx->last_sent, &ctx->terminated );
+          else
+            status = -1;
+        } while(status >= 0);
+        if (flag->verbose == 1) printf("BT error, returning -1\n");        
+        free( line );
+        return( CMD_ERROR );
       } else {
-        if (flag->debug == 1) printf("[%d] %s Extracting\n", (*linenum), debugdate());
-        cc = 0;
+        if(( ctx->next_packet == 1 )&&( ctx->expired == 0 )) {
+          // the reply comes in several packets, $ARCHIVEDATA1 goes on with the next
+          if(( status = NextPacket( ctx )) > 0 ) {
+            StreamLabel( ctx, label );
+            ctx->wait_for = WAIT_STREAM;
+            ctx->wait_ms = CommandWaitMs( ctx, label );
+            free( line );
+            return( CMD_WAIT_READ );
+          }
+          if( status < 0 ) {
+            printf("ERROR: Lost the link reading the reply to %s\n", ctx->command );
+            free( line );
+            return( CMD_ERROR );
+          }
+          ctx->next_packet = 0;
+        }
+        if(( ctx->terminated == 0 )&&( ctx->expired == 0 )&&( StreamLine( ctx->cmdfile->lines[ctx->linenum] ) )) {
+          // ReadStream will want the rest of this reply, wait until it is all here
+          StreamLabel( ctx, label );
+          if(( status = transport_message( tp )) == 0 ) {
+            ctx->wait_for = WAIT_STREAM;
+            ctx->wait_ms = CommandWaitMs( ctx, label );
+            free( line );
+            return( CMD_WAIT_READ );
+          }
+          if(( status > 0 )&&( ctx->sent_ms > 0 )&&(( ctx->timed & 2 ) == 0 )) {
+            RttSample( conf, label, monotonic_ms() - ctx->sent_ms );
+            ctx->timed |= 2;
+          }
+        }
+        if( ctx->expired == 1 )
+          tp->timeout = 0; // waited long enough, take what has come
+        if (flag->debug == 1) printf("[%d] %s Extracting\n", linenum, debugdate());
+        ctx->cc = 0;
+        collect = 1;
+        if(( dev = ReplyUnit( ctx, 0 )) == NULL )
+          dev = unit[0];
+        else if( conf->num_units > 1 )
+          printf("Device %s %s\n", dev->SerialStr, dev->Inverter );
+        status = 0;
         do {
           lineread = strtok(NULL," ;");
           switch(select_str(flag, lineread)) {
             case 5: // extract current power $POW
-              if(( data = ReadStream( conf, flag, &readRecord, s, received, &rr, data, &datalen, last_sent, cc, &terminated, &togo )) != NULL ) {
+              if(( status = ReadStream( conf, flag, &ctx->readRecord, tp, received, &ctx->rr, payload, ctx->last_sent, ctx->cc, &ctx->terminated, &ctx->togo )) == 0 ) {
+                datalen = payload->len;
+                memcpy( head, PayloadRecord( payload, 0, sizeof(head) ), sizeof(head) );
                 //printf( "\ndata=%02x:%02x:%02x:%02x:%02x:%02x\n", data[0], (data+1)[0], (data+2)[0], (data+3)[0], (data+4)[0], (data+5)[0] );
-                if( (data+3)[0] == 0x08 )
+                if( head[3] == 0x08 )
                   gap = 40; 
-                if( (data+3)[0] == 0x10 )
+                if( head[3] == 0x10 )
                   gap = 40; 
-                if( (data+3)[0] == 0x40 )
+                if( head[3] == 0x40 )
                   gap = 28;
-                if( (data+3)[0] == 0x00 )
+                if( head[3] == 0x00 )
                   gap = 28;
                 for ( i = 0; i<datalen; i+=gap ) {
-                  idate=ConvertStreamtoTime( data+i+4, 4, &idate, &day, &month, &year, &hour, &minute, &second );
-                  ConvertStreamtoFloat( data+i+8, 3, &currentpower_total );
+                  data = PayloadRecord( payload, i, gap );
+                  idate=ConvertStreamtoTime( data+4, 4, &idate, &day, &month, &year, &hour, &minute, &second );
+                  ConvertStreamtoFloat( data+8, 3, &currentpower_total );
                   return_key=-1;
                   for( j=0; j<conf->num_return_keys; j++ ) {
-                    if(( (data+i+1)[0] == conf->returnkeylist[j].key1 )&&((data+i+2)[0] == conf->returnkeylist[j].key2)) {
+                    if(( (data+1)[0] == conf->returnkeylist[j].key1 )&&((data+2)[0] == conf->returnkeylist[j].key2)) {
                       return_key=j;
                       break;
                     }
                   }
                   if( return_key >= 0 ) {
                     printf("Current power: %4d-%02d-%02d %02d:%02d:%02d %-20s = %.0f %-20s\n", year, month, day, hour, minute, second, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, conf->returnkeylist[return_key].units );
-                    inverter_serial=(unit[0]->Serial[3]<<24) + (unit[0]->Serial[2]<<16) + (unit[0]->Serial[1]<<8) + unit[0]->Serial[0];
+                    inverter_serial=(dev->Serial[3]<<24) + (dev->Serial[2]<<16) + (dev->Serial[1]<<8) + dev->Serial[0];
                   } else
-                    if( (data+0)[0] > 0 )
-                      printf("Current power: %4d-%02d-%02d %02d:%02d:%02d NO DATA for %02x %02x = %.0f NO UNITS\n", year, month, day, hour, minute, second, (data+i+1)[0], (data+i+1)[1], currentpower_total );
+                    if( head[0] > 0 )
+                      printf("Current power: %4d-%02d-%02d %02d:%02d:%02d NO DATA for %02x %02x = %.0f NO UNITS\n", year, month, day, hour, minute, second, (data+1)[0], (data+1)[1], currentpower_total );
                 }
-                free( data );
+                PayloadLast( payload, received, ctx->rr );
                 break;
-              } else
+              } else if( status < 0 )
                 //An Error has occurred
                 printf("ERROR: Current Power (5) - ReadStream no data");
               break;
@@ -728,10 +1225,10 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
                 memcpy(timeset,received+79,4);
                 idate=ConvertStreamtoTime( received+63,4, &idate, &day, &month, &year, &hour, &minute, &second  );
                 /* Allow delay for inverter to be slow */
-                if( reporttime > idate ) {
-                  if( flag->debug == 1 ) printf( "Delay = %d\n", (int)(reporttime-idate) );
+                if( ctx->reporttime > idate ) {
+                  if( flag->debug == 1 ) printf( "Delay = %d\n", (int)(ctx->reporttime-idate) );
                   //sleep( reporttime - idate );
-                  sleep(5);    //was sleeping for > 1min excessive
+                  pause_ms = 5000;    //was sleeping for > 1min excessive
                 }
               } else {
                 if (received[61]==0x7e) {
@@ -740,75 +1237,92 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
                   memcpy(timestr,received+63,24);
                   if (flag->debug == 1) printf("bad extracting timestring\n");
                 }
-                already_read=0;
+                ctx->already_read=0;
                 found=0;
                 strcpy( lineread, "" );
-                failedbluetooth++;
-                if( failedbluetooth > 60 ) {
+                ctx->failedbluetooth++;
+                if( ctx->failedbluetooth > 60 ) {
                   printf("ERROR: Failed Bluetooth");
-                  return(-1);
+                  free( line );
+                  return( CMD_ERROR );
                 }
               }
               break;
 
             case 17: // Test data
-              if(( data = ReadStream( conf, flag,  &readRecord, s, received, &rr, data, &datalen, last_sent, cc, &terminated, &togo )) != NULL ) {
+              if(( status = ReadStream( conf, flag, &ctx->readRecord, tp, received, &ctx->rr, payload, ctx->last_sent, ctx->cc, &ctx->terminated, &ctx->togo )) == 0 ) {
                 printf( "Test data (17)\n" );
-                free( data );
+                PayloadLast( payload, received, ctx->rr );
                 break;
-              } else
+              } else if( status < 0 )
                 printf("ERROR: Test data (17) - ReadStream no data");
                 //An Error has occurred
               break;
     
             case 18: // $ARCHIVEDATA1
-              finished=0;
-              ptotal=0;
-              idate=0;
-              while( finished != 1 ) {
-                if(( data = ReadStream( conf, flag,  &readRecord, s, received, &rr, data, &datalen, last_sent, cc, &terminated, &togo )) != NULL ) {
-                  j=0;
-                  for( i=0; i<datalen; i++ ) {
-                    datarecord[j]=data[i];
-                    j++;
-                    if( j > 11 ) {
-                      if( idate > 0 ) prev_idate=idate;
-                      else prev_idate=0;
-                      idate=ConvertStreamtoTime( datarecord, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
-                      if( prev_idate == 0 ) prev_idate = idate-300;
-                      ConvertStreamtoFloat( datarecord+4, 8, &gtotal );
-                      if((*archdatalen) == 0 ) ptotal = gtotal;
-                      printf("%4d-%02d-%02d %02d:%02d:%02d  total=%.3f kWh current=%.0f Watts togo=%d i=%d datalen=%d\n", year, month, day, hour, minute,second, gtotal/1000, (gtotal-ptotal)*12, togo, i, datalen);
-                      if( idate != prev_idate+300 ) {
-                        printf( "Date Error! prev=%d current=%d\n", (int)prev_idate, (int)idate );
-                        break;
-                      }
-                      if( (*archdatalen) == 0 )
-                        (*archdatalist) = ( ArchDataType *)malloc( sizeof( ArchDataType ) );
-                      else
-                        (*archdatalist) = ( ArchDataType *)realloc( (*archdatalist), sizeof( ArchDataType )*((*archdatalen)+1));
-                      ((*archdatalist)+(*archdatalen))->date=idate;
-                      strcpy(((*archdatalist)+(*archdatalen))->inverter,unit[0]->Inverter);
-                      inverter_serial=(unit[0]->Serial[0]<<24) + (unit[0]->Serial[1]<<16) + (unit[0]->Serial[2]<<8) + unit[0]->Serial[3];
-                      ((*archdatalist)+(*archdatalen))->serial=inverter_serial;
-                      ((*archdatalist)+(*archdatalen))->accum_value=gtotal/1000;
-                      ((*archdatalist)+(*archdatalen))->current_value=(gtotal-ptotal)*12;
-                      (*archdatalen)++;
-                      ptotal=gtotal;
-                      j=0; //get ready for another record
-                    }
-                  } // for i todatalen
-                  if( togo == 0 ) {
-                    finished=1;
-                  } else {
-                    if (flag->debug == 1) printf("\nStill records to go (%d)...\n", togo);
-                  }
-                } else
-                  //An Error has occurred
-                  printf("ERROR: ReadStream no data");
+              collect = 0; // asked of one device at a time, see to_unit
+              unit_done = 1;
+              if( ctx->next_packet == 1 ) {
+                // waited long enough for the next packet
+                printf("ERROR: No more archive data after %d records, %d packets to go\n", (*archdatalen), ctx->togo );
+                ctx->packets = 0;
+                ctx->next_packet = 0;
+                printf( "\n" );
                 break;
               }
-              free( data );
+              ptotal = ( ctx->packets > 0 ) ? ctx->arch_total : 0;
+              idate = ( ctx->packets > 0 ) ? ctx->arch_date : 0;
+              if(( status = ReadStream( conf, flag, &ctx->readRecord, tp, received, &ctx->rr, payload, ctx->last_sent, ctx->cc, &ctx->terminated, &ctx->togo )) == 0 ) {
+                datalen = payload->len;
+                // 12 byte records, date and total, read where they came in
+                for( i=0; i+12<=datalen; i+=12 ) {
+                  data = PayloadRecord( payload, i, 12 );
+                  if( idate > 0 ) prev_idate=idate;
+                  else prev_idate=0;
+                  idate=ConvertStreamtoTime( data, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
+                  if( prev_idate == 0 ) prev_idate = idate-300;
+                  ConvertStreamtoFloat( data+4, 8, &gtotal );
+                  if(( ptotal == 0 )||( idate < ctx->arch_from )) {
+                    // the record before the range, or the first with none before it,
+                    // is only the baseline of the next: it has no current power
+                    ptotal = gtotal;
+                    continue;
+                  }
+                  printf("%4d-%02d-%02d %02d:%02d:%02d  total=%.3f kWh current=%.0f Watts togo=%d i=%d datalen=%d\n", year, month, day, hour, minute,second, gtotal/1000, (gtotal-ptotal)*12, ctx->togo, i+11, datalen);
+                  if( idate != prev_idate+300 ) {
+                    printf( "Date Error! prev=%d current=%d\n", (int)prev_idate, (int)idate );
+                    break;
+                  }
+                  if( (*archdatalen) == 0 )
+                    (*archdatalist) = ( ArchDataType *)malloc( sizeof( ArchDataType ) );
+                  else
+                    (*archdatalist) = ( ArchDataType *)realloc( (*archdatalist), sizeof( ArchDataType )*((*archdatalen)+1));
+                  ((*archdatalist)+(*archdatalen))->date=idate;
+                  strcpy(((*archdatalist)+(*archdatalen))->inverter,dev->Inverter);
+                  inverter_serial=(dev->Serial[0]<<24) + (dev->Serial[1]<<16) + (dev->Serial[2]<<8) + dev->Serial[3];
+                  ((*archdatalist)+(*archdatalen))->serial=inverter_serial;
+                  ((*archdatalist)+(*archdatalen))->accum_value=gtotal/1000;
+                  ((*archdatalist)+(*archdatalen))->current_value=(gtotal-ptotal)*12;
+                  (*archdatalen)++;
+                  ptotal=gtotal;
+                } // for i todatalen
+                PayloadLast( payload, received, ctx->rr );
+                if( ctx->togo > 0 ) {
+                  // the rest follows unasked, this E line runs again on the next packet
+                  if (flag->debug == 1) printf("\nStill records to go (%d)...\n", ctx->togo);
+                  ctx->packets++;
+                  ctx->next_packet = 1;
+                  ctx->arch_total = ptotal;
+                  ctx->arch_date = idate;
+                  unit_done = 0;
+                  break;
+                }
+                ctx->packets = 0;
+              } else {
+                //An Error has occurred
+                if( status < 0 ) printf("ERROR: ReadStream no data");
+                PayloadLast( payload, received, ctx->rr );
+              }
               printf( "\n" );
               break;
               
@@ -831,47 +1345,52 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
               break;
 
             case 24: // Inverter data $INVERTERDATA
-              if(( data = ReadStream( conf, flag,  &readRecord, s, received, &rr, data, &datalen, last_sent, cc, &terminated, &togo )) != NULL ) {
-                if( flag->debug==1 ) printf( "Inverter data = %02x\n",(data+3)[0] );
-                if( (data+3)[0] == 0x08 )
+              if(( status = ReadStream( conf, flag, &ctx->readRecord, tp, received, &ctx->rr, payload, ctx->last_sent, ctx->cc, &ctx->terminated, &ctx->togo )) == 0 ) {
+                datalen = payload->len;
+                memcpy( head, PayloadRecord( payload, 0, sizeof(head) ), sizeof(head) );
+                if( flag->debug==1 ) printf( "Inverter data = %02x\n",head[3] );
+                if( head[3] == 0x08 )
                   gap = 40; 
-                if( (data+3)[0] == 0x10 )
+                if( head[3] == 0x10 )
                   gap = 40; 
-                if( (data+3)[0] == 0x40 )
+                if( head[3] == 0x40 )
                   gap = 28;
-                if( (data+3)[0] == 0x00 )
+                if( head[3] == 0x00 )
                   gap = 28;
                 for ( i = 0; i<datalen; i+=gap ) {
-                  idate=ConvertStreamtoTime( data+i+4, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
-                  ConvertStreamtoFloat( data+i+8, 3, &currentpower_total );
+                  data = PayloadRecord( payload, i, gap );
+                  idate=ConvertStreamtoTime( data+4, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
+                  ConvertStreamtoFloat( data+8, 3, &currentpower_total );
                   return_key=-1;
                   for( j=0; j<conf->num_return_keys; j++ ) {
-                    if(( (data+i+1)[0] == conf->returnkeylist[j].key1 )&&((data+i+2)[0] == conf->returnkeylist[j].key2)) {
+                    if(( (data+1)[0] == conf->returnkeylist[j].key1 )&&((data+2)[0] == conf->returnkeylist[j].key2)) {
                       return_key=j;
                       break;
                     }
                   }
                   if( return_key >= 0 ) {
-                    if( i==0 ) printf("Inverter data: %4d-%02d-%02d  %02d:%02d:%02d %s\n", year, month, day, hour, minute, second, (data+i+8) );
+                    if( i==0 ) printf("Inverter data: %4d-%02d-%02d  %02d:%02d:%02d %s\n", year, month, day, hour, minute, second, (data+8) );
                     printf("Inverter data: %4d-%02d-%02d %02d:%02d:%02d %-20s = %.0f %-20s\n", year, month, day, hour, minute, second, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, conf->returnkeylist[return_key].units );
                   } else
-                    if( data[0]>0 )
-                      printf("Inverter data: %4d-%02d-%02d %02d:%02d:%02d NO DATA for %02x %02x = %.0f NO UNITS \n", year, month, day, hour, minute, second, (data+i+1)[0], (data+i+1)[0], currentpower_total );
+                    if( head[0]>0 )
+                      printf("Inverter data: %4d-%02d-%02d %02d:%02d:%02d NO DATA for %02x %02x = %.0f NO UNITS \n", year, month, day, hour, minute, second, (data+1)[0], (data+1)[0], currentpower_total );
                 }
-                free( data );
+                PayloadLast( payload, received, ctx->rr );
                 break;
-              } else
+              } else if( status < 0 )
                 //An Error has occurred
                 printf("ERROR: ReadStream no data");
               break;
 
             case 28: // extract data $DATA
-              if(( data = ReadStream( conf, flag, &readRecord, s, received, &rr, data, &datalen, last_sent, cc, &terminated, &togo )) != NULL ) {
+              if(( status = ReadStream( conf, flag, &ctx->readRecord, tp, received, &ctx->rr, payload, ctx->last_sent, ctx->cc, &ctx->terminated, &ctx->togo )) == 0 ) {
+                datalen = payload->len;
+                memcpy( head, PayloadRecord( payload, 0, sizeof(head) ), sizeof(head) );
                 if( flag->debug == 1 ) printf( "Extract data (28)\n"); 
                 gap = 0;
                 return_key=-1;
                 for( j=0; j<conf->num_return_keys; j++ ) {
-                  if(( (data+1)[0] == conf->returnkeylist[j].key1 )&&((data+2)[0] == conf->returnkeylist[j].key2)) {
+                  if(( head[1] == conf->returnkeylist[j].key1 )&&(head[2] == conf->returnkeylist[j].key2)) {
                     if( flag->debug == 2 ) printf( "Key found\n"); 
                     return_key=j;
                     break;
@@ -882,14 +1401,19 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
                   datalength=conf->returnkeylist[return_key].datalength;
                 } else {
                   if( datalen > 0 ) {
-                    printf( "\nFailed to find key %02x:%02x (datalen = %d)\n", (data+1)[0], (data+2)[0], datalen );
+                    printf( "\nFailed to find key %02x:%02x (datalen = %d)\n", head[1], head[2], datalen );
                   }
+                  datalen = 0; // without its record gap there is no stepping through it
                 }
                 for ( i = 0; i<datalen; i+=gap ) {
-                  idate=ConvertStreamtoTime( data+i+4, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
+                  data = PayloadRecord( payload, i, ( gap > datalength+8 ) ? gap : datalength+8 );
+                  // a merged request also reads what lies between the ranges of its commands
+                  if(( ctx->plan != NULL )&&( PlanKeep( ctx->plan, (data+1)[0], (data+2)[0] ) == 0 ))
+                    continue;
+                  idate=ConvertStreamtoTime( data+4, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
                   return_key=-1;
                   for( j=0; j<conf->num_return_keys; j++ ) {
-                    if(( (data+i+1)[0] == conf->returnkeylist[j].key1 )&&((data+i+2)[0] == conf->returnkeylist[j].key2)) {
+                    if(( (data+1)[0] == conf->returnkeylist[j].key1 )&&((data+2)[0] == conf->returnkeylist[j].key2)) {
                       return_key=j;
                       break;
                     }
@@ -898,94 +1422,103 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
                     if( flag->debug == 1 ) printf( "Extract data: Switch returnkeylist %d\n", conf->returnkeylist[return_key].decimal); 
                     switch( conf->returnkeylist[return_key].decimal ) {
                       case 0 :
-                        ConvertStreamtoFloat( data+i+8, datalength, &currentpower_total );
+                        ConvertStreamtoFloat( data+8, datalength, &currentpower_total );
                         if( currentpower_total == 0 )
                           persistent=1;
                         else
                           persistent = conf->returnkeylist[return_key].persistent;
                         printf("%4d-%02d-%02d %02d:%02d:%02d %-30s = %.0f '%-20s'\n", year, month, day, hour, minute, second, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, conf->returnkeylist[return_key].units );
-                        UpdateLiveList( conf, flag, unit[0], "%.0f",  idate, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, -1, (char *)NULL, conf->returnkeylist[return_key].units, persistent, livedatalen, livedatalist );
+                        UpdateLiveList( conf, flag, dev, "%.0f",  idate, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, -1, (char *)NULL, conf->returnkeylist[return_key].units, persistent, livedatalen, livedatalist );
                         break;
                         
                       case 1 :
-                        ConvertStreamtoFloat( data+i+8, datalength, &currentpower_total );
+                        ConvertStreamtoFloat( data+8, datalength, &currentpower_total );
                         if( currentpower_total == 0 )
                           persistent=1;
                         else
                           persistent = conf->returnkeylist[return_key].persistent;
                         printf("%4d-%02d-%02d %02d:%02d:%02d %-30s = %.1f '%-20s'\n", year, month, day, hour, minute, second, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, conf->returnkeylist[return_key].units );
-                        UpdateLiveList( conf, flag, unit[0], "%.1f",  idate, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, -1, (char *)NULL, conf->returnkeylist[return_key].units, persistent, livedatalen, livedatalist );
+                        UpdateLiveList( conf, flag, dev, "%.1f",  idate, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, -1, (char *)NULL, conf->returnkeylist[return_key].units, persistent, livedatalen, livedatalist );
                         break;
                         
                       case 2 :
-                        ConvertStreamtoFloat( data+i+8, datalength, &currentpower_total );
+                        ConvertStreamtoFloat( data+8, datalength, &currentpower_total );
                         if( currentpower_total == 0 )
                           persistent=1;
                         else
                           persistent = conf->returnkeylist[return_key].persistent;
                         printf("%4d-%02d-%02d %02d:%02d:%02d %-30s = %.2f '%-20s'\n", year, month, day, hour, minute, second, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, conf->returnkeylist[return_key].units );
-                        UpdateLiveList( conf, flag, unit[0], "%.2f",  idate, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, -1, (char *)NULL, conf->returnkeylist[return_key].units, persistent, livedatalen, livedatalist );
+                        UpdateLiveList( conf, flag, dev, "%.2f",  idate, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, -1, (char *)NULL, conf->returnkeylist[return_key].units, persistent, livedatalen, livedatalist );
                         break;
 
                       case 3 :
-                        ConvertStreamtoFloat( data+i+8, datalength, &currentpower_total );
+                        ConvertStreamtoFloat( data+8, datalength, &currentpower_total );
                         if( currentpower_total == 0 )
                           persistent=1;
                         else
                           persistent = conf->returnkeylist[return_key].persistent;
                         printf("%4d-%02d-%02d %02d:%02d:%02d %-30s = %.3f '%-20s'\n", year, month, day, hour, minute, second, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, conf->returnkeylist[return_key].units );
-                        UpdateLiveList( conf, flag, unit[0], "%.3f",  idate, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, -1, (char *)NULL, conf->returnkeylist[return_key].units, persistent, livedatalen, livedatalist );
+                        UpdateLiveList( conf, flag, dev, "%.3f",  idate, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, -1, (char *)NULL, conf->returnkeylist[return_key].units, persistent, livedatalen, livedatalist );
                         break;
 
                       case 4 :
-                        ConvertStreamtoFloat( data+i+8, datalength, &currentpower_total );
+                        ConvertStreamtoFloat( data+8, datalength, &currentpower_total );
                         if( currentpower_total == 0 )
                           persistent=1;
                         else
                           persistent = conf->returnkeylist[return_key].persistent;
                         printf("%4d-%02d-%02d %02d:%02d:%02d %-30s = %.4f '%-20s'\n", year, month, day, hour, minute, second, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, conf->returnkeylist[return_key].units );
-                        UpdateLiveList( conf, flag, unit[0], "%.4f",  idate, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, -1, (char *)NULL, conf->returnkeylist[return_key].units, persistent, livedatalen, livedatalist );
+                        UpdateLiveList( conf, flag, dev, "%.4f",  idate, conf->returnkeylist[return_key].description, currentpower_total/conf->returnkeylist[return_key].divisor, -1, (char *)NULL, conf->returnkeylist[return_key].units, persistent, livedatalen, livedatalist );
                         break;
 
                       case 97 :
-                        idate=ConvertStreamtoTime( data+i+4, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
+                        idate=ConvertStreamtoTime( data+4, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
                         printf("                    %-30s = %d-%02d-%02d %02d:%02d:%02d\n", conf->returnkeylist[return_key].description, year, month, day, hour, minute, second );
                         sprintf( valuebuf, "%4d-%02d-%02d %02d:%02d:%02d", year, month, day, hour, minute, second );
-                        UpdateLiveList( conf, flag, unit[0], "%s",  idate, conf->returnkeylist[return_key].description, -1.0, -1, valuebuf, conf->returnkeylist[return_key].units, conf->returnkeylist[return_key].persistent, livedatalen, livedatalist );
+                        UpdateLiveList( conf, flag, dev, "%s",  idate, conf->returnkeylist[return_key].description, -1.0, -1, valuebuf, conf->returnkeylist[return_key].units, conf->returnkeylist[return_key].persistent, livedatalen, livedatalist );
+                        MetaPut( conf, dev, ctx->command, (data+1)[0], (data+2)[0], idate, 97, 0, valuebuf );
                         break;
                         
                       case 98 :
-                        idate=ConvertStreamtoTime( data+i+4, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
-                        ConvertStreamtoInt( data+i+8, 2, &index );
-                        datastring = return_xml_data( conf, index );
+                        idate=ConvertStreamtoTime( data+4, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
+                        ConvertStreamtoInt( data+8, 2, &index );
+                        // each code is only looked up in the XML once
+                        if(( cached = MetaCode( conf, (data+1)[0], (data+2)[0], index )) != NULL )
+                          datastring = strdup( cached );
+                        else
+                          datastring = return_xml_data( conf, index );
                         printf("%4d-%02d-%02d %02d:%02d:%02d %-30s = '%s' '%-20s'\n", year, month, day, hour, minute, second, conf->returnkeylist[return_key].description, datastring, conf->returnkeylist[return_key].units );
-                        UpdateLiveList( conf, flag, unit[0], "%s",  idate, conf->returnkeylist[return_key].description, -1.0, -1, datastring, conf->returnkeylist[return_key].units, conf->returnkeylist[return_key].persistent, livedatalen, livedatalist );
-                        if( (data+i+1)[0]==0x20 && (data+i+2)[0] == 0x82 ) {
-                          strcpy( unit[0]->Inverter, datastring );
+                        UpdateLiveList( conf, flag, dev, "%s",  idate, conf->returnkeylist[return_key].description, -1.0, -1, datastring, conf->returnkeylist[return_key].units, conf->returnkeylist[return_key].persistent, livedatalen, livedatalist );
+                        if( (data+1)[0]==0x20 && (data+2)[0] == 0x82 ) {
+                          strcpy( dev->Inverter, datastring );
                         }
+                        MetaPut( conf, dev, ctx->command, (data+1)[0], (data+2)[0], idate, 98, index, datastring );
                         free( datastring);
                         break;
                         
                       case 99 :
-                        idate=ConvertStreamtoTime( data+i+4, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
-                        datastring = ConvertStreamtoString( data+i+8, datalength );
-                        if (flag->debug == 1) printf("datastring = %s (from stream '%s', length %d)\n", datastring, data+i+8, datalength);
+                        idate=ConvertStreamtoTime( data+4, 4, &idate, &day, &month, &year, &hour, &minute, &second  );
+                        datastring = ConvertStreamtoString( data+8, datalength );
+                        if (flag->debug == 1) printf("datastring = %s (from stream '%s', length %d)\n", datastring, data+8, datalength);
                         printf("%4d-%02d-%02d %02d:%02d:%02d %-30s = '%s' '%-20s'\n", year, month, day, hour, minute, second, conf->returnkeylist[return_key].description, datastring, conf->returnkeylist[return_key].units );
-                        UpdateLiveList( conf, flag, unit[0], "%s",  idate, conf->returnkeylist[return_key].description, -1.0, -1, datastring, conf->returnkeylist[return_key].units, conf->returnkeylist[return_key].persistent, livedatalen, livedatalist );
+                        UpdateLiveList( conf, flag, dev, "%s",  idate, conf->returnkeylist[return_key].description, -1.0, -1, datastring, conf->returnkeylist[return_key].units, conf->returnkeylist[return_key].persistent, livedatalen, livedatalist );
+                        MetaPut( conf, dev, ctx->command, (data+1)[0], (data+2)[0], idate, 99, 0, datastring );
                         free( datastring );
                         break;
                     } // switch returnkeylist decimal
+                    if( conf->returnkeylist[return_key].decimal < 97 )
+                      MetaPut( conf, dev, ctx->command, (data+1)[0], (data+2)[0], idate, conf->returnkeylist[return_key].decimal, 0, NULL );
                   } else { // if return_key > 0
-                    if( data[0]>0 )
-                      printf("%4d-%02d-%02d %02d:%02d:%02d NO DATA for %02x %02x (current power = %.0f) NO UNITS\n", year, month, day, hour, minute, second, (data+i+1)[0], (data+i+1)[1], currentpower_total );
+                    if( head[0]>0 )
+                      printf("%4d-%02d-%02d %02d:%02d:%02d NO DATA for %02x %02x (current power = %.0f) NO UNITS\n", year, month, day, hour, minute, second, (data+1)[0], (data+1)[1], currentpower_total );
                     break;
                   }
                 } // for i to datalen
-                free( data );
+                PayloadLast( payload, received, ctx->rr );
                 break;
               } else {
                 //An Error has occurred
-                printf("ERROR: Extract data (28) - ReadStream no data");
+                if( status < 0 ) printf("ERROR: Extract data (28) - ReadStream no data");
                 break;
               }
               
@@ -993,47 +1526,94 @@ int ProcessCommand( ConfType * conf, FlagType * flag, UnitType **unit, int *s, F
               idate=ConvertStreamtoTime( received+59, 4, &idate, &day, &month, &year, &hour, &minute, &second );
               if( flag->verbose == 1) printf("Inverter date = %4d-%02d-%02d %02d:%02d:%02d\n",year, month, day, hour, minute,second);
               if (flag->debug == 1) printf("SUSyID = %02x:%02x\n", received[33], received[34]);
-              unit[0]->Serial[3]=received[35];
-              unit[0]->Serial[2]=received[36];
-              unit[0]->Serial[1]=received[37];
-              unit[0]->Serial[0]=received[38];
-              if (flag->debug == 1) printf( "Serial = %02x:%02x:%02x:%02x\n",unit[0]->Serial[3]&0xff,unit[0]->Serial[2]&0xff,unit[0]->Serial[1]&0xff,unit[0]->Serial[0]&0xff );  
-              //This is where we poll for other inverters
-              inverter_serial=(unit[0]->Serial[0]<<24) + (unit[0]->Serial[1]<<16) + (unit[0]->Serial[2]<<8) + unit[0]->Serial[3];
-              sprintf( unit[0]->SerialStr, "%llu", inverter_serial ); 
-              //This is where we poll for other inverters
-              unit[0]->SUSyID[0]=received[33];
-              unit[0]->SUSyID[1]=received[34];
-              //This is where we poll for other inverters
+              // every device on the NetID answers the login, each gets a unit
+              dev = ReplyUnit( ctx, 1 );
+              dev->Serial[3]=received[35];
+              dev->Serial[2]=received[36];
+              dev->Serial[1]=received[37];
+              dev->Serial[0]=received[38];
+              if (flag->debug == 1) printf( "Serial = %02x:%02x:%02x:%02x\n",dev->Serial[3]&0xff,dev->Serial[2]&0xff,dev->Serial[1]&0xff,dev->Serial[0]&0xff );  
+              inverter_serial=(dev->Serial[0]<<24) + (dev->Serial[1]<<16) + (dev->Serial[2]<<8) + dev->Serial[3];
+              sprintf( dev->SerialStr, "%llu", inverter_serial ); 
+              dev->SUSyID[0]=received[33];
+              dev->SUSyID[1]=received[34];
+              // a device may have joined or left since the last login
+              if( conf->NetID > 1 )
+                ctx->expect = -1;
               break;
           } // switch select lineread
         } while (strcmp(lineread,"$END"));
+        if( status > 0 ) {
+          // ReadStream dropped the reply with a bad FCS, wait for it or send again
+          StreamLabel( ctx, label );
+          ctx->wait_for = WAIT_STREAM;
+          ctx->wait_ms = CommandWaitMs( ctx, label );
+          free( line );
+          return( CMD_WAIT_READ );
+        }
       } // if/else extract - ReadRecord Status 
     } // if need to extract
-    if( flag->debug == 1 ) printf( "ProcessCommand - going to next line\n");
-  } // while readline 
+    if( ctx->next_packet == 1 ) {
+      ctx->wait_for = WAIT_NONE;
+      ctx->waited = 0;
+      ctx->expired = 0;
+      tp->timeout = conf->bt_timeout;
+      continue; // the same E line on the next packet
+    }
+    if(( unit_done )&&( ctx->to_unit >= 0 )&&( ctx->send_line >= 0 )&&( ctx->to_unit+1 < conf->num_units )) {
+      // the same request again for the next device
+      ctx->to_unit++;
+      unit_done = 0;
+      ctx->linenum = ctx->send_line;
+      ctx->wait_for = WAIT_NONE;
+      ctx->waited = 0;
+      ctx->expired = 0;
+      tp->timeout = conf->bt_timeout;
+      continue;
+    }
+    if( flag->debug == 1 ) printf( "CommandStep - going to next line\n");
+    ctx->linenum = linenum;
+    ctx->after_line = -1;
+    if(( collect == 1 )&&( ctx->reply_line >= 0 )&&(( ctx->expect < 0 )||( ctx->replies < ctx->expect ))) {
+      // more devices on the NetID answer the same request, run R and E again for each
+      if( flag->debug == 1 ) printf( "[%d] %s Reply %d of %d, waiting for the next device\n", linenum, debugdate(), ctx->replies, ctx->expect );
+      ctx->after_line = linenum;
+      ctx->linenum = ctx->reply_line;
+    }
+    ctx->wait_for = WAIT_NONE;
+    ctx->waited = 0;
+    ctx->expired = 0;
+    tp->timeout = conf->bt_timeout;
+    if( pause_ms > 0 ) {
+      // the line is done, carry on with the next one after the pause
+      ctx->wait_ms = pause_ms;
+      free( line );
+      return( CMD_WAIT_TIME );
+    }
+  } // while lines
+  free( line );
   // EZ added:
-  if( flag->debug == 1 ) printf( "End of ProcessCommand, returning 0\n"); 
-  return (0);
+  if( flag->debug == 1 ) printf( "End of command, returning 0\n"); 
+  return( CMD_DONE );
 }
 
 /*
  * Get Line number of the command required
  * reurn line number on success 0 on failure
  */
-int GetLine( const char * command, FILE * fp )
+int GetLine( const char * command, CommandFileType * cmdfile )
 {
-    char *line = NULL;
-    size_t len=0;
-    ssize_t read;
+    char line[1024];
     char *lineread;
     int  linenum=0;
     int  found=0;
 
-    while (( read = getline(&line,&len,fp) ) != -1){ //read line from sma.in
+    while ( linenum < cmdfile->num_lines ){ //read line from sma.in
+ strncpy( line, cmdfile->lines[linenum], sizeof(line)-1 );
+ line[sizeof(line)-1] = '\0';
  linenum++;
  lineread = strtok(line," ;");
- if(!strncmp(lineread,":", 1)){ //See if line is something we need to receive
+ if(( lineread != NULL )&&( !strncmp(lineread,":", 1) )){ //See if line is something we need to receive
             if( ! strcmp( lineread+1, command ) )
             {
                 found=1;
@@ -1042,7 +1622,6 @@ int GetLine( const char * command, FILE * fp )
         }
     }
     if( !found ) linenum=0;
-    free(line);
     return linenum;
 }
 
@@ -1050,26 +1629,23 @@ int GetLine( const char * command, FILE * fp )
  * Run a command on an inverter
  *
  */
-int InverterCommand(  const char * command, ConfType * conf, FlagType * flag, UnitType **unit, int *s, FILE * fp, ArchDataType **archdatalist, int *archdatalen , LiveDataType **livedatalist, int *livedatalen)
+int InverterCommand(  const char * command, ConfType * conf, FlagType * flag, UnitType **unit, TransportType *tp, CommandFileType * cmdfile, ArchDataType **archdatalist, int *archdatalen , LiveDataType **livedatalist, int *livedatalen)
 {
-  int linenum;
-  int result;
+  const char * commands[2];
 
-  if (fseek( fp, 0L, 0 ) < 0 ) {
-    printf("ERROR: Cannot seek sma.in file" );
-    return -1;
-  }
-  if(( linenum = GetLine( command, fp )) > 0 ) {
-    result = ProcessCommand( conf, flag, unit, s, fp, &linenum, archdatalist, archdatalen, livedatalist, livedatalen );
-    if(result < 0) {
-      printf("ERROR: Cannot process Command %s\n", command);
-      return -1;
-    } else {
-      return result;
-    }
-  } else {
-    //Command not found in config
-    printf("ERROR: Command %s not found in config!\n", command );
-    return -1;
-  }
+  commands[0] = command;
+  commands[1] = NULL;
+  return InverterCommands( commands, conf, flag, unit, tp, cmdfile, archdatalist, archdatalen, livedatalist, livedatalen );
+}
+
+/*
+ * Run a list of commands on an inverter, stopping at the first one that fails
+ *
+ */
+int InverterCommands( const char ** commands, ConfType * conf, FlagType * flag, UnitType **unit, TransportType *tp, CommandFileType * cmdfile, ArchDataType **archdatalist, int *archdatalen , LiveDataType **livedatalist, int *livedatalen)
+{
+  SessionType session;
+
+  SessionInit( &session, commands, conf, flag, unit, tp, cmdfile, archdatalist, archdatalen, livedatalist, livedatalen );
+  return RunSessions( &session, 1 );
 }
@@ -16,12 +16,96 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
+#ifndef H_SB_COMMANDS
+  #define H_SB_COMMANDS
+
 #include "sma_struct.h"
+#include "transport.h"
+#include "payload.h"
+
+/* CommandStep results */
+#define CMD_ERROR     -1
+#define CMD_DONE       0
+#define CMD_WAIT_READ  1        /* wait for the link to become readable */
+#define CMD_WAIT_TIME  2        /* wait wait_ms before carrying on */
+
+/* What a CMD_WAIT_READ is waiting for */
+#define WAIT_NONE      0
+#define WAIT_REPLY     1        /* the reply an R line matches */
+#define WAIT_STREAM    2        /* the rest of a reply an E line reads */
+#define WAIT_DRAIN     3        /* more records after an e0 status */
 
-extern int ConnectSocket ( ConfType * conf );
+/* State of one sma.in command being run, kept between lines so it can wait */
+typedef struct{
+  ConfType * conf;
+  FlagType * flag;
+  UnitType ** unit;
+  TransportType * tp;
+  CommandFileType * cmdfile;
+  char command[40];             /* sma.in command being run, labels its round trip times */
+  PlanType * plan;              /* merged request being run, NULL for an sma.in command */
+  ArchDataType ** archdatalist;
+  int * archdatalen;
+  LiveDataType ** livedatalist;
+  int * livedatalen;
+  int  linenum;                 /* sma.in lines done, lines[linenum] runs next */
+  int  wait_for;                /* WAIT_* */
+  int  wait_ms;                 /* how long the wait may take */
+  int  waited;                  /* ms this line has already timed out after */
+  int  expired;                 /* a WAIT_STREAM timed out */
+  unsigned char fl[1024];       /* frame being built or matched */
+  int  cc;
+  unsigned char received[1024]; /* last frame read, unescaped */
+  int  rr;
+  PayloadType payload;          /* multi-frame reply ReadStream read, E lines extract from it */
+  ReadRecordType readRecord;
+  unsigned char * last_sent;
+  long sent_ms;                 /* when last_sent went out */
+  int  timed;                   /* 1 reply and 2 stream round trips of last_sent measured */
+  int  send_line;               /* index of the S line that sent last_sent, -1 if none */
+  int  sent_cnt;                /* $CNT packet id in last_sent, -1 if none */
+  int  retries;                 /* times last_sent was sent again */
+  int  resend;                  /* the S line is running as a retransmit */
+  int  expect;                  /* replies to last_sent, one per device, -1 until they stop */
+  int  replies;                 /* replies to last_sent matched so far */
+  int  reply_line;              /* index of the R line of last_sent, -1 if none */
+  int  after_line;              /* collecting more replies, index of the line after the E line */
+  int  already_read;
+  int  terminated;
+  int  togo;
+  int  packets;                 /* packets of a reply in several read so far */
+  int  next_packet;             /* the next of them has still to come */
+  float arch_total;             /* $ARCHIVEDATA1 total and date of the last record, */
+  time_t arch_date;             /* carried on to the next packet */
+  time_t arch_from;             /* $TIMEFROM1, records before it are only a baseline */
+  int  to_unit;                 /* $ARCHIVEDATA1 with several devices: the one asked now, else -1 */
+  int  failedbluetooth;
+  int  * send_count;            /* $CNT packet ids of the link, shared by the commands on it */
+  time_t reporttime;
+  unsigned char dest_address[6];
+  unsigned char timestr[25];
+  unsigned char timeset[4];
+  unsigned char tzhex[2];
+} CommandContext;
 
 extern int OpenInverter( ConfType * conf, FlagType * flag, UnitType **unit, int * s, ArchDataType **archdatalist, int *archdatalen , LiveDataType **livedatalist, int *livedatalen );
 
-extern int InverterCommand(  const char * command, ConfType * conf, FlagType * flag, UnitType **unit, int *s, FILE * fp, ArchDataType **archdatalist, int *archdatalen , LiveDataType **livedatalist, int *livedatalen);
+extern int ReadCommandFile( CommandFileType * cmdfile, const char * filename );
+
+extern void FreeCommandFile( CommandFileType * cmdfile );
+
+extern int CommandStart( CommandContext * ctx, const char * command );
+
+extern int CommandStep( CommandContext * ctx );
+
+extern int CommandTimeout( CommandContext * ctx );
+
+extern void CommandEnd( CommandContext * ctx );
+
+extern int InverterCommand(  const char * command, ConfType * conf, FlagType * flag, UnitType **unit, TransportType *tp, CommandFileType * cmdfile, ArchDataType **archdatalist, int *archdatalen , LiveDataType **livedatalist, int *livedatalen);
+
+extern int InverterCommands( const char ** commands, ConfType * conf, FlagType * flag, UnitType **unit, TransportType *tp, CommandFileType * cmdfile, ArchDataType **archdatalist, int *archdatalen , LiveDataType **livedatalist, int *livedatalen);
+
+//extern int ReadStream( ConfType *, FlagType *, ReadRecordType *, TransportType *, unsigned char *, int *, PayloadType *, unsigned char *, int , int *, int * );
 
-//extern unsigned char * ReadStream( ConfType *, FlagType *, ReadRecordType *, int *, unsigned char *, int *, unsigned char *, int *, unsigned char *, int , int *, int * );
+#endif
@@ -0,0 +1,705 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE /* glibc needs this */
+
+/*
+ * Scheduler for polling several inverters over one adapter.  Each sma.in
+ * command of a poll becomes a job with a class: the type label first since
+ * live rows are tagged with it, then the live values, then the archive.
+ * A getrangedata backfill is cut into slices of ArchiveSlice minutes that
+ * run in the idle time between polls, so the next poll of any inverter only
+ * waits for the slice being read.
+ * A command with a Schedule line is only queued once per its interval,
+ * counted from the epoch so its reads keep to whole multiples of it, and
+ * the others once per poll.  When each last ran is kept in StateDir/schedule.
+ * Near the deadline of a poll (CycleBudget) only live jobs are started,
+ * the others wait for the next chance; jobs still running at the deadline
+ * are cut off, an archive job then reads a shorter slice next time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sma_struct.h"
+#include "transport.h"
+#include "sb_commands.h"
+#include "engine.h"
+#include "rtt.h"
+#include "pool.h"
+#include "sched.h"
+#include "plan.h"
+
+static const char * sched_names[SCHED_CLASSES] = { "metadata", "live", "archive" };
+
+static const struct{
+  const char * command;
+  int class;
+} sched_classes[] = {
+  { "typelabel", SCHED_META },
+  { "TypeLabel", SCHED_META },
+  { "startuptime", SCHED_META },
+  { "getrangedata", SCHED_ARCHIVE },
+  { NULL, SCHED_LIVE }
+};
+
+/* The class of an sma.in command, live unless listed above */
+int sched_class( const char * command )
+{
+  int i;
+
+  for( i=0; sched_classes[i].command != NULL; i++ )
+    if( strcmp( sched_classes[i].command, command ) == 0 )
+      break;
+  return( sched_classes[i].class );
+}
+
+/* datefrom/dateto are local time, as $TIMEFROM1 and $TIMETO1 read them */
+time_t sched_time( const char * date )
+{
+  struct tm tm;
+
+  memset( &tm, 0, sizeof(tm) );
+  if( strptime( date, "%Y-%m-%d %H:%M:%S", &tm ) == NULL )
+    return( -1 );
+  tm.tm_isdst=-1;
+  return( mktime( &tm ) );
+}
+
+void sched_date( char * date, time_t t )
+{
+  struct tm tm;
+
+  localtime_r( &t, &tm );
+  strftime( date, 40, "%Y-%m-%d %H:%M:%S", &tm );
+}
+
+/* The Schedule of an sma.in command in seconds, 0 to read it every poll */
+int SchedInterval( ConfType * conf, const char * command )
+{
+  int i;
+
+  for( i=0; i<conf->num_schedules; i++ )
+    if( strcmp( conf->schedulelist[i].command, command ) == 0 )
+      return( conf->schedulelist[i].interval );
+  return( 0 );
+}
+
+/* Read StateDir/schedule if there is one */
+void sched_load( SchedType * sched )
+{
+  PoolType *pool = sched->pool;
+  FILE *fp;
+  char path[200];
+  char line[400];
+  char address[20], command[40];
+  long ran;
+  int e, c, n=0;
+
+  sprintf( path, "%s/schedule", pool->conf->StateDir );
+  if(( fp = fopen( path, "r" )) == NULL )
+    return;
+  while( fgets( line, sizeof(line), fp ) != NULL ) {
+    if(( line[0] == '#' )||( sscanf( line, "%19s %39s %ld", address, command, &ran ) != 3 ))
+      continue;
+    for( e=0; e<pool->num_entries; e++ ) {
+      if( strcmp( pool->entries[e].conf.BTAddress, address ) != 0 )
+        continue;
+      for( c=0; c<sched->num_commands; c++ )
+        if(( sched->intervals[c] > 0 )&&( strcmp( sched->commands[c], command ) == 0 )) {
+          sched->ran[e*sched->num_commands+c] = ran;
+          n++;
+        }
+    }
+  }
+  fclose( fp );
+  if( pool->flag->debug == 1 ) printf("Loaded %d scheduled reads from %s\n", n, path );
+}
+
+/* Write StateDir/schedule */
+void SchedSave( SchedType * sched )
+{
+  PoolType *pool = sched->pool;
+  FILE *fp;
+  char path[200], tmppath[210];
+  int e, c;
+
+  for( c=0; ( c<sched->num_commands )&&( sched->intervals[c] == 0 ); c++ );
+  if( c == sched->num_commands )
+    return;
+  sprintf( path, "%s/schedule", pool->conf->StateDir );
+  sprintf( tmppath, "%s.tmp", path );
+  if(( fp = fopen( tmppath, "w" )) == NULL ) {
+    if( pool->flag->debug == 1 ) printf("Cannot write %s, not keeping the scheduled reads\n", tmppath );
+    return;
+  }
+  fprintf( fp, "# address command last read, seconds since the epoch\n" );
+  for( e=0; e<pool->num_entries; e++ )
+    for( c=0; c<sched->num_commands; c++ )
+      if(( sched->intervals[c] > 0 )&&( sched->ran[e*sched->num_commands+c] > 0 ))
+        fprintf( fp, "%s %s %ld\n", pool->entries[e].conf.BTAddress, sched->commands[c], (long)sched->ran[e*sched->num_commands+c] );
+  fclose( fp );
+  if( rename( tmppath, path ) < 0 )
+    printf("ERROR: Cannot update %s\n", path );
+}
+
+int SchedInit( SchedType * sched, PoolType * pool, const char ** commands, int budget, int window, time_t slice )
+{
+  PlanType *plan;
+  int e, c;
+
+  memset( sched, 0, sizeof(SchedType) );
+  sched->pool = pool;
+  sched->commands = commands;
+  sched->budget = ( budget > 0 ) ? budget : 1;
+  sched->window = ( window > 0 ) ? window : 1;
+  sched->slice = slice;
+  for( sched->num_commands=0; commands[sched->num_commands] != NULL; sched->num_commands++ );
+  sched->intervals = (int *)calloc( sched->num_commands+1, sizeof(int) );
+  sched->ran = (time_t *)calloc( pool->num_entries*sched->num_commands+1, sizeof(time_t) );
+  sched->tokens = (int *)calloc( pool->num_entries, sizeof(int) );
+  sched->down = (int *)calloc( pool->num_entries, sizeof(int) );
+  sched->batch = (int *)calloc( pool->num_entries, sizeof(int) );
+  sched->slots = (SchedSlotType *)calloc( pool->num_entries, sizeof(SchedSlotType) );
+  sched->sessions = (SessionType *)calloc( pool->num_entries, sizeof(SessionType) );
+  sched->entries = (PoolEntryType **)calloc( pool->num_entries, sizeof(PoolEntryType *) );
+  sched->indexes = (int *)calloc( pool->num_entries, sizeof(int) );
+  if(( sched->intervals == NULL )||( sched->ran == NULL )||( sched->tokens == NULL )||( sched->down == NULL )||( sched->batch == NULL )||( sched->slots == NULL )||( sched->sessions == NULL )||( sched->entries == NULL )||( sched->indexes == NULL )) {
+    printf("ERROR: Out of memory\n" );
+    return( -1 );
+  }
+  for( e=0; e<pool->num_entries; e++ ) {
+    sched->slots[e].jobs = (SchedJobType *)calloc( sched->window, sizeof(SchedJobType) );
+    sched->slots[e].commands = (const char **)calloc( sched->window+1, sizeof(const char *) );
+    if(( sched->slots[e].jobs == NULL )||( sched->slots[e].commands == NULL )) {
+      printf("ERROR: Out of memory\n" );
+      return( -1 );
+    }
+  }
+  for( c=0; c<sched->num_commands; c++ ) {
+    plan = PlanFind( pool->cmdfile, commands[c] );
+    sched->intervals[c] = ( plan != NULL ) ? plan->interval : SchedInterval( pool->conf, commands[c] );
+    if(( sched->intervals[c] > 0 )&&( pool->flag->debug == 1 )) printf("Reading %s every %d s\n", commands[c], sched->intervals[c] );
+  }
+  sched_load( sched );
+  return( 0 );
+}
+
+/* Index of the first job of entry running command, or -1 */
+int sched_find( SchedType * sched, int entry, const char * command )
+{
+  int i;
+
+  for( i=0; i<sched->num_jobs; i++ )
+    if(( sched->jobs[i].entry == entry )&&( strcmp( sched->jobs[i].command, command ) == 0 ))
+      return( i );
+  return( -1 );
+}
+
+int sched_queue( SchedType * sched, SchedJobType * job )
+{
+  SchedJobType *jobs;
+  SchedStatType *stat = sched->stats+job->class;
+
+  if(( jobs = (SchedJobType *)realloc( sched->jobs, sizeof(SchedJobType) * ( sched->num_jobs + 1 ))) == NULL ) {
+    printf("ERROR: Out of memory\n" );
+    return( -1 );
+  }
+  sched->jobs = jobs;
+  job->queued = monotonic_ms();
+  sched->jobs[sched->num_jobs++] = *job;
+  if( ++stat->depth > stat->depth_max )
+    stat->depth_max = stat->depth;
+  return( 0 );
+}
+
+void sched_remove( SchedType * sched, int index )
+{
+  sched->stats[sched->jobs[index].class].depth--;
+  sched->num_jobs--;
+  memmove( sched->jobs+index, sched->jobs+index+1, sizeof(SchedJobType) * ( sched->num_jobs - index ));
+}
+
+/*
+ * Is command c due on inverter e at now: on a full poll without a Schedule,
+ * else when it has not run yet in the interval now is in.  Metadata is also
+ * read on a full poll until the inverter's devices have their names, which
+ * tag the live values
+ */
+int sched_due( SchedType * sched, int e, int c, int full, time_t now )
+{
+  PoolEntryType *entry = sched->pool->entries+e;
+  int interval = sched->intervals[c];
+  time_t ran = sched->ran[e*sched->num_commands+c];
+
+  if( interval == 0 )
+    return( full );
+  if(( ran == 0 )||( now/interval != ran/interval ))
+    return( 1 );
+  if(( full )&&( sched_class( sched->commands[c] ) == SCHED_META )&&(( entry->conf.num_units == 0 )||( entry->unit->Inverter[0] == '\0' )))
+    return( 1 );
+  return( 0 );
+}
+
+/* The classes with a command due, as 1 << SCHED_* bits */
+int SchedDue( SchedType * sched, int full )
+{
+  time_t now = time(NULL);
+  int e, c, due=0;
+
+  for( e=0; e<sched->pool->num_entries; e++ )
+    for( c=0; c<sched->num_commands; c++ )
+      if( sched_due( sched, e, c, full, now ))
+        due |= 1 << sched_class( sched->commands[c] );
+  return( due );
+}
+
+/*
+ * Queue the commands due for every inverter, all of a poll when full and
+ * else only those with a Schedule.  A command still queued from the last
+ * time is not added again; an archive backfill still going is extended to
+ * the new dateto instead.
+ * Returns 0 on success and -1 on error
+ */
+int SchedCycle( SchedType * sched, int full )
+{
+  PoolType *pool = sched->pool;
+  SchedJobType job;
+  time_t from, to, now;
+  int e, c, i;
+
+  from = sched_time( pool->conf->datefrom );
+  to = sched_time( pool->conf->dateto );
+  sched->cycled = now = time(NULL);
+  for( i=0; i<sched->num_jobs; i++ )
+    sched->jobs[i].deferred = 0; // a new poll, say so again if they still wait
+  for( e=0; e<pool->num_entries; e++ ) {
+    sched->down[e] = 0;
+    sched->tokens[e] = sched->budget;
+    for( c=0; c<sched->num_commands; c++ ) {
+      if( sched_due( sched, e, c, full, now ) == 0 )
+        continue;
+      if(( i = sched_find( sched, e, sched->commands[c] )) >= 0 ) {
+        if(( sched->jobs[i].to > 0 )&&( to > sched->jobs[i].to ))
+          sched->jobs[i].to = to;
+        continue;
+      }
+      memset( &job, 0, sizeof(job) );
+      job.entry = e;
+      job.command = sched->commands[c];
+      job.class = sched_class( job.command );
+      job.due = now;
+      if(( job.class == SCHED_ARCHIVE )&&( from > 0 )&&( to >= from )) {
+        job.from = from;
+        job.to = to;
+        job.slice = sched->slice;
+      }
+      if( sched_queue( sched, &job ) < 0 )
+        return( -1 );
+    }
+  }
+  return( 0 );
+}
+
+/*
+ * When the next command with a Schedule falls due, 0 if none has one.  One
+ * that was due at the last SchedCycle and has not run since, as its
+ * inverter failed, waits for its next interval; one still queued is not
+ * counted, the archive it reads runs between polls
+ */
+time_t SchedNextDue( SchedType * sched )
+{
+  time_t now = time(NULL);
+  time_t next=0, due, ran;
+  int e, c, interval;
+
+  for( c=0; c<sched->num_commands; c++ ) {
+    if(( interval = sched->intervals[c] ) == 0 )
+      continue;
+    for( e=0; e<sched->pool->num_entries; e++ ) {
+      if( sched_find( sched, e, sched->commands[c] ) >= 0 )
+        continue;
+      ran = sched->ran[e*sched->num_commands+c];
+      due = ( ran > 0 ) ? ( ran/interval + 1 ) * interval : 0;
+      if( due <= sched->cycled )
+        due = ( now/interval + 1 ) * interval;
+      else if( due < now )
+        due = now;
+      if(( next == 0 )||( due < next ))
+        next = due;
+    }
+  }
+  return( next );
+}
+
+/* Is the deadline so near that only live jobs start */
+int sched_late( SchedType * sched )
+{
+  ConfType *conf = sched->pool->conf;
+
+  return(( conf->deadline > 0 )&&( conf->deadline - monotonic_ms() < conf->cycle_budget*1000L/SCHED_RESERVE ));
+}
+
+/* Note a job of entry for the summary, what is set apart */
+void sched_note( SchedType * sched, int entry, const char * command, const char * what )
+{
+  size_t len = strlen( sched->late );
+
+  if( sched->pool->num_entries > 1 )
+    snprintf( sched->late+len, sizeof(sched->late)-len, " %s on %s%s", command, sched->pool->entries[entry].conf.BTAddress, what );
+  else
+    snprintf( sched->late+len, sizeof(sched->late)-len, " %s%s", command, what );
+}
+
+/* Pass over the jobs of class for now, keeping them queued */
+void sched_defer( SchedType * sched, int class )
+{
+  int i;
+
+  for( i=0; i<sched->num_jobs; i++ ) {
+    if(( sched->jobs[i].class != class )||( sched->jobs[i].deferred ))
+      continue;
+    sched->jobs[i].deferred = 1;
+    sched->stats[class].deferred++;
+    sched_note( sched, sched->jobs[i].entry, sched->jobs[i].command, "" );
+  }
+}
+
+/*
+ * The next job to run: the highest class with a job of an inverter still
+ * up and not running one already, from the inverter whose turn it is,
+ * preferring one that is logged in.  Near the deadline only live jobs.
+ * Turns are refilled when every inverter with such a job has used its own,
+ * but not for the second job on, which would mostly swap links in and out.
+ * Returns the job index or -1
+ */
+int sched_pick( SchedType * sched, int max_class )
+{
+  PoolType *pool = sched->pool;
+  int n = pool->num_entries;
+  int class, pass, refilled, i, k, e, waiting, late, picked=0;
+
+  for( e=0; e<n; e++ )
+    picked |= sched->batch[e];
+  late = sched_late( sched );
+  for( class=0; class<=max_class; class++ ) {
+    if(( late )&&( class != SCHED_LIVE )) {
+      sched_defer( sched, class );
+      continue;
+    }
+    for( refilled=0; refilled<2; refilled++ ) {
+      waiting = 0;
+      for( pass=0; pass<2; pass++ ) {
+        for( k=0; k<n; k++ ) {
+          e = ( sched->next + k ) % n;
+          if( sched->down[e] || sched->batch[e] )
+            continue;
+          for( i=0; i<sched->num_jobs; i++ )
+            if(( sched->jobs[i].entry == e )&&( sched->jobs[i].class == class ))
+              break;
+          if( i == sched->num_jobs )
+            continue;
+          waiting = 1;
+          if(( sched->tokens[e] > 0 )&&(( pass == 1 )||( pool->entries[e].connected )))
+            return( i );
+        }
+      }
+      if( !waiting || picked )
+        break;
+      for( e=0; e<n; e++ )
+        sched->tokens[e] = sched->budget;
+    }
+  }
+  return( -1 );
+}
+
+/* An inverter failed: drop its jobs until the next poll, except the archive which is kept to resume */
+void sched_down( SchedType * sched, int entry )
+{
+  int i;
+
+  sched->down[entry] = 1;
+  for( i=sched->num_jobs-1; i>=0; i-- ) {
+    if(( sched->jobs[i].entry == entry )&&( sched->jobs[i].class != SCHED_ARCHIVE )) {
+      sched->stats[sched->jobs[i].class].dropped++;
+      sched_remove( sched, i );
+    }
+  }
+}
+
+/*
+ * Add a job's records to the shared list.  The archive lists of the
+ * inverters run together carry no baseline records, see $ARCHIVEDATA1, so
+ * they are joined as they are
+ */
+int sched_append( void ** list, int * len, void * add, int addlen, size_t size )
+{
+  void *grown;
+
+  if( addlen == 0 )
+    return( 0 );
+  if(( grown = realloc( *list, size * ( *len + addlen ))) == NULL ) {
+    printf("ERROR: Out of memory\n" );
+    return( -1 );
+  }
+  memcpy( (char *)grown + size * (*len), add, size * addlen );
+  *list = grown;
+  *len += addlen;
+  return( 0 );
+}
+
+/* The job is done, it is next due in the interval after the one it was queued in */
+void sched_done( SchedType * sched, SchedJobType * job )
+{
+  int c;
+
+  for( c=0; c<sched->num_commands; c++ )
+    if( sched->commands[c] == job->command )
+      sched->ran[job->entry*sched->num_commands+c] = job->due;
+}
+
+/* The job was still running at the deadline, an archive job reads half as much next time */
+void sched_cut( SchedType * sched, SchedJobType * job )
+{
+  sched->stats[job->class].deferred++;
+  sched_note( sched, job->entry, job->command, " (cut off)" );
+  if( job->to > 0 ) {
+    job->slice = (( job->slice > 0 ) ? job->slice : job->to - job->from + 1 ) / 2;
+    if( job->slice < SCHED_MIN_SLICE )
+      job->slice = SCHED_MIN_SLICE;
+  }
+}
+
+/* The job failed with its inverter, keeping an archive job to resume */
+void sched_failed( SchedType * sched, SchedJobType * job )
+{
+  if( job->class == SCHED_ARCHIVE ) sched_queue( sched, job );
+  sched_down( sched, job->entry );
+}
+
+/* Move a queued job into the slot of its inverter, using up one of its turn */
+void sched_take( SchedType * sched, SchedSlotType * slot, int index )
+{
+  SchedJobType *job = slot->jobs+slot->num_jobs;
+  SchedStatType *stat;
+  long wait;
+
+  *job = sched->jobs[index];
+  sched_remove( sched, index );
+  stat = sched->stats+job->class;
+  wait = monotonic_ms() - job->queued;
+  stat->jobs++;
+  stat->wait_total += wait;
+  if( wait > stat->wait_max )
+    stat->wait_max = wait;
+  sched->tokens[job->entry]--;
+  slot->commands[slot->num_jobs++] = job->command;
+  slot->commands[slot->num_jobs] = NULL;
+  RttAdd( sched->pool->conf, job->command ); // before the inverters get their copies of the list
+  if( sched->pool->flag->debug == 1 ) printf("Running %s job %s after %ld ms queued\n", sched_names[job->class], job->command, wait );
+}
+
+/*
+ * The next queued job of entry and class that can go in flight with those
+ * taken already, or -1.  An archive job runs on its own
+ */
+int sched_more( SchedType * sched, SchedSlotType * slot )
+{
+  SchedJobType *first = slot->jobs;
+  int i;
+
+  if(( slot->num_jobs >= sched->window )||( sched->tokens[first->entry] <= 0 )||( first->class == SCHED_ARCHIVE ))
+    return( -1 );
+  for( i=0; i<sched->num_jobs; i++ )
+    if(( sched->jobs[i].entry == first->entry )&&( sched->jobs[i].class == first->class ))
+      return( i );
+  return( -1 );
+}
+
+/*
+ * Run the next jobs of class max_class or higher for up to PoolSize
+ * inverters, all at once.  Each inverter runs up to Pipeline jobs of one
+ * class, with their requests in flight together.  Their data is added to
+ * the lists as each inverter's block, in the order the inverters were
+ * picked.
+ * Returns 0 if they ran, -1 if any failed and SCHED_IDLE if there were none
+ */
+int SchedRun( SchedType * sched, int max_class, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen )
+{
+  PoolType *pool = sched->pool;
+  FlagType *flag = pool->flag;
+  SessionType *sessions = sched->sessions;
+  SchedSlotType *slot;
+  SchedJobType *job;
+  int max, num, n, k, j, e, index, status, result=0;
+
+  max = ( pool->conf->pool_size < pool->num_entries ) ? pool->conf->pool_size : pool->num_entries;
+  if( max < 1 ) max = 1;
+  memset( sched->batch, 0, sizeof(int) * pool->num_entries );
+  for( num=0; ( num < max )&&(( index = sched_pick( sched, max_class )) >= 0 ); num++ ) {
+    slot = sched->slots+num;
+    slot->num_jobs = 0;
+    slot->entry = NULL;
+    slot->session = -1;
+    slot->to = 0;
+    slot->archdatalist = NULL;
+    slot->archdatalen = 0;
+    slot->livedatalist = NULL;
+    slot->livedatalen = 0;
+    do
+      sched_take( sched, slot, index );
+    while(( index = sched_more( sched, slot )) >= 0 );
+    e = slot->jobs->entry;
+    sched->next = ( sched->tokens[e] > 0 ) ? e : ( e + 1 ) % pool->num_entries;
+    sched->batch[e] = 1;
+    sched->indexes[num] = e;
+  }
+  if( num == 0 )
+    return( SCHED_IDLE );
+
+  PoolGetMany( pool, sched->indexes, sched->entries, num, archdatalist, archdatalen, livedatalist, livedatalen );
+  for( n=0, k=0; k<num; k++ ) {
+    slot = sched->slots+k;
+    job = slot->jobs;
+    if(( slot->entry = sched->entries[k] ) == NULL ) {
+      for( j=0; j<slot->num_jobs; j++ )
+        sched_failed( sched, slot->jobs+j );
+      result = -1;
+      continue;
+    }
+    if(( pool->num_entries > 1 )&&( flag->verbose == 1 )) {
+      printf("Inverter %s", slot->entry->conf.BTAddress );
+      for( j=0; j<slot->num_jobs; j++ )
+        printf(" %s", slot->jobs[j].command );
+      printf("\n");
+    }
+    if( job->to > 0 ) {
+      // the range it was queued for, or the next slice of it
+      slot->to = (( job->slice > 0 )&&( job->to - job->from >= job->slice )) ? job->from + job->slice - 1 : job->to;
+      sched_date( slot->entry->conf.datefrom, job->from );
+      sched_date( slot->entry->conf.dateto, slot->to );
+      if(( job->slice > 0 )&&( flag->verbose == 1 )) printf("Archive slice %s to %s\n", slot->entry->conf.datefrom, slot->entry->conf.dateto );
+    }
+    slot->session = n;
+    SessionInit( sessions+n, slot->commands, &slot->entry->conf, flag, &slot->entry->unit, &slot->entry->tp, pool->cmdfile, &slot->archdatalist, &slot->archdatalen, &slot->livedatalist, &slot->livedatalen );
+    sessions[n++].window = sched->window; // the jobs are separate reads, their requests can overlap
+  }
+  RunSessions( sessions, n );
+
+  for( k=0; k<num; k++ ) {
+    slot = sched->slots+k;
+    job = slot->jobs;
+    if( slot->session < 0 )
+      continue;
+    status = sched_append( (void **)archdatalist, archdatalen, slot->archdatalist, slot->archdatalen, sizeof(ArchDataType) );
+    if( status == 0 )
+      status = sched_append( (void **)livedatalist, livedatalen, slot->livedatalist, slot->livedatalen, sizeof(LiveDataType) );
+    free( slot->archdatalist );
+    free( slot->livedatalist );
+    if( status < 0 ) {
+      // its records are lost, an archive job reads its range again
+      PoolPut( pool, slot->entry, 1 );
+      for( j=0; j<slot->num_jobs; j++ )
+        sched_failed( sched, slot->jobs+j );
+      result = -1;
+    } else if( sessions[slot->session].overran ) {
+      // the link is fine, late replies to it are told apart by packet id
+      PoolPut( pool, slot->entry, 1 );
+      for( j=0; j<slot->num_jobs; j++ ) {
+        sched_cut( sched, slot->jobs+j );
+        sched_failed( sched, slot->jobs+j );
+      }
+    } else if( sessions[slot->session].state != SESSION_DONE ) {
+      PoolPut( pool, slot->entry, 0 );
+      for( j=0; j<slot->num_jobs; j++ )
+        sched_failed( sched, slot->jobs+j );
+      result = -1;
+    } else {
+      PoolPut( pool, slot->entry, 1 );
+      if(( job->to > 0 )&&( slot->to < job->to )) {
+        // rest of the range later, a longer slice if this one was empty
+        job->from = slot->to + 1;
+        job->slice = ( slot->archdatalen > 0 ) ? sched->slice : job->slice * 2;
+        if( sched_queue( sched, job ) < 0 )
+          result = -1;
+      } else
+        sched_done( sched, job );
+      for( j=1; j<slot->num_jobs; j++ )
+        sched_done( sched, slot->jobs+j );
+    }
+  }
+  return( result );
+}
+
+/* Jobs queued of class max_class or higher */
+int SchedPending( SchedType * sched, int max_class )
+{
+  int i, pending=0;
+
+  for( i=0; i<sched->num_jobs; i++ )
+    if( sched->jobs[i].class <= max_class )
+      pending++;
+  return( pending );
+}
+
+void SchedStats( SchedType * sched )
+{
+  SchedStatType *stat;
+  int c;
+
+  for( c=0; c<SCHED_CLASSES; c++ ) {
+    stat = sched->stats+c;
+    printf("Scheduler %s: %lu jobs, %lu dropped, %lu deferred, wait avg %ld ms max %ld ms, queued %d max %d\n", sched_names[c], stat->jobs, stat->dropped, stat->deferred, ( stat->jobs > 0 ) ? stat->wait_total / (long)stat->jobs : 0, stat->wait_max, stat->depth, stat->depth_max );
+  }
+}
+
+/*
+ * Say which jobs were deferred or cut off for the cycle budget since the
+ * last time.  Returns 1 if there were any, otherwise 0
+ */
+int SchedLate( SchedType * sched )
+{
+  if( sched->late[0] == '\0' )
+    return( 0 );
+  printf("Deferred for the cycle budget:%s\n", sched->late );
+  sched->late[0] = '\0';
+  return( 1 );
+}
+
+void SchedFree( SchedType * sched )
+{
+  int e;
+
+  for( e=0; ( sched->slots != NULL )&&( e<sched->pool->num_entries ); e++ ) {
+    free( sched->slots[e].jobs );
+    free( sched->slots[e].commands );
+  }
+  free( sched->jobs );
+  free( sched->intervals );
+  free( sched->ran );
+  free( sched->tokens );
+  free( sched->down );
+  free( sched->batch );
+  free( sched->slots );
+  free( sched->sessions );
+  free( sched->entries );
+  free( sched->indexes );
+  sched->jobs = NULL;
+  sched->num_jobs = 0;
+}
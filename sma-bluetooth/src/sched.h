@@ -0,0 +1,114 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef H_SCHED
+  #define H_SCHED
+
+#include <time.h>
+#include "sma_struct.h"
+#include "engine.h"
+#include "pool.h"
+
+#define SCHED_META    0         /* what the device is, needed to tag its data */
+#define SCHED_LIVE    1         /* spot values, read every poll */
+#define SCHED_ARCHIVE 2         /* getrangedata backfill */
+#define SCHED_CLASSES 3
+
+#define SCHED_IDLE    1         /* SchedRun found nothing to run */
+#define SCHED_MIN_SLICE 3600    /* seconds, an archive job cut off is not made shorter */
+#define SCHED_RESERVE 4         /* 1/4 of CycleBudget before the deadline only live jobs start */
+
+/* One sma.in command due on one inverter */
+typedef struct{
+  int  entry;                 /* pool index of the inverter */
+  const char * command;
+  int  class;                 /* SCHED_*, lower runs first */
+  long queued;                /* ms, when it was queued */
+  time_t from;                /* archive: start of the range still to read */
+  time_t to;                  /* archive: end of it, 0 to use datefrom/dateto as they are */
+  time_t slice;               /* archive: seconds to read next, 0 for all at once */
+  time_t due;                 /* when it was queued, its last run once done */
+  int  deferred;              /* passed over for the cycle budget */
+} SchedJobType;
+
+/* The jobs of an inverter being run, with their own data lists until they are done */
+typedef struct{
+  SchedJobType * jobs;        /* of one class, up to Pipeline of them in flight at once */
+  int  num_jobs;
+  PoolEntryType * entry;
+  const char ** commands;     /* their commands for the session, NULL terminated */
+  int  session;               /* index in the sessions run, -1 for none */
+  time_t to;                  /* archive: end of the slice read */
+  ArchDataType * archdatalist;
+  int  archdatalen;
+  LiveDataType * livedatalist;
+  int  livedatalen;
+} SchedSlotType;
+
+typedef struct{
+  unsigned long jobs;         /* run */
+  unsigned long dropped;      /* given up with their inverter */
+  unsigned long deferred;     /* passed over or cut off for the cycle budget */
+  long wait_total;            /* ms queued, of the jobs run */
+  long wait_max;
+  int  depth;                 /* queued now */
+  int  depth_max;
+} SchedStatType;
+
+/*
+ * Jobs of all inverters sharing the adapter, up to Pipeline per inverter
+ * at a time and up to PoolSize inverters at once: the highest class first,
+ * and within a class the inverters take turns of up to SchedBudget jobs.
+ */
+typedef struct{
+  PoolType * pool;
+  const char ** commands;     /* sma.in commands of a poll */
+  int  num_commands;
+  int  * intervals;           /* per command, its Schedule in seconds, 0 for every poll */
+  time_t * ran;               /* per inverter and command, when it last ran, 0 for never */
+  time_t cycled;              /* last SchedCycle */
+  char late[400];             /* jobs deferred or cut off since SchedLate */
+  SchedJobType * jobs;        /* queued, in order */
+  int  num_jobs;
+  int  * tokens;              /* per inverter, jobs left in its turn */
+  int  * down;                /* per inverter, failed this poll */
+  int  * batch;               /* per inverter, has a job in the ones run now */
+  SchedSlotType * slots;      /* the jobs run now, one slot per inverter at most */
+  SessionType * sessions;     /* and their sessions */
+  PoolEntryType ** entries;   /* and their inverters */
+  int  * indexes;             /* and their pool indexes */
+  int  next;                  /* inverter whose turn it is */
+  int  budget;
+  int  window;                /* jobs of an inverter run in one session, Pipeline */
+  time_t slice;               /* seconds per archive job, 0 to read the range at once */
+  SchedStatType stats[SCHED_CLASSES];
+} SchedType;
+
+extern int  SchedInit( SchedType * sched, PoolType * pool, const char ** commands, int budget, int window, time_t slice );
+extern int  SchedInterval( ConfType * conf, const char * command );
+extern int  SchedDue( SchedType * sched, int full );
+extern int  SchedCycle( SchedType * sched, int full );
+extern time_t SchedNextDue( SchedType * sched );
+extern int  SchedRun( SchedType * sched, int max_class, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen );
+extern int  SchedPending( SchedType * sched, int max_class );
+extern void SchedStats( SchedType * sched );
+extern int  SchedLate( SchedType * sched );
+extern void SchedSave( SchedType * sched );
+extern void SchedFree( SchedType * sched );
+
+#endif
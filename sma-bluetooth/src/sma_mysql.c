@@ -277,3 +277,31 @@ void live_mysql( ConfType * conf, FlagType * flag, LiveDataType *livedatalist, i
   CloseMySqlDatabase();
   if (flag->debug == 1) printf("End live_mysql\n");
 }
+
+void archive_mysql( ConfType * conf, FlagType * flag, ArchDataType *archdatalist, int archdatalen )
+/* Archive inverter values mysql update */
+{
+  struct tm *utctime;
+  char SQLQUERY[1024];
+  char datetime[40];
+  int day,month,year,hour,minute,second;
+  int i;
+
+  OpenMySqlDatabase( conf->MySqlHost, conf->MySqlUser, conf->MySqlPwd, conf->MySqlDatabase);
+  for( i=0; i<archdatalen; i++ ) {
+    // Storing in Inverter timezone (mostly set to UTC)
+    utctime = gmtime(&((archdatalist+i)->date));
+    day = utctime->tm_mday;
+    month = utctime->tm_mon +1;
+    year = utctime->tm_year + 1900;
+    hour = utctime->tm_hour;
+    minute = utctime->tm_min;
+    second = utctime->tm_sec;
+    sprintf( datetime, "%04d-%02d-%02d %02d:%02d:%02d", year, month, day, hour, minute, second);
+    if( flag->debug == 1 ) printf( "utc datetime = %s\n", datetime);    
+    sprintf(SQLQUERY,"INSERT INTO DayData ( DateTime, Inverter, Serial, CurrentPower, EtotalToday ) VALUES (\'%s\',\'%s\',%ld,%0.f, %.3f ) ON DUPLICATE KEY UPDATE DateTime=Datetime, Inverter=VALUES(Inverter), Serial=VALUES(Serial), CurrentPower=VALUES(CurrentPower), EtotalToday=VALUES(EtotalToday)",datetime, (archdatalist+i)->inverter, (archdatalist+i)->serial, (archdatalist+i)->current_value, (archdatalist+i)->accum_value );
+    if (flag->debug == 1) printf("SQL Query: %s\n",SQLQUERY);
+    DoQuery(SQLQUERY);
+  }
+  mysql_close(conn);
+}
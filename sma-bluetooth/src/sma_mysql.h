@@ -29,3 +29,4 @@ extern int install_mysql_tables( ConfType *, FlagType *,  char * );
 extern void update_mysql_tables( ConfType *, FlagType *  );
 extern int check_schema( ConfType *, FlagType *,  char * );
 extern void live_mysql( ConfType *, FlagType *, LiveDataType *, int );
+extern void archive_mysql( ConfType *, FlagType *, ArchDataType *, int );
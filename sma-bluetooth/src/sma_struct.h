@@ -31,6 +31,36 @@ typedef struct{
   int persistent;
 } ReturnType;
 
+#define RTT_BUCKETS 20
+
+/* Round trip times seen for one sma.in command */
+typedef struct{
+  char label[40];             /* command, with "/stream" for the rest of a multi-frame reply */
+  long samples;               /* replies timed */
+  float ewma;                 /* ms, moving average */
+  int backoff;                /* timeouts in a row, each doubles the next wait */
+  long retries;               /* requests sent again for want of a reply */
+  long hist[RTT_BUCKETS];     /* replies per rtt_bounds bucket */
+} RttType;
+
+/* A metadata value of a device as read before, see meta.c */
+typedef struct{
+  char serial[20];            /* SerialStr of the device */
+  unsigned char SUSyID[2];    /* its device class at the time, another one voids the values */
+  char command[40];           /* sma.in command that read it */
+  unsigned char key1;
+  unsigned char key2;
+  time_t date;                /* of the record */
+  time_t expires;             /* served until then, 0 if the command is never served */
+  int  index;                 /* code looked up in the XML for it */
+  char value[80];             /* as printed */
+} MetaType;
+
+typedef struct{
+  MetaType * list;
+  int  num;
+} MetaCacheType;
+
 typedef struct {
   time_t date;
   char inverter[30];
@@ -49,9 +79,22 @@ typedef struct {
   int Persistent;
 } LiveDataType;
 
+typedef struct{
+  char BTAddress[20];         /* Inverter address */
+  char Transport[80];         /* how to reach it, empty for Transport */
+  char Password[20];          /* empty for Password */
+} InverterType;
+
+typedef struct{
+  char command[40];           /* sma.in command */
+  int  interval;              /* seconds between its reads */
+} ScheduleType;
+
 typedef struct{
   char BTAddress[20];         /*--address  	-a 	*/
   int  bt_timeout;		/*--timeout  	-t 	*/
+  char Transport[80];         /*--transport   	*/
+  char Capture[80];           /*--capture   	*/
   char Password[20];          /*--password 	-p 	*/
   char Config[80];            /*--config   	-c 	*/
   char File[80];              /*--file     	-f 	*/
@@ -66,10 +109,33 @@ typedef struct{
   unsigned int MySerial[4];   /*Serial  of this app*/
   unsigned int MyBTAddress[6];   /*Serial  of this app*/
   unsigned int NetID;         /* Network ID of Inverter*/
+  unsigned int num_units;     /* devices that answered the login, 1 unless NetID > 1 */
   ReturnType *returnkeylist;  /* pointer to return key list */
   unsigned int num_return_keys;   /* number of items in list */
+  RttType *rttlist;           /* pointer to round trip times per command */
+  unsigned int num_rtt;       /* number of items in list */
+  MetaCacheType *metacache;   /* device metadata read before, shared by the inverters' copies */
+  int  metadata_ttl;     /*MetadataTTL hours metadata is served from the cache, 0 to always read it */
+  unsigned long retransmits;  /* requests sent again this run */
+  int  retries;          /*Retries resends of a request before giving up on the link */
   char datefrom[40];  /* is system using a daterange */
   char dateto[40];     /* is system using a daterange */
+  int  daemon_interval;  /*DaemonInterval seconds between polls in daemon mode */
+  int  keepalive;        /*KeepAlive seconds between keepalives in daemon mode */
+  int  connect_timeout;  /*ConnectTimeout ms allowed for each connect attempt */
+  int  connect_budget;   /*ConnectBudget seconds to keep retrying the connect */
+  char StateDir[80];     /*StateDir where smatool keeps what it learnt between runs */
+  InverterType *inverterlist; /* pointer to Inverter lines */
+  unsigned int num_inverters; /* number of items in list */
+  int  pool_size;        /*PoolSize inverters kept connected and logged in */
+  int  sched_budget;     /*SchedBudget jobs an inverter runs before the next one's turn */
+  int  archive_slice;    /*ArchiveSlice minutes of archive read per job in daemon mode */
+  int  pipeline;         /*Pipeline requests to an inverter in flight at once */
+  int  merge_gap;        /*MergeGap LRIs apart two ranges may be and still be read with one request */
+  int  cycle_budget;     /*CycleBudget seconds a poll may take, 0 for no limit */
+  long deadline;         /* ms, as monotonic_ms, the waits of what runs now end by, 0 for none */
+  ScheduleType *schedulelist; /* pointer to Schedule lines */
+  unsigned int num_schedules; /* number of items in list */
 } ConfType;
 
 typedef struct{
@@ -80,6 +146,7 @@ typedef struct{
   unsigned int test;      /* is test only */
   unsigned int mysql;     /* write to MySQL*/
   unsigned int file;      /* use sma.in file */
+  unsigned int daemon;    /* keep running and polling */
 } FlagType;
 
 typedef struct{
@@ -105,4 +172,26 @@ typedef struct{
   unsigned char data[255];      /*Data to be analysed */
 } ReadRecordType;
 
+/* LRI range, key2<<8 | key1, a merged request reads for one of its commands */
+typedef struct{
+  unsigned int first;
+  unsigned int last;
+} PlanRangeType;
+
+/* A request made up to read the ranges of several sma.in commands at once */
+typedef struct{
+  char command[40];             /* its name in lines */
+  PlanRangeType * ranges;       /* of the commands, records outside them are dropped */
+  int  num_ranges;
+  int  interval;                /* Schedule of the commands, 0 for every poll */
+} PlanType;
+
+typedef struct{
+  int num_lines;
+  char **lines;                 /* sma.in as read, newlines included, then the merged requests */
+  PlanType * plans;             /* merged requests */
+  int  num_plans;
+  const char ** commands;       /* commands of a poll, merged requests in place of theirs */
+} CommandFileType;
+
 #endif
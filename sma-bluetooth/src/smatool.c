@@ -27,12 +27,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <bluetooth/bluetooth.h>
-#include <bluetooth/rfcomm.h>
 #include <errno.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <signal.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <libxml2/libxml/parser.h>
@@ -40,13 +39,21 @@
 #include "almanac.h"
 #include "sb_commands.h"
 #include "sma_mysql.h"
+#include "transport.h"
+#include "rtt.h"
+#include "pool.h"
+#include "sched.h"
+#include "plan.h"
+#include "meta.h"
+#include "ident.h"
+#include "startup.h"
+#include "snap.h"
+#include "escape.h"
+#include "fcs.h"
 
 // u16 represents an unsigned 16-bit number.  Adjust the typedef for your hardware.
 typedef u_int16_t u16;
 
-#define PPPINITFCS16 0xffff /* Initial FCS value    */
-#define PPPGOODFCS16 0xf0b8 /* Good final FCS value */
-#define ASSERT(x) assert(x)
 #define SCHEMA "4"  /* Current database schema */
 
 
@@ -89,76 +96,6 @@ int cc;
 unsigned char fl[1024] = { 0 };
 
 
-static u16 fcstab[256] = {
-   0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
-   0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
-   0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
-   0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
-   0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
-   0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
-   0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
-   0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
-   0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
-   0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
-   0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
-   0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
-   0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
-   0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
-   0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
-   0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
-   0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
-   0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
-   0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
-   0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
-   0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
-   0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
-   0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
-   0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
-   0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
-   0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
-   0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
-   0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
-   0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
-   0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
-   0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
-   0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
-};
-
-/*
- * Calculate a new fcs given the current fcs and the new data.
- */
-u16 pppfcs16(u16 fcs, void *_cp, int len)
-{
-    register unsigned char *cp = (unsigned char *)_cp;
-    /* don't worry about the efficiency of these asserts here.  gcc will
-     * recognise that the asserted expressions are constant and remove them.
-     * Whether they are usefull is another question. 
-     */
-
-    ASSERT(sizeof (u16) == 2);
-    ASSERT(((u16) -1) > 0);
-    while (len--)
-        fcs = (fcs >> 8) ^ fcstab[(fcs ^ *cp++) & 0xff];
-    return (fcs);
-}
-
-/*
- * Strip escapes (7D) as they aren't includes in fcs
- */
-void
-strip_escapes(unsigned char *cp, int *len)
-{
-    int i,j;
-
-    for( i=0; i<(*len); i++ ) {
-      if( cp[i] == 0x7d ) { /*Found escape character. Need to convert*/
-        cp[i] = cp[i+1]^0x20;
-        for( j=i+1; j<(*len)-1; j++ ) cp[j] = cp[j+1];
-        (*len)--;
-      }
-   }
-}
-
 int quick_pow10(int n)
 {
     static int pow10[10] = {
@@ -169,28 +106,6 @@ int quick_pow10(int n)
     return pow10[n]; 
 }
 
-/*
- * Add escapes (7D) as they are required
- */
-void add_escapes(unsigned char *cp, int *len)
-{
-    int i,j;
-
-    for( i=19; i<(*len); i++ ) {
-      switch( cp[i] ) {
-        case 0x7d :
-        case 0x7e :
-        case 0x11 :
-        case 0x12 :
-        case 0x13 :
-          for( j=(*len); j>i; j-- ) cp[j] = cp[j-1];
-          cp[i+1] = cp[i]^0x20;
-          cp[i]=0x7d;
-          (*len)++;
-      }
-   }
-}
-
 /*
  * Recalculate and update length to correct for escapes
  */
@@ -241,16 +156,14 @@ void tryfcs16(FlagType * flag, unsigned char *cp, int len, unsigned char *fl, in
   u16 trialfcs;
   unsigned
   int i;
-  unsigned char stripped[1024] = { 0 };
 
-  memcpy( stripped, cp, len );
   /* add on output */
   if (flag->debug == 2) {
     printf("String to calculate FCS\n");	 
     for (i=0;i<len;i++) printf("%02x ",cp[i]);
     printf("\n\n");
   }	
-  trialfcs = pppfcs16( PPPINITFCS16, stripped, len );
+  trialfcs = pppfcs16( PPPINITFCS16, cp, len );
   trialfcs ^= 0xffff;               /* complement */
   fl[(*cc)] = (trialfcs & 0x00ff);  /* least significant byte first */
   fl[(*cc)+1] = ((trialfcs >> 8) & 0x00ff);
@@ -308,199 +221,39 @@ unsigned char conv(char *nn)
 		return res;
 }
 
-int empty_read_bluetooth(  ConfType * conf, FlagType * flag, ReadRecordType * readRecord, int *s, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated )
+/*
+ * Read the next frame from the link into received, unescaped.  Returns 0,
+ * 1 if it was a Data2+ packet with a bad FCS and was dropped (*rr is 0),
+ * and -1 on error
+ */
+int read_bluetooth( ConfType * conf, FlagType * flag, ReadRecordType * readRecord, TransportType *tp, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated )
 {
   int bytes_read,i,j, last_decoded;
-  unsigned char buf[1024]; /*read buffer*/
-  unsigned char header[4]; /*read buffer*/
-  struct timeval tv;
-  fd_set readfds;
+  unsigned char *header; /*frame in the transport receive buffer*/
+  unsigned char *buf;    /*frame body after the header*/
+  long skipped = tp->rx_skipped;
 
-  tv.tv_sec = 0; // just cleaning BT before sending, so no timeout 
-  tv.tv_usec = 0;
-  memset(buf,0,1024);
-
-  FD_ZERO(&readfds);
-  FD_SET((*s), &readfds);
-
-  if( select((*s)+1, &readfds, NULL, NULL, &tv) <  0) {
-    printf("ERROR: select error has occurred\n");
-  }
+  if(flag->debug == 1) printf("Reading bluetooth packet (socket=%d)\n", tp->fd);
   (*terminated) = 0; // Tag to tell if string has 7e termination
-  // first read the header to get the record length
-  if (FD_ISSET((*s), &readfds)) { // did we receive anything in the mean time?
-    bytes_read = recv((*s), header, sizeof(header), 0); //Get length of string
-    (*rr) = 0;
-    for( i=0; i<sizeof(header); i++ ) {
-      received[(*rr)] = header[i];
-      if (flag->debug == 1) printf("%02x ", received[i]);
-      (*rr)++;
-    }
-  } else {
-    // No problem if no data waiting, just clearing BT anyway
-    if (flag->debug == 1) printf("Timeout reading bluetooth socket (empty_read_bluetooth, header)\n");
-    memset(received,0,1024);
-    (*rr)=0;
-    return -1;
-  }
-  if (FD_ISSET((*s), &readfds)) { // did we receive anything within 5 seconds
-    bytes_read = recv((*s), buf, header[1]-3, 0); //Read the length specified by header
-  } else {
-    printf("ERROR: Timeout reading bluetooth socket (empty_read_bluetooth, body)\n");
-    memset(received,0,1024);
-    (*rr)=0;
+  (*rr) = 0;
+  bytes_read = transport_frame( tp, tp->timeout, &header );
+  if(( flag->verbose == 1 )&&( tp->rx_skipped > skipped ))
+    printf("Resynchronised after %ld bytes of line noise\n", tp->rx_skipped-skipped );
+  if( bytes_read == 0 ) {
+    printf("ERROR: Timeout reading bluetooth socket (read_bluetooth)\n");
     return -1;
   }
-  readRecord->Status[0]=0;
-  readRecord->Status[1]=0;
-  if ( bytes_read > 0) {
-    if (flag->debug == 1){ 
-      printf( "\n-----------------------------------------------------------" );
-      printf( "\nREAD:");
-      //Start byte
-      printf("\n7e "); j++;
-      //Size and checkbit
-      printf("%02x ",header[1]);
-      printf("                      size:              %d", header[1] );
-      printf("\n   " );
-      printf("%02x ",header[2]);
-      printf("\n   " );
-      printf("%02x ",header[3]);
-      printf("                      checkbit:          %d", header[3] );
-      printf("\n   " );
-      //Source Address
-      for( i=0; i<bytes_read; i++ ) {
-        if( i > 5 ) break;
-        printf("%02x ",buf[i]);
-      }
-      printf("       source:            %02x:%02x:%02x:%02x:%02x:%02x", buf[5], buf[4], buf[3], buf[2], buf[1], buf[0] );
-      printf("\n   " );
-      //Destination Address
-      for( i=6; i<bytes_read; i++ ) {
-        if( i > 11 ) break;
-        printf("%02x ",buf[i]);
-      }
-      printf("       destination:       %02x:%02x:%02x:%02x:%02x:%02x", buf[11], buf[10], buf[9], buf[8], buf[7], buf[6] );
-      printf("\n   " );
-      //Destination Address
-      for( i=12; i<bytes_read; i++ ) {
-        if( i > 13 ) break;
-        printf("%02x ",buf[i]);
-      }
-      printf("                   control:           %02x%02x", buf[13], buf[12] );
-      readRecord->Control[0]=buf[12];
-      readRecord->Control[1]=buf[13];
-           
-      last_decoded=14;
-      if( memcmp( buf+14, "\x7e\xff\x03\x60\x65", 5 ) == 0 ){
-        printf("\n");
-        for( i=14; i<bytes_read; i++ ) {
-          if( i > 18 ) break;
-          printf("%02x ",buf[i]);
-        }
-        printf("             SMA Data2+ header: %02x:%02x:%02x:%02x:%02x", buf[18], buf[17], buf[16], buf[15], buf[14] );
-        printf("\n   " );
-        for( i=19; i<bytes_read; i++ ) {
-          if( i > 19 ) break;
-          printf("%02x ",buf[i]);
-        }
-        printf("                      data packet size:  %02d", buf[19] );
-        printf("\n   " );
-        for( i=20; i<bytes_read; i++ ) {
-          if( i > 20 ) break;
-          printf("%02x ",buf[i]);
-        }
-        printf("                      control:           %02x", buf[20] );
-        printf("\n   " );
-        for( i=21; i<bytes_read; i++ ) {
-          if( i > 26 ) break;
-          printf("%02x ",buf[i]);
-        }
-        printf("       source:            %02x %02x:%02x:%02x:%02x:%02x", buf[21], buf[26], buf[25], buf[24], buf[23], buf[22] );
-        printf("\n   " );
-        for( i=27; i<bytes_read; i++ ) {
-          if( i > 28 ) break;
-          printf("%02x ",buf[i]);
-        }
-        printf("                   read status:       %02x %02x", buf[28], buf[27] );
-        printf("\n   " );
-        for( i=29; i<bytes_read; i++ ) {
-          if( i > 30 ) break;
-          printf("%02x ",buf[i]);
-        }
-        readRecord->Status[0]=buf[28];
-        readRecord->Status[1]=buf[27];
-        printf("                   count up:          %02d %02x:%02x", buf[29]+buf[30]*256, buf[30], buf[29] );
-        printf("\n   " );
-        for( i=31; i<bytes_read; i++ ) {
-          if( i > 32 ) break;
-          printf("%02x ",buf[i]);
-        }
-        printf("                   count down:        %02d %02x:%02x", buf[31]+buf[32]*256, buf[32], buf[31] );
-        printf("\n   " );
-        last_decoded=33;
-      }
-      printf("\n   " );
-      j=0;
-      for (i=last_decoded;i<bytes_read;i++) {
-        if( j%16== 0 ) printf( "\n   %08x: ",j);
-        printf("%02x ",buf[i]);
-        j++;
-      }
-      printf(" rr=%d",(bytes_read+3));
-      printf("\n\n");
-    } // if debug
-  } // if bytes read
-  (*rr)=0;
-  memset(received,0,1024);
-  return 0;
-}
-
-int read_bluetooth( ConfType * conf, FlagType * flag, ReadRecordType * readRecord, int *s, int *rr, unsigned char *received, int cc, unsigned char *last_sent, int *terminated )
-{
-  int bytes_read,i,j, last_decoded;
-  unsigned char buf[1024]; /*read buffer*/
-  unsigned char header[4]; /*read buffer*/
-  unsigned char checkbit;
-  struct timeval tv;
-  fd_set readfds;
-
-  tv.tv_sec = conf->bt_timeout; // set timeout of reading
-  tv.tv_usec = 0;
-  memset(buf,0,1024);
-
-  FD_ZERO(&readfds);
-  FD_SET((*s), &readfds);
-      
-  if( select((*s)+1, &readfds, NULL, NULL, &tv) <  0) {
-    printf("ERROR: select error has occurred\n");
-  }
-      
-  if(flag->debug == 1) printf("Reading bluetooth packet (socket=%d)\n", (*s));
-  (*terminated) = 0; // Tag to tell if string has 7e termination
-  // first read the header to get the record length
-  if (FD_ISSET((*s), &readfds)) { // did we receive anything within 5 seconds
-    bytes_read = recv((*s), header, sizeof(header), 0); //Get length of string
-    (*rr) = 0;
-    for( i=0; i<sizeof(header); i++ ) {
-      received[(*rr)] = header[i];
-      if (flag->debug == 2) printf("%02x ", received[i]);
-      (*rr)++;
-    }
-  } else {
-    printf("ERROR: Timeout reading bluetooth socket (read_bluetooth, header)\n");
-    (*rr) = 0;
-    memset(received,0,1024);
+  if( bytes_read < 0 ) {
+    printf("ERROR: Lost connection reading bluetooth socket (read_bluetooth)\n");
     return -1;
   }
-  if (FD_ISSET((*s), &readfds)){ // did we receive anything within 5 seconds
-    bytes_read = recv((*s), buf, header[1]-3, 0); //Read the length specified by header
-  } else {
-    printf("ERROR: Timeout reading bluetooth socket (read_bluetooth, body)\n");
-    (*rr) = 0;
-    memset(received,0,1024);
-    return -1;
+  for( i=0; i<4; i++ ) {
+    received[(*rr)] = header[i];
+    if (flag->debug == 2) printf("%02x ", received[i]);
+    (*rr)++;
   }
+  buf = header+4;
+  bytes_read -= 4;
   readRecord->Status[0]=0;
   readRecord->Status[1]=0;
   if ( bytes_read > 0) {
@@ -597,7 +350,7 @@ int read_bluetooth( ConfType * conf, FlagType * flag, ReadRecordType * readRecor
         printf("%02x ",buf[i]);
         j++;
       }
-      printf(" rr=%d",(bytes_read+3));
+      printf(" rr=%d",(bytes_read+4));
       printf("\n");
     } // if debug
     if ((cc==bytes_read)&&(memcmp(received,last_sent,cc) == 0)){
@@ -606,44 +359,31 @@ int read_bluetooth( ConfType * conf, FlagType * flag, ReadRecordType * readRecor
       // EZ added:
       return -1;
     }
-    // Check check bit
-    checkbit=header[0]^header[1]^header[2];
-    if( checkbit != header[3] ) {
-      printf("ERROR: Checkbit Error! %02x!=%02x\n",  header[0]^header[1]^header[2], header[3]);
-      (*rr) = 0;
-      memset(received,0,1024);
-      return -1;
-    }
     if( buf[ bytes_read-1 ] == 0x7e )
       (*terminated) = 1;
     else
       (*terminated) = 0;
-    for (i=0;i<bytes_read;i++) { //start copy the rec buffer in to received
-      if (buf[i] == 0x7d) { //did we receive the escape char
-        switch (buf[i+1]) {   // act depending on the char after the escape char
-          case 0x5e :
-            received[(*rr)] = 0x7e;
-            break;
-          case 0x5d :
-            received[(*rr)] = 0x7d;
-            break;
-          default :
-            received[(*rr)] = buf[i+1] ^ 0x20;
-            break;
-        }
-        i++;
-      } else { 
-        received[(*rr)] = buf[i];
-      }
-      if (flag->debug == 2) printf("%02x ", received[(*rr)]);
-      (*rr)++;
+    // copy the rec buffer in to received, unescaped
+    if(( i = unescape_frame( received+(*rr), RXMAXFRAME-(*rr), buf, bytes_read )) < 0 ) {
+      printf("ERROR: Frame too long to unescape (read_bluetooth)\n");
+      return -1;
     }
+    if (flag->debug == 2)
+      for( j=(*rr); j<(*rr)+i; j++ ) printf("%02x ", received[j]);
+    (*rr) += i;
     fix_length_received( flag, received, rr );
     if (flag->debug == 2) {
       printf("\n");
       for( i=0;i<(*rr); i++ ) printf("%02x ", received[(i)]);
     }
     if (flag->debug == 1) printf("\n\n");
+    // a Data2+ packet all in this frame is checked here, one in several in ReadStream
+    if(( (*terminated) == 1 )&&( (*rr) > 24 )&&( memcmp( received+18, "\x7e\xff\x03\x60\x65", 5 ) == 0 )&&( goodfcs16( received+19, (*rr)-20 ) == 0 )) {
+      if (flag->verbose == 1) printf("Dropped a frame with a bad FCS\n");
+      (*rr) = 0;
+      (*terminated) = 0;
+      return( 1 );
+    }
   } // if bytes read
   return 0;
 }
@@ -777,11 +517,9 @@ int is_light( ConfType * conf, FlagType * flag )
 }
 
 //Set a value depending on inverter
-void  SetInverterType( ConfType * conf, UnitType ** unit )  
+void  SetInverterType( ConfType * conf )  
 {
   srand(time(NULL));
-  unit[0]->SUSyID[0] = 0xFF;
-  unit[0]->SUSyID[1] = 0xFF;
   conf->MySUSyID[0] = rand()%254;
   conf->MySUSyID[1] = rand()%254;
   conf->MySerial[0] = rand()%254;
@@ -987,51 +725,78 @@ void  SetSwitches( ConfType *conf, FlagType *flag )
         flag->daterange=1;
     else
         flag->daterange=0;
+    //A poll should be done before the next one, or the next timer run
+    if( conf->cycle_budget < 0 )
+        conf->cycle_budget = ( flag->daemon == 1 ) ? conf->daemon_interval*4/5 : 50;
 }
 
-unsigned char *ReadStream( ConfType * conf, FlagType * flag, ReadRecordType * readRecord, int * s, unsigned char * stream, int * streamlen, unsigned char * datalist, int * datalen, unsigned char * last_sent, int cc, int * terminated, int * togo )
+/*
+ * Read the rest of a reply that takes several frames, stream is the frame
+ * it started with.  The frames stay where read_bluetooth unescaped them,
+ * payload lists their data.  Returns 0, 1 if a frame of it had a bad FCS
+ * and was dropped, or -1 if the reply did not come
+ */
+int ReadStream( ConfType * conf, FlagType * flag, ReadRecordType * readRecord, TransportType * tp, unsigned char * stream, int * streamlen, PayloadType * payload, unsigned char * last_sent, int cc, int * terminated, int * togo )
 {
-  int finished;
-  int finished_record;
-  int i, j=0;
+  unsigned char *frame = stream;
+  int i, start, from, status;
+  int check = ( memcmp( stream+18, "\x7e\xff\x03\x60\x65", 5 ) == 0 );
+  u16 fcs = PPPINITFCS16;
 
   (*togo)=ConvertStreamtoInt( stream+43, 2, togo );
   if(flag->debug == 2) printf( "togo=%d\n", (*togo) );
-  i=59; //Initial position of data stream
-  (*datalen)=0;
-  datalist=(unsigned char *)malloc(sizeof(char));
-  finished=0;
-  finished_record=0;
-  while( finished != 1 ) {
-    datalist=(unsigned char *)realloc(datalist,sizeof(char)*((*datalen)+(*streamlen)-i));
-    while( finished_record != 1 ) {
-      if( i> 500 ) break; //Somthing has gone wrong
-      if(( i < (*streamlen) )&&(( (*terminated) != 1)||(i+3 < (*streamlen) ))) {
-        datalist[j]=stream[i];
-        j++;
-        (*datalen)=j;
-        i++;
-      } else
-        finished_record = 1;
+  PayloadStart( payload, stream );
+  start=PAYLOAD_FIRST; //Initial position of data stream
+  from=19; // the Data2+ packet the fcs is over starts after the 7e, in the frames after that at 18
+  for(;;) {
+    // the fcs and 7e end the last frame
+    if( PayloadAdd( payload, start, ( (*terminated) == 1 ) ? (*streamlen)-3 : (*streamlen) ) != 0 ) {
+      printf("ERROR: Out of memory\n" );
+      return( -1 );
     }
-    finished_record = 0;
-    if( (*terminated) == 0 ) {
-      if( read_bluetooth( conf, flag, readRecord, s, streamlen, stream, cc, last_sent, terminated ) != 0 ) {
-		if( flag->debug== 1 ) printf("ReadStream error reading BT, freeing datalist");
-        free( datalist );
-        datalist = NULL;
-      }
-      if( j> 0 ) i=18;
-    } else
-      finished = 1;
-  } // while not finished
+    if( (*terminated) == 1 )
+      break;
+    if(( check )&&( (*streamlen) > from ))
+      fcs = pppfcs16( fcs, frame+from, (*streamlen)-from );
+    from = PAYLOAD_NEXT;
+    if(( frame = PayloadFrame( payload )) == NULL ) {
+      printf("ERROR: Out of memory\n" );
+      return( -1 );
+    }
+    while(( status = read_bluetooth( conf, flag, readRecord, tp, streamlen, frame, cc, last_sent, terminated )) > 0 ) {
+      // a whole packet came in between and was dropped, the reply goes on after it
+      if( transport_pending( tp ) <= 0 )
+        break;
+    }
+    if( status > 0 )
+      return( 1 );
+    if( status < 0 ) {
+      if( flag->debug== 1 ) printf("ReadStream error reading BT\n");
+      return( -1 );
+    }
+    // until some data has come this is still the first frame, e.g. after
+    // the left over frame an E line without an R line of its own starts with
+    if( payload->len > 0 )
+      start=PAYLOAD_NEXT;
+    else if(( check = ( memcmp( frame+18, "\x7e\xff\x03\x60\x65", 5 ) == 0 ))) {
+      // the packet starts here, its fcs and togo too
+      (*togo)=ConvertStreamtoInt( frame+43, 2, togo );
+      fcs = PPPINITFCS16;
+      from = 19;
+    }
+  }
+  // read_bluetooth checked a reply that came in one frame
+  if(( check )&&( frame != stream )&&( (*streamlen) > from )&&( pppfcs16( fcs, frame+from, (*streamlen)-from-1 ) != PPPGOODFCS16 )) {
+    printf("ERROR: Bad FCS on a reply of %d frames, not using it\n", payload->num_frames+1 );
+    return( -1 );
+  }
   if( flag->debug== 1 ) {
-    printf( "len=%d data=", (*datalen) );
-    for( i=0; i< (*datalen); i++ )
-      printf( "%02x ", datalist[i] );
+    printf( "len=%d data=", payload->len );
+    for( i=0; i< payload->len; i++ )
+      printf( "%02x ", PayloadRecord( payload, i, 1 )[0] );
     printf( "\n" );
   }
-  return datalist;
+  return( 0 );
 }
 
 /* Init Config to default values */
@@ -1051,6 +816,29 @@ void InitConfig( ConfType *conf )
     strcpy( conf->MySqlPwd, "" );  
     strcpy( conf->datefrom, "" );  
     strcpy( conf->dateto, "" );  
+    strcpy( conf->Transport, "" );  
+    strcpy( conf->Capture, "" );  
+    conf->daemon_interval = 60;
+    conf->keepalive = 20;
+    conf->retries = 3;
+    conf->retransmits = 0;
+    conf->num_units = 0;
+    conf->connect_timeout = 5000;
+    conf->connect_budget = 60;
+    strcpy( conf->StateDir, "/var/lib/smatool" );
+    conf->inverterlist = NULL;
+    conf->num_inverters = 0;
+    conf->pool_size = 3;
+    conf->sched_budget = 4;
+    conf->archive_slice = 360;
+    conf->pipeline = 1;
+    conf->merge_gap = 8;
+    conf->schedulelist = NULL;
+    conf->num_schedules = 0;
+    conf->metacache = NULL;
+    conf->metadata_ttl = 24;
+    conf->cycle_budget = -1;
+    conf->deadline = 0;
 }
 
 /* Init Flags to default values */
@@ -1063,6 +851,26 @@ void InitFlag( FlagType *flag )
     flag->test=0;     /* is system using a test */
     flag->mysql=0;     /* is system using MySQL */
     flag->file=0;     /* is system using a file for sma.in */
+    flag->daemon=0;     /* is system running as a daemon */
+}
+
+/* Seconds in an interval like 10s, 5m, 24h or 1d, plain seconds without a unit; 0 if not valid */
+int interval_seconds( const char * value )
+{
+    char *end;
+    long n;
+
+    n = strtol( value, &end, 10 );
+    if( n <= 0 )
+        return( 0 );
+    switch( *end ) {
+        case '\0':
+        case 's': return( n );
+        case 'm': return( n*60 );
+        case 'h': return( n*3600 );
+        case 'd': return( n*86400 );
+    }
+    return( 0 );
 }
 
 /* read Config from file */
@@ -1118,6 +926,74 @@ int GetConfig( ConfType *conf, FlagType * flag )
                        strcpy( conf->MySqlUser, value );  
                     if( strcmp( variable, "MySqlPwd" ) == 0 )
                        strcpy( conf->MySqlPwd, value );  
+                    if( strcmp( variable, "Transport" ) == 0 )
+                       strcpy( conf->Transport, value );  
+                    if( strcmp( variable, "Capture" ) == 0 )
+                       strcpy( conf->Capture, value );  
+                    if( strcmp( variable, "DaemonInterval" ) == 0 )
+                       conf->daemon_interval = atoi(value);  
+                    if( strcmp( variable, "KeepAlive" ) == 0 )
+                       conf->keepalive = atoi(value);  
+                    if( strcmp( variable, "Retries" ) == 0 )
+                       conf->retries = atoi(value);  
+                    if( strcmp( variable, "ConnectTimeout" ) == 0 )
+                       conf->connect_timeout = atoi(value);  
+                    if( strcmp( variable, "ConnectBudget" ) == 0 )
+                       conf->connect_budget = atoi(value);  
+                    if( strcmp( variable, "StateDir" ) == 0 )
+                       strcpy( conf->StateDir, value );  
+                    if( strcmp( variable, "PoolSize" ) == 0 )
+                       conf->pool_size = atoi(value);  
+                    if( strcmp( variable, "SchedBudget" ) == 0 )
+                       conf->sched_budget = atoi(value);  
+                    if( strcmp( variable, "ArchiveSlice" ) == 0 )
+                       conf->archive_slice = atoi(value);  
+                    if( strcmp( variable, "Pipeline" ) == 0 )
+                       conf->pipeline = atoi(value);  
+                    if( strcmp( variable, "MergeGap" ) == 0 )
+                       conf->merge_gap = atoi(value);  
+                    if( strcmp( variable, "MetadataTTL" ) == 0 )
+                       conf->metadata_ttl = atoi(value);  
+                    if( strcmp( variable, "CycleBudget" ) == 0 )
+                       conf->cycle_budget = atoi(value);  
+                    if( strcmp( variable, "Inverter" ) == 0 )
+                    {
+                       InverterType *inverter;
+
+                       if(( inverter = (InverterType *)realloc( conf->inverterlist, sizeof( InverterType ) * ( conf->num_inverters + 1 ))) == NULL )
+                       {
+                          printf("ERROR: Out of memory\n" );
+                          fclose( fp );
+                          return( -1 );
+                       }
+                       conf->inverterlist = inverter;
+                       inverter += conf->num_inverters++;
+                       strcpy( inverter->Transport, "" );
+                       strcpy( inverter->Password, "" );
+                       sscanf( line, "%*s %19s %79s %19s", inverter->BTAddress, inverter->Transport, inverter->Password );
+                       if( strcmp( inverter->Transport, "-" ) == 0 )
+                          strcpy( inverter->Transport, "" );
+                    }
+                    if( strcmp( variable, "Schedule" ) == 0 )
+                    {
+                       ScheduleType *schedule;
+                       char interval[20];
+
+                       if(( schedule = (ScheduleType *)realloc( conf->schedulelist, sizeof( ScheduleType ) * ( conf->num_schedules + 1 ))) == NULL )
+                       {
+                          printf("ERROR: Out of memory\n" );
+                          fclose( fp );
+                          return( -1 );
+                       }
+                       conf->schedulelist = schedule;
+                       schedule += conf->num_schedules;
+                       strcpy( interval, "" );
+                       sscanf( line, "%*s %39s %19s", schedule->command, interval );
+                       if(( schedule->interval = interval_seconds( interval )) == 0 )
+                          printf("ERROR: Schedule %s has no valid interval, reading it every poll\n", schedule->command );
+                       else
+                          conf->num_schedules++;
+                    }
                 }
             }
         }
@@ -1215,6 +1091,8 @@ void PrintHelp()
     printf( "  -d,  --debug                             Show debug\n" );
     printf( "  -c,  --config CONFIGFILE                 Set config file default smatool.conf\n" );
     printf( "       --test                              Run in test mode - don't update data\n" );
+    printf( "       --daemon                            Keep running, polling every DaemonInterval secs\n" );
+    printf( "                                           over one connection and login\n" );
     printf( "\n" );
     printf( "Dates are no longer required - defaults to last update if using mysql\n" );
     printf( "or 2000 to now if not using mysql\n" );
@@ -1225,6 +1103,10 @@ void PrintHelp()
     printf( "  -i,  --inverter INVERTER_MODEL           inverter model\n" );
     printf( "  -a,  --address INVERTER_ADDRESS          inverter BT address\n" );
     printf( "  -t,  --timeout TIMEOUT                   bluetooth timeout (secs) default 5\n" );
+    printf( "       --transport URL                     rfcomm://ADDRESS, tcp://HOST:PORT, unix:///PATH\n" );
+    printf( "                                           speedwire://HOST[:PORT] or replay:///CAPTUREFILE,\n" );
+    printf( "                                           default rfcomm\n" );
+    printf( "       --capture CAPTUREFILE               record all traffic for replay\n" );
     printf( "  -p,  --password PASSWORD                 inverter user password default 0000\n" );
     printf( "  -f,  --file FILENAME                     command file default sma.in.new\n" );
     printf( "Location Information to calculate sunset and sunrise so inverter is not\n" );
@@ -1263,6 +1145,7 @@ int ReadCommandConfig( ConfType *conf, FlagType *flag, int argc, char **argv, in
       }
     }
     else if (strcmp(argv[i],"--test")==0) flag->test=1;
+    else if (strcmp(argv[i],"--daemon")==0) flag->daemon=1;
     else if ((strcmp(argv[i],"-from")==0)||(strcmp(argv[i],"--datefrom")==0)) {
       i++;
       if(i<argc) {
@@ -1281,6 +1164,18 @@ int ReadCommandConfig( ConfType *conf, FlagType *flag, int argc, char **argv, in
         strcpy(conf->BTAddress,argv[i]);
       }
     }
+    else if (strcmp(argv[i],"--transport")==0){
+      i++;
+      if (i<argc){
+        strcpy(conf->Transport,argv[i]);
+      }
+    }
+    else if (strcmp(argv[i],"--capture")==0){
+      i++;
+      if (i<argc){
+        strcpy(conf->Capture,argv[i]);
+      }
+    }
     else if ((strcmp(argv[i],"-t")==0)||(strcmp(argv[i],"--timeout")==0)){
       i++;
       if (i<argc){
@@ -1372,35 +1267,191 @@ char * debugdate()
   return result;
 }
 
+/* Command sequences run against the inverter */
+static const char * login_commands[] = { "init", "login", 0 };
+static const char * relogin_commands[] = { "login", 0 };
+static const char * data_commands[] = {
+    "typelabel", "startuptime",
+    "getacvoltage", "getenergyproduction", "getspotdcpower", "getspotdcvoltage", "getspotacpower", "getgridfreq",
+    "maxACPower", "maxACPowerTotal", "ACPowerTotal", "DeviceStatus", "getrangedata",
+    0
+};
+static const char * logoff_commands[] = { "logoff", 0 };
+
+volatile sig_atomic_t daemon_stop = 0;
+
+void daemon_signal( int sig )
+{
+  daemon_stop = 1;
+}
+
+/* Milliseconds elapsed since start */
+long elapsed_ms( struct timespec * start )
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return (now.tv_sec - start->tv_sec)*1000 + (now.tv_nsec - start->tv_nsec)/1000000;
+}
+
+/* Make sure todays sunrise and sunset are in the Almanac table */
+void CheckAlmanac( ConfType * conf, FlagType * flag )
+{
+  char sunrise_time[6], sunset_time[6];
+
+  if((flag->location==1)&&(flag->mysql==1)) {
+    if( flag->debug == 1 ) printf( "Before todays Almanac\n" ); 
+    if( ! todays_almanac( conf, flag->debug ) ) {
+      sprintf( sunrise_time, "%s", sunrise(conf, flag->debug ));
+      sprintf( sunset_time, "%s", sunset(conf, flag->debug ));
+      if( flag->verbose == 1) printf( "sunrise=%s sunset=%s (local time)\n", sunrise_time, sunset_time );
+      update_almanac(  conf, sunrise_time, sunset_time, flag->debug );
+    }
+  }
+}
+
+/* Store collected archive and live data in the database */
+void StoreData( ConfType * conf, FlagType * flag, ArchDataType *archdatalist, int archdatalen, LiveDataType *livedatalist, int livedatalen )
+{
+  if(archdatalen > 0) printf( "Storing archive data (%d records)\n",  archdatalen);
+  archive_mysql( conf, flag, archdatalist, archdatalen );
+  // Update Mysql with live data
+  if(livedatalen > 0) printf( "Storing live data (%d records)\n",  livedatalen); 
+  live_mysql( conf, flag, livedatalist, livedatalen );
+}
+
+/* Store what the jobs collected and empty the lists */
+void FlushData( ConfType * conf, FlagType * flag, ArchDataType **archdatalist, int *archdatalen, LiveDataType **livedatalist, int *livedatalen )
+{
+  if( flag->mysql == 1 )
+    StoreData( conf, flag, *archdatalist, *archdatalen, *livedatalist, *livedatalen );
+  if( *archdatalen > 0 )
+    free( *archdatalist );
+  *archdatalist=NULL;
+  *archdatalen=0;
+  if( *livedatalen > 0 )
+    free( *livedatalist );
+  *livedatalist=NULL;
+  *livedatalen=0;
+}
+
+/*
+ * Daemon mode: connect and log in once, then run the data commands every
+ * DaemonInterval seconds.  In between polls the link is kept up with the
+ * keepalive command; init and login are only redone when the link dropped.
+ * With several Inverter lines the scheduler runs the commands of all of
+ * them, the live ones first, and reads the archive in between polls.
+ * Commands with a Schedule line are run when they fall due, also in
+ * between polls, and not with every poll.
+ */
+int RunDaemon( ConfType * conf, FlagType * flag, SchedType * sched, int no_dark, int auto_dates )
+{
+  PoolType *pool = sched->pool;
+  int result=0;
+  int yday=-1;
+  int full, due, polled;
+  int archdatalen=0, livedatalen=0;
+  ArchDataType *archdatalist=NULL;
+  LiveDataType *livedatalist=NULL;
+  time_t next_cycle, next_keepalive, next_due, wake, now;
+  struct timespec cycle_start;
+  struct tm *loctime;
+
+  signal( SIGTERM, daemon_signal );
+  signal( SIGINT, daemon_signal );
+  next_cycle = time(NULL);
+  while( daemon_stop == 0 ) {
+    now = time(NULL);
+    full = ( now >= next_cycle );
+    polled = 0;
+    loctime = localtime(&now);
+    if( loctime->tm_yday != yday ) {
+      // new day, so new sunrise and sunset
+      if( yday >= 0 ) CheckAlmanac( conf, flag );
+      yday = loctime->tm_yday;
+    }
+    if(flag->location==0||no_dark==1||is_light( conf, flag )) {
+      clock_gettime( CLOCK_MONOTONIC, &cycle_start );
+      conf->deadline = ( conf->cycle_budget > 0 ) ? monotonic_ms() + conf->cycle_budget*1000L : 0;
+      due = SchedDue( sched, full );
+      if(( auto_dates == 1 )&&( due & ( 1 << SCHED_ARCHIVE ))) {
+        if( flag->mysql == 1 ) strcpy( conf->datefrom, "" );
+        auto_set_dates( conf, flag );
+      }
+      SchedCycle( sched, full );
+      if(( flag->mysql == 0 )&&( auto_dates == 1 )&&( due & ( 1 << SCHED_ARCHIVE )))
+        strcpy( conf->datefrom, conf->dateto ); //the archive jobs have the range now, continue from here next cycle
+      polled = 1;
+      result = 0;
+      while(( daemon_stop == 0 )&&(( result = SchedRun( sched, SCHED_LIVE, &archdatalist, &archdatalen, &livedatalist, &livedatalen )) != SCHED_IDLE ))
+        if( result < 0 ) printf("ERROR: Lost inverter link, reconnecting next cycle\n");
+      conf->deadline = 0;
+      FlushData( conf, flag, &archdatalist, &archdatalen, &livedatalist, &livedatalen );
+      if( flag->verbose == 1 ) {
+        printf("Cycle done in %ld ms (%lu retransmits, pool %lu hits %lu misses %lu evictions so far)\n", elapsed_ms( &cycle_start ), conf->retransmits, pool->hits, pool->misses, pool->evictions);
+        SchedStats( sched );
+      }
+      SchedLate( sched );
+      RttSave( conf, flag );
+      MetaSave( conf, flag );
+      SchedSave( sched );
+      IdentSave( sched->pool );
+    } else if( full ) {
+      if( flag->verbose == 1) printf("Not waking up inverter\n");
+      PoolClose( pool, &archdatalist, &archdatalen, &livedatalist, &livedatalen );
+    }
+    // until the next poll or scheduled command read the archive, else keep the links alive
+    now = time(NULL);
+    if( full ) {
+      next_cycle += conf->daemon_interval;
+      if( next_cycle <= now ) next_cycle = now + conf->daemon_interval; // overran, skip the missed polls
+    }
+    wake = next_cycle;
+    if(( polled == 1 )&&(( next_due = SchedNextDue( sched )) > 0 )&&( next_due < wake ))
+      wake = next_due;
+    next_keepalive = now + conf->keepalive;
+    while(( daemon_stop == 0 )&&( time(NULL) < wake )) {
+      // done before the next full poll is due, a scheduled command may wait for it
+      conf->deadline = ( conf->cycle_budget > 0 ) ? monotonic_ms() + ( next_cycle - time(NULL) )*1000L : 0;
+      result = SchedRun( sched, SCHED_ARCHIVE, &archdatalist, &archdatalen, &livedatalist, &livedatalen );
+      conf->deadline = 0;
+      if( result != SCHED_IDLE ) {
+        FlushData( conf, flag, &archdatalist, &archdatalen, &livedatalist, &livedatalen );
+        SchedLate( sched );
+        next_keepalive = time(NULL) + conf->keepalive;
+        continue;
+      }
+      if(( pool->open > 0 )&&( conf->keepalive > 0 )&&( time(NULL) >= next_keepalive )) {
+        PoolKeepalive( pool, &archdatalist, &archdatalen, &livedatalist, &livedatalen );
+        next_keepalive = time(NULL) + conf->keepalive;
+      }
+      sleep(1);
+    }
+  }
+  PoolClose( pool, &archdatalist, &archdatalen, &livedatalist, &livedatalen );
+  return 0;
+}
+
 int main(int argc, char **argv)
 {
-  FILE *fp;
+  CommandFileType cmdfile;
+  const char ** commands;
   ConfType conf;
   FlagType flag;
-  int maximumUnits=1;
-  UnitType *unit;
+  PoolType pool;
+  SchedType sched;
+  StartupType startup;
+  SnapType snap;
   unsigned char received[1024];
-  int i,s;
-  int install=0, update=0, no_dark=0;
+  int install=0, update=0, no_dark=0, auto_dates=0, almanac=1, light=1;
   unsigned char tzhex[2] = { 0 };
-  int result;
-  char SQLQUERY[1024];
-  struct tm *utctime;
-  char datetime[40];
-  int day,month,year,hour,minute,second;
+  int i, status, result=0;
   int archdatalen=0, livedatalen=0;
   ArchDataType *archdatalist=NULL;
   LiveDataType *livedatalist=NULL;
 
-  char sunrise_time[6], sunset_time[6];
-
   printf("%s version %s\n", PROGRAM, VERSION);
 
-  unit=(UnitType *)malloc( sizeof(UnitType) * maximumUnits);
-  if( unit == NULL ) {
-    printf("ERROR: Unable to allocate memory\n");
-    exit(1);
-  }
   memset(received,0,1024);
 
   // set config to defaults
@@ -1428,6 +1479,20 @@ int main(int argc, char **argv)
     printf("Configuration parameters:\n");
     printf("BTAddress = %s\n", conf.BTAddress);
     printf("bt_timeout = %d\n", conf.bt_timeout);
+    printf("Transport = %s\n", conf.Transport);
+    printf("Capture = %s\n", conf.Capture);
+    printf("Retries = %d\n", conf.retries);
+    printf("ConnectTimeout = %d ConnectBudget = %d\n", conf.connect_timeout, conf.connect_budget);
+    printf("StateDir = %s\n", conf.StateDir);
+    printf("PoolSize = %d\n", conf.pool_size);
+    printf("SchedBudget = %d ArchiveSlice = %d Pipeline = %d\n", conf.sched_budget, conf.archive_slice, conf.pipeline);
+    printf("MergeGap = %d\n", conf.merge_gap);
+    printf("MetadataTTL = %d\n", conf.metadata_ttl);
+    printf("CycleBudget = %d\n", conf.cycle_budget);
+    for( i=0; i<conf.num_schedules; i++ )
+      printf("Schedule = %s %d\n", conf.schedulelist[i].command, conf.schedulelist[i].interval);
+    for( i=0; i<conf.num_inverters; i++ )
+      printf("Inverter = %s %s %s\n", conf.inverterlist[i].BTAddress, conf.inverterlist[i].Transport, conf.inverterlist[i].Password);
     printf("Password = %s\n", conf.Password);
     printf("Config = %s\n", conf.Config);
     printf("File = %s\n", conf.File);
@@ -1452,6 +1517,9 @@ int main(int argc, char **argv)
     printf("test = %d\n", flag.test);
     printf("mysql = %d\n", flag.mysql);
     printf("file = %d\n", flag.file);
+    printf("daemon = %d\n", flag.daemon);
+    printf("daemon_interval = %d\n", conf.daemon_interval);
+    printf("keepalive = %d\n", conf.keepalive);
   }
   // If asked for installing MySQL database structure
   if(( install==1 )&&( flag.mysql==1 )) {
@@ -1463,92 +1531,99 @@ int main(int argc, char **argv)
     update_mysql_tables( &conf, &flag );
     exit(0);
   }
-  // Get Return Value lookup from file
-  InitReturnKeys( &conf );
+  // Get Return Value lookup from file, unless the snapshot of an earlier run has them
+  if( SnapLoad( &snap, &conf, &flag ) == 0 )
+    InitReturnKeys( &conf );
+  // Round trip times learnt on earlier runs
+  RttLoad( &conf, &flag );
+  // Device metadata read on earlier runs
+  MetaLoad( &conf, &flag );
   // Set value for inverter type
-  SetInverterType( &conf, &unit );
+  SetInverterType( &conf );
   // Get Local Timezone offset in seconds
   get_timezone_in_seconds( &flag, tzhex );
-  // Location based information to avoid quering Inverter in the dark
-  if((flag.location==1)&&(flag.mysql==1)) {
-    if( flag.debug == 1 ) printf( "Before todays Almanac\n" ); 
-    if( ! todays_almanac( &conf, flag.debug ) ) {
-      sprintf( sunrise_time, "%s", sunrise(&conf, flag.debug ));
-      sprintf( sunset_time, "%s", sunset(&conf, flag.debug ));
-      if( flag.verbose == 1) printf( "sunrise=%s sunset=%s (local time)\n", sunrise_time, sunset_time );
-      update_almanac(  &conf, sunrise_time, sunset_time, flag.debug );
+  // Location based information to avoid quering Inverter in the dark,
+  // a single run needs it before anything else
+  if(( flag.location == 1 )&&( no_dark == 0 )&&( flag.daemon == 0 )) {
+    if(( light = SnapLight( &snap, &conf, &flag )) < 0 ) {
+      CheckAlmanac( &conf, &flag );
+      light = is_light( &conf, &flag );
+      SnapChecked( &snap, &conf, &flag, NULL, 1 );
     }
+    almanac = 0;
+  } else if( SnapAlmanac( &snap, &conf, &flag ))
+    almanac = 0;
+  //auto set the dates
+  if( flag.daterange == 0 )
+    auto_dates=1;
+  // The rest of the database work runs next to the connect, joined before the archive
+  if( StartupBegin( &startup, &conf, &flag, SnapSchema( &snap, &conf, SCHEMA ) ? NULL : SCHEMA, almanac, auto_dates ) < 0 )
+    exit(1);
+
+  // Read inverter codes
+  if(( flag.file == 0 )||( ReadCommandFile( &cmdfile, conf.File ) < 0 )) {
+    printf("ERROR: Cannot connect open inverter code file %s\n", conf.File);
+    exit(1);
   }
-  if( flag.mysql==1 ) { 
-    if( flag.debug == 1 ) printf( "Before Check Schema\n" ); 
-    if( check_schema( &conf, &flag,  SCHEMA ) != 1 ) {
-      printf("ERROR: Schema not correct\n");
+  if( PoolInit( &pool, &conf, &flag, &cmdfile, login_commands, relogin_commands, logoff_commands ) < 0 )
+    exit(1);
+  IdentLoad( &pool );
+  // ranges next to each other are read with one request
+  if(( commands = PlanCommands( &conf, &flag, &cmdfile, data_commands )) == NULL )
+    exit(1);
+  if( SchedInit( &sched, &pool, commands, conf.sched_budget, conf.pipeline, ( flag.daemon == 1 ) ? conf.archive_slice * 60 : 0 ) < 0 )
+    exit(1);
+  if( flag.daemon == 1 ) {
+    if( StartupJoin( &startup, &conf, &flag ) < 0 )
       exit(1);
-    }
-  }
-  if(flag.daterange==0 ) {
-    //auto set the dates
-    if( flag.debug == 1) printf( "Before auto_set_dates\n" ); 
-    auto_set_dates( &conf, &flag);
+    SnapChecked( &snap, &conf, &flag, startup.schema, almanac );
+    SnapSave( &snap, &conf, &flag );
+    result = RunDaemon( &conf, &flag, &sched, no_dark, auto_dates );
+    RttSave( &conf, &flag );
+    MetaSave( &conf, &flag );
+    SchedSave( &sched );
+    IdentSave( &pool );
+    SchedFree( &sched );
+    PoolFree( &pool );
+    FreeCommandFile( &cmdfile );
+    MetaFree( &conf );
+    if( flag.verbose == 1) printf("Done (resultcode = %d, pool %lu hits %lu misses %lu evictions).\n", result, pool.hits, pool.misses, pool.evictions);
+    return(result);
   }
-  if( flag.verbose == 1 ) printf( "QUERY RANGE from %s to %s (daterange = %d)\n", conf.datefrom, conf.dateto, flag.daterange );
 
   // Collect data from inverter
-  if(flag.location==0||no_dark==1||is_light( &conf, &flag )) {
+  if( light ) {
     if (flag.debug == 1) printf("Collecting data from inverter address %s\n",conf.BTAddress);
-    //Connect to Inverter
-    if ((s = ConnectSocket( &conf )) < 0 ) {
-      printf("ERROR: Cannot connect to socket\n");
-      exit(1);
-    }
-    // Read inverter codes
-    if (flag.file == 1)
-      fp=fopen(conf.File,"r");
-    else {
-      printf("ERROR: Cannot connect open inverter code file %s\n", conf.File);
-      exit(1);
-    }
-    static const char * commands[] = {
-        "init", "login", "typelabel", "startuptime",
-        "getacvoltage", "getenergyproduction", "getspotdcpower", "getspotdcvoltage", "getspotacpower", "getgridfreq",
-        "maxACPower", "maxACPowerTotal", "ACPowerTotal", "DeviceStatus", "getrangedata", "logoff",
-        0
-    };
-    while(commands[i] && result >= 0) {
-        if( flag.debug == 1) printf("Executing command %s\n", commands[i]);
-        result = InverterCommand( commands[i], &conf, &flag, &unit, &s, fp, &archdatalist, &archdatalen, &livedatalist, &livedatalen );
-        if (result < 0) printf("ERROR executing command %s\n", commands[i]);
-        i++;
-    }
+    // Connect and log in as the jobs need it, the archive in one go once
+    // the database work is done, an archive queued without dates takes them then
+    conf.deadline = ( conf.cycle_budget > 0 ) ? monotonic_ms() + conf.cycle_budget*1000L : 0;
+    SchedCycle( &sched, 1 );
+    while(( status = SchedRun( &sched, SCHED_LIVE, &archdatalist, &archdatalen, &livedatalist, &livedatalen )) != SCHED_IDLE )
+      if( status < 0 ) result = -1;
+    if( StartupJoin( &startup, &conf, &flag ) < 0 )
+      result = -1;
+    else
+      while(( status = SchedRun( &sched, SCHED_ARCHIVE, &archdatalist, &archdatalen, &livedatalist, &livedatalen )) != SCHED_IDLE )
+        if( status < 0 ) result = -1;
+    conf.deadline = 0;
+    SchedLate( &sched ); // what was read is stored all the same, the rest waits for the next run
+    if( PoolClose( &pool, &archdatalist, &archdatalen, &livedatalist, &livedatalen ) < 0 )
+      result = -1;
+    RttSave( &conf, &flag );
+    MetaSave( &conf, &flag );
+    SchedSave( &sched );
+    IdentSave( &pool );
   } else
     if( flag.verbose == 1) printf("Not waking up inverter\n");
+  if( StartupJoin( &startup, &conf, &flag ) < 0 )
+    exit(1);
+  SnapChecked( &snap, &conf, &flag, startup.schema, almanac );
+  SnapSave( &snap, &conf, &flag );
 
-  // Store in database
-  if (result>=0 && flag.mysql==1) {
+  // Store in database, what the inverters that answered gave even if others failed
+  if (flag.mysql==1) {
     if( flag.debug == 1) printf( "Before store in database\n" ); 
-    // Connect to database
-    OpenMySqlDatabase( conf.MySqlHost, conf.MySqlUser, conf.MySqlPwd, conf.MySqlDatabase );
-    if(archdatalen > 0) printf( "Storing archive data (%d records)\n",  archdatalen);
-    for( i=1; i<archdatalen; i++ ) { //Start at 1 as the first record is a dummy 
-	  // Storing in Inverter timezone (mostly set to UTC)
-      utctime = gmtime(&((archdatalist+i)->date));
-      day = utctime->tm_mday;
-      month = utctime->tm_mon +1;
-      year = utctime->tm_year + 1900;
-      hour = utctime->tm_hour;
-      minute = utctime->tm_min;
-      second = utctime->tm_sec;
-      sprintf( datetime, "%04d-%02d-%02d %02d:%02d:%02d", year, month, day, hour, minute, second);
-      if( flag.debug == 1 ) printf( "utc datetime = %s\n", datetime);    
-      sprintf(SQLQUERY,"INSERT INTO DayData ( DateTime, Inverter, Serial, CurrentPower, EtotalToday ) VALUES (\'%s\',\'%s\',%ld,%0.f, %.3f ) ON DUPLICATE KEY UPDATE DateTime=Datetime, Inverter=VALUES(Inverter), Serial=VALUES(Serial), CurrentPower=VALUES(CurrentPower), EtotalToday=VALUES(EtotalToday)",datetime, (archdatalist+i)->inverter, (archdatalist+i)->serial, (archdatalist+i)->current_value, (archdatalist+i)->accum_value );
-      if (flag.debug == 1) printf("SQL Query: %s\n",SQLQUERY);
-      DoQuery(SQLQUERY);
-    }
-    mysql_close(conn);
-
-    // Update Mysql with live data
-    if(livedatalen > 0) printf( "Storing live data (%d records)\n",  livedatalen); 
-    live_mysql( &conf, &flag, livedatalist, livedatalen );
+    StoreData( &conf, &flag, archdatalist, archdatalen, livedatalist, livedatalen );
   }
 
   // Clean up data
@@ -1558,7 +1633,10 @@ int main(int argc, char **argv)
   if( livedatalen > 0 )
     free( livedatalist );
   livedatalen=0;
-  close(s);
-  if( flag.verbose == 1) printf("Done (resultcode = %d).\n", result);
+  SchedFree( &sched );
+  PoolFree( &pool );
+  FreeCommandFile( &cmdfile );
+  MetaFree( &conf );
+  if( flag.verbose == 1) printf("Done (resultcode = %d, %lu retransmits).\n", result, conf.retransmits);
   return(result);
 }
@@ -0,0 +1,215 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * What every run used to work out again before it could connect, kept in
+ * StateDir/snapshot: the unit conversion keys of sma.in, as long as that
+ * has the same mtime and size, and whether the database schema was right
+ * and the Almanac had its row today, with today's sunrise and sunset.  A
+ * run that finds it all there reads the one file instead of sma.in, and
+ * neither checks the schema nor asks the database whether it is light.
+ * The checks are done again each new day, with another database or
+ * location, or when SCHEMA changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "sma_struct.h"
+#include "almanac.h"
+#include "snap.h"
+
+/* Today as YYYY-MM-DD local time */
+void snap_today( char * today )
+{
+  time_t now = time(NULL);
+  struct tm tm;
+
+  localtime_r( &now, &tm );
+  strftime( today, 12, "%Y-%m-%d", &tm );
+}
+
+void snap_database( ConfType * conf, char * database )
+{
+  snprintf( database, 64, "%s/%s", conf->MySqlHost, conf->MySqlDatabase );
+}
+
+/*
+ * Read StateDir/snapshot if there is one, after GetConfig, and take the
+ * unit conversion keys from it if sma.in did not change since.
+ * Returns 1 if it did, else 0 and InitReturnKeys has to read them
+ */
+int SnapLoad( SnapType * snap, ConfType * conf, FlagType * flag )
+{
+  FILE *fp;
+  char path[200];
+  struct stat st;
+  SnapHeaderType head;
+  ReturnType *keys;
+
+  memset( snap, 0, sizeof(SnapType) );
+  snap->changed = 1;
+  strcpy( snap->head.magic, "smasnap" );
+  snap->head.version = SNAP_VERSION;
+  snap->head.keysize = sizeof(ReturnType);
+  strcpy( snap->head.File, conf->File );
+  if( stat( conf->File, &st ) == 0 ) {
+    snap->head.file_mtime = (long)st.st_mtime;
+    snap->head.file_size = (long)st.st_size;
+  }
+  sprintf( path, "%s/snapshot", conf->StateDir );
+  if(( fp = fopen( path, "r" )) == NULL )
+    return( 0 );
+  if(( fread( &head, sizeof(head), 1, fp ) != 1 )||( memcmp( head.magic, "smasnap", 8 ) != 0 )||( head.version != SNAP_VERSION )||( head.keysize != sizeof(ReturnType) )) {
+    fclose( fp );
+    if( flag->debug == 1 ) printf("Not using %s, it is not from this version\n", path );
+    return( 0 );
+  }
+  if(( strcmp( head.File, conf->File ) != 0 )||( head.file_mtime != snap->head.file_mtime )||( head.file_size != snap->head.file_size )||( head.num_return_keys == 0 )) {
+    // the checks are still good, only the keys are not
+    strcpy( head.File, snap->head.File );
+    head.file_mtime = snap->head.file_mtime;
+    head.file_size = snap->head.file_size;
+    snap->head = head;
+    fclose( fp );
+    if( flag->debug == 1 ) printf("%s changed since %s, reading its keys\n", conf->File, path );
+    return( 0 );
+  }
+  if(( keys = (ReturnType *)malloc( sizeof(ReturnType)*head.num_return_keys )) == NULL ) {
+    fclose( fp );
+    return( 0 );
+  }
+  if( fread( keys, sizeof(ReturnType), head.num_return_keys, fp ) != head.num_return_keys ) {
+    free( keys );
+    fclose( fp );
+    return( 0 );
+  }
+  fclose( fp );
+  snap->head = head;
+  snap->changed = 0;
+  conf->returnkeylist = keys;
+  conf->num_return_keys = head.num_return_keys;
+  if( flag->debug == 1 ) printf("Loaded %d unit conversion keys from %s\n", head.num_return_keys, path );
+  return( 1 );
+}
+
+/* 1 if the database was found to have schema today */
+int SnapSchema( SnapType * snap, ConfType * conf, char * schema )
+{
+  char today[12], database[64];
+
+  snap_today( today );
+  snap_database( conf, database );
+  return(( strcmp( snap->head.schema, schema ) == 0 )&&( strcmp( snap->head.database, database ) == 0 )&&( strcmp( snap->head.checked, today ) == 0 ));
+}
+
+/* 1 if the Almanac has today's row for this location, as CheckAlmanac makes sure */
+int SnapAlmanac( SnapType * snap, ConfType * conf, FlagType * flag )
+{
+  char today[12], database[64];
+
+  snap_today( today );
+  snap_database( conf, database );
+  return(( flag->location == 1 )&&( flag->mysql == 1 )&&( strcmp( snap->head.almanac, today ) == 0 )&&( strcmp( snap->head.database, database ) == 0 )&&( snap->head.latitude == conf->latitude_f )&&( snap->head.longitude == conf->longitude_f ));
+}
+
+/*
+ * What is_light would find in the Almanac, from today's sunrise and sunset
+ * Returns 1 if light, 0 if not and -1 if the snapshot does not know
+ */
+int SnapLight( SnapType * snap, ConfType * conf, FlagType * flag )
+{
+  char now[12], sunrise[12], sunset[12];
+  time_t t = time(NULL);
+  struct tm tm;
+  int light;
+
+  if( SnapAlmanac( snap, conf, flag ) == 0 )
+    return( -1 );
+  localtime_r( &t, &tm );
+  strftime( now, sizeof(now), "%H:%M:%S", &tm );
+  sprintf( sunrise, "%s:00", snap->head.sunrise );
+  sprintf( sunset, "%s:00", snap->head.sunset );
+  light = ( strcmp( sunrise, now ) < 0 )&&( strcmp( sunset, now ) > 0 );
+  if( flag->debug == 1 ) printf( "light = %d (sunrise %s sunset %s from the snapshot)\n", light, snap->head.sunrise, snap->head.sunset );
+  return( light );
+}
+
+/*
+ * Note what was checked in the database this run: that it has schema,
+ * if not NULL, and the Almanac today's row, if almanac is set
+ */
+void SnapChecked( SnapType * snap, ConfType * conf, FlagType * flag, char * schema, int almanac )
+{
+  char today[12], database[64];
+  char *time;
+
+  if(( flag->mysql == 0 )||(( schema == NULL )&&( almanac == 0 )))
+    return;
+  snap_today( today );
+  snap_database( conf, database );
+  if( strcmp( snap->head.database, database ) != 0 ) {
+    strcpy( snap->head.schema, "" );
+    strcpy( snap->head.almanac, "" );
+    strcpy( snap->head.database, database );
+  }
+  if( schema != NULL ) {
+    strcpy( snap->head.schema, schema );
+    strcpy( snap->head.checked, today );
+  }
+  if(( almanac )&&( flag->location == 1 )) {
+    strcpy( snap->head.almanac, today );
+    snap->head.latitude = conf->latitude_f;
+    snap->head.longitude = conf->longitude_f;
+    time = sunrise( conf, flag->debug );
+    strcpy( snap->head.sunrise, time );
+    free( time );
+    time = sunset( conf, flag->debug );
+    strcpy( snap->head.sunset, time );
+    free( time );
+  }
+  snap->changed = 1;
+}
+
+/* Write StateDir/snapshot if anything in it changed */
+void SnapSave( SnapType * snap, ConfType * conf, FlagType * flag )
+{
+  FILE *fp;
+  char path[200], tmppath[210];
+
+  if( snap->changed == 0 )
+    return;
+  sprintf( path, "%s/snapshot", conf->StateDir );
+  sprintf( tmppath, "%s.tmp", path );
+  if(( fp = fopen( tmppath, "w" )) == NULL ) {
+    if( flag->debug == 1 ) printf("Cannot write %s, not keeping the snapshot\n", tmppath );
+    return;
+  }
+  snap->head.num_return_keys = conf->num_return_keys;
+  fwrite( &snap->head, sizeof(SnapHeaderType), 1, fp );
+  fwrite( conf->returnkeylist, sizeof(ReturnType), conf->num_return_keys, fp );
+  if( fclose( fp ) != 0 ) {
+    printf("ERROR: Cannot write %s\n", tmppath );
+    return;
+  }
+  if( rename( tmppath, path ) < 0 )
+    printf("ERROR: Cannot update %s\n", path );
+  snap->changed = 0;
+}
@@ -0,0 +1,57 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef H_SNAP
+  #define H_SNAP
+
+#include "sma_struct.h"
+
+#define SNAP_VERSION 1
+
+/* StateDir/snapshot as written: this and then the unit conversion keys */
+typedef struct{
+  char magic[8];              /* "smasnap", then the layout of the build that wrote it */
+  int  version;
+  int  keysize;               /* sizeof(ReturnType) */
+  char File[80];              /* sma.in the keys were read from, with its mtime and size then */
+  long file_mtime;
+  long file_size;
+  unsigned int num_return_keys;
+  char schema[20];            /* database schema found, on MySqlHost/MySqlDatabase, on that day */
+  char database[64];
+  char checked[12];
+  char almanac[12];           /* day the Almanac had its row, for latitude and longitude */
+  float latitude;
+  float longitude;
+  char sunrise[6];            /* HH:MM local time that day */
+  char sunset[6];
+} SnapHeaderType;
+
+typedef struct{
+  SnapHeaderType head;
+  int changed;                /* write it back at SnapSave */
+} SnapType;
+
+extern int SnapLoad( SnapType * snap, ConfType * conf, FlagType * flag );
+extern int SnapSchema( SnapType * snap, ConfType * conf, char * schema );
+extern int SnapLight( SnapType * snap, ConfType * conf, FlagType * flag );
+extern int SnapAlmanac( SnapType * snap, ConfType * conf, FlagType * flag );
+extern void SnapChecked( SnapType * snap, ConfType * conf, FlagType * flag, char * schema, int almanac );
+extern void SnapSave( SnapType * snap, ConfType * conf, FlagType * flag );
+
+#endif
@@ -0,0 +1,133 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * The database work at startup: the Almanac, the schema check and the auto
+ * dates each open a connection of their own, so together they take a while.
+ * With MySQL they run in a thread of their own next to the inverter connect,
+ * login and live reads, and are joined before the archive needs the dates.
+ * The task works on copies of conf and flag and main leaves the database
+ * alone until the join, the connection in sma_mysql.c is shared.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <mysql/mysql.h>
+#include "sma_struct.h"
+#include "sma_mysql.h"
+#include "transport.h"
+#include "startup.h"
+
+extern void CheckAlmanac( ConfType * conf, FlagType * flag );
+extern int auto_set_dates( ConfType * conf, FlagType * flag );
+
+void * startup_task( void * arg )
+{
+  StartupType *startup = (StartupType *)arg;
+  long start = monotonic_ms();
+
+  if( startup->almanac ) {
+    CheckAlmanac( &startup->conf, &startup->flag );
+    startup->almanac_ms = monotonic_ms() - start;
+  }
+  start += startup->almanac_ms;
+  if(( startup->flag.mysql == 1 )&&( startup->schema != NULL )) {
+    if( startup->flag.debug == 1 ) printf( "Before Check Schema\n" );
+    startup->schema_ok = check_schema( &startup->conf, &startup->flag, startup->schema );
+    startup->schema_ms = monotonic_ms() - start;
+  }
+  start += startup->schema_ms;
+  if( startup->dates ) {
+    if( startup->flag.debug == 1 ) printf( "Before auto_set_dates\n" );
+    auto_set_dates( &startup->conf, &startup->flag );
+    startup->dates_ms = monotonic_ms() - start;
+  }
+  if( startup->running )
+    mysql_thread_end();
+  return( NULL );
+}
+
+/* Hand what the task found to main, returns -1 for the wrong schema */
+int startup_apply( StartupType * startup, ConfType * conf, FlagType * flag )
+{
+  if( startup->dates ) {
+    strcpy( conf->datefrom, startup->conf.datefrom );
+    strcpy( conf->dateto, startup->conf.dateto );
+    flag->daterange = startup->flag.daterange;
+  }
+  if( flag->verbose == 1 ) printf( "QUERY RANGE from %s to %s (daterange = %d)\n", conf->datefrom, conf->dateto, flag->daterange );
+  if(( flag->mysql == 1 )&&( startup->schema_ok != 1 )) {
+    printf("ERROR: Schema not correct\n");
+    return( -1 );
+  }
+  return( 0 );
+}
+
+/*
+ * Start the database work: the Almanac if almanac is set, the schema check
+ * with MySQL unless schema is NULL as it is known to be right, and the auto
+ * dates if dates is set.  Without MySQL, or if no
+ * thread can be had, it is done right here and StartupJoin only reports.
+ * Returns 0 on success and -1 for the wrong schema when done here
+ */
+int StartupBegin( StartupType * startup, ConfType * conf, FlagType * flag, char * schema, int almanac, int dates )
+{
+  memset( startup, 0, sizeof(StartupType) );
+  startup->conf = *conf;
+  startup->flag = *flag;
+  startup->schema = schema;
+  startup->schema_ok = ( schema == NULL );
+  startup->almanac = almanac;
+  startup->dates = dates;
+  startup->start = monotonic_ms();
+  if( flag->mysql == 1 ) {
+    mysql_library_init( 0, NULL, NULL ); // before a thread uses the client library
+    startup->running = 1;
+    if( pthread_create( &startup->thread, NULL, startup_task, startup ) == 0 )
+      return( 0 );
+    startup->running = 0;
+    if( flag->debug == 1 ) printf( "No thread for the database work, doing it first\n" );
+  }
+  startup_task( startup );
+  startup->result = startup_apply( startup, conf, flag );
+  return( startup->result );
+}
+
+/*
+ * Wait for the database work to be done and take over its dates.  In
+ * verbose mode says what bounded the startup: the database work or what
+ * main did next to it.  Can be called again, it then only returns the same.
+ * Returns 0 on success and -1 for the wrong schema
+ */
+int StartupJoin( StartupType * startup, ConfType * conf, FlagType * flag )
+{
+  long main_ms, wait_ms, db_ms;
+
+  if( startup->running == 0 )
+    return( startup->result );
+  main_ms = monotonic_ms() - startup->start;
+  pthread_join( startup->thread, NULL );
+  startup->running = 0;
+  wait_ms = monotonic_ms() - startup->start - main_ms;
+  db_ms = startup->almanac_ms + startup->schema_ms + startup->dates_ms;
+  if( flag->verbose == 1 ) printf( "Startup: database %ld ms (almanac %ld, schema %ld, dates %ld) next to %ld ms on the inverter, waited %ld ms, critical path %s\n", db_ms, startup->almanac_ms, startup->schema_ms, startup->dates_ms, main_ms, wait_ms, ( wait_ms > 0 ) ? "database" : "inverter" );
+  startup->result = startup_apply( startup, conf, flag );
+  return( startup->result );
+}
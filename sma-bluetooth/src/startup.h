@@ -0,0 +1,42 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef H_STARTUP
+  #define H_STARTUP
+
+#include <pthread.h>
+#include "sma_struct.h"
+
+typedef struct{
+    pthread_t thread;
+    int running;           /* the task is started and not yet joined */
+    int result;            /* what StartupJoin returns once it is */
+    ConfType conf;         /* the task's own copies, main goes on with its */
+    FlagType flag;
+    char * schema;
+    int almanac;           /* what it does besides the schema check */
+    int dates;
+    int schema_ok;
+    long start;            /* ms, as monotonic_ms */
+    long almanac_ms, schema_ms, dates_ms;
+} StartupType;
+
+extern int StartupBegin( StartupType * startup, ConfType * conf, FlagType * flag, char * schema, int almanac, int dates );
+extern int StartupJoin( StartupType * startup, ConfType * conf, FlagType * flag );
+
+#endif
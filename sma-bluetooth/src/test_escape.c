@@ -0,0 +1,169 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Checks escape_frame, unescape_frame and add_escapes against the shifting
+ * versions they replaced, on random frames: make test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "escape.h"
+
+#define TEST_FRAMES 20000
+#define TEST_MAXLEN 900       /* escaped it still fits the 2048 of add_escapes */
+
+/* add_escapes as it was, shifting the rest of the frame for every escape */
+static void old_add_escapes(unsigned char *cp, int *len)
+{
+    int i,j;
+
+    for( i=19; i<(*len); i++ ) {
+      switch( cp[i] ) {
+        case 0x7d :
+        case 0x7e :
+        case 0x11 :
+        case 0x12 :
+        case 0x13 :
+          for( j=(*len); j>i; j-- ) cp[j] = cp[j-1];
+          cp[i+1] = cp[i]^0x20;
+          cp[i]=0x7d;
+          (*len)++;
+      }
+   }
+}
+
+/* strip_escapes as it was */
+static void old_strip_escapes(unsigned char *cp, int *len)
+{
+    int i,j;
+
+    for( i=0; i<(*len); i++ ) {
+      if( cp[i] == 0x7d ) { /*Found escape character. Need to convert*/
+        cp[i] = cp[i+1]^0x20;
+        for( j=i+1; j<(*len)-1; j++ ) cp[j] = cp[j+1];
+        (*len)--;
+      }
+   }
+}
+
+/* The copy loop read_bluetooth had */
+static int old_read_unescape(unsigned char *received, unsigned char *buf, int bytes_read)
+{
+    int i, rr=0;
+
+    for (i=0;i<bytes_read;i++) { //start copy the rec buffer in to received
+      if (buf[i] == 0x7d) { //did we receive the escape char
+        switch (buf[i+1]) {   // act depending on the char after the escape char
+          case 0x5e :
+            received[rr] = 0x7e;
+            break;
+          case 0x5d :
+            received[rr] = 0x7d;
+            break;
+          default :
+            received[rr] = buf[i+1] ^ 0x20;
+            break;
+        }
+        i++;
+      } else { 
+        received[rr] = buf[i];
+      }
+      rr++;
+    }
+    return( rr );
+}
+
+/* len random bytes, about one in every (special) of them one to escape */
+static void random_frame(unsigned char *cp, int len, int special)
+{
+    static const unsigned char specials[5] = { 0x11, 0x12, 0x13, 0x7d, 0x7e };
+    int i;
+
+    for( i=0; i<len; i++ )
+      if(( special > 0 )&&( rand() % special == 0 ))
+        cp[i] = specials[rand() % 5];
+      else
+        cp[i] = rand() & 0xff;
+}
+
+static int failed( int frame, const char * what, int len )
+{
+    printf("ERROR: frame %d of %d bytes: %s\n", frame, len, what );
+    return( 1 );
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char raw[TEST_MAXLEN+19];
+    unsigned char old[2*TEST_MAXLEN+40];
+    unsigned char new[2*TEST_MAXLEN+40];
+    unsigned char out[2*TEST_MAXLEN+40];
+    int frame, len, oldlen, newlen, n, errors=0;
+    unsigned int seed = ( argc > 1 ) ? (unsigned int)atoi( argv[1] ) : 1;
+    static const int density[5] = { 0, 100, 10, 3, 1 };
+
+    srand( seed );
+    for( frame=0; ( frame<TEST_FRAMES )&&( errors<10 ); frame++ ) {
+      len = ( frame < 40 ) ? frame : rand() % TEST_MAXLEN;
+      random_frame( raw, len+19, density[frame%5] );
+
+      // add_escapes leaves the 19 bytes up to the Data2+ 7e as they are
+      memset( old, 0, sizeof(old) );
+      memcpy( old, raw, len+19 );
+      oldlen = len+19;
+      old_add_escapes( old, &oldlen );
+      memcpy( new, raw, len+19 );
+      newlen = len+19;
+      if(( add_escapes( new, &newlen, sizeof(new) ) != 0 )||( newlen != oldlen )||( memcmp( old, new, oldlen ) != 0 ))
+        errors += failed( frame, "add_escapes differs from the old one", len );
+      memcpy( new, raw, len+19 );
+      newlen = len+19;
+      if(( oldlen > len+19 )&&( add_escapes( new, &newlen, oldlen-1 ) != -1 ))
+        errors += failed( frame, "add_escapes fits in a buffer one short", len );
+
+      // escape_frame does all of it, the same as the old code after the 19
+      n = escape_frame( out, sizeof(out), raw+19, len );
+      if(( n != oldlen-19 )||( memcmp( out, old+19, n ) != 0 ))
+        errors += failed( frame, "escape_frame differs from the old add_escapes", len );
+      if(( n > 0 )&&( escape_frame( out, n-1, raw+19, len ) != -1 ))
+        errors += failed( frame, "escape_frame fits in a buffer one short", len );
+
+      // and back: unescape_frame, strip_escapes and the read_bluetooth loop
+      n = unescape_frame( out, sizeof(out), old+19, oldlen-19 );
+      if(( n != len )||( memcmp( out, raw+19, len ) != 0 ))
+        errors += failed( frame, "unescape_frame does not give the frame back", len );
+      if(( len > 0 )&&( unescape_frame( out, len-1, old+19, oldlen-19 ) != -1 ))
+        errors += failed( frame, "unescape_frame fits in a buffer one short", len );
+      memcpy( new, old+19, oldlen-19 );
+      newlen = oldlen-19;
+      old_strip_escapes( new, &newlen );
+      if(( newlen != n )||( memcmp( new, out, n ) != 0 ))
+        errors += failed( frame, "unescape_frame differs from the old strip_escapes", len );
+      if(( old_read_unescape( new, old+19, oldlen-19 ) != n )||( memcmp( new, out, n ) != 0 ))
+        errors += failed( frame, "unescape_frame differs from the old read_bluetooth loop", len );
+    }
+    // a 7D at the very end, with nothing after it, is dropped
+    if( unescape_frame( out, sizeof(out), (unsigned char *)"\x01\x7d\x5e\x7d", 4 ) != 2 )
+      errors += failed( frame, "a 7D at the end is not dropped", 4 );
+    if( errors > 0 )
+      return( 1 );
+    printf("%d frames, escape_frame, unescape_frame and add_escapes as before\n", frame );
+    return( 0 );
+}
@@ -0,0 +1,136 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * Checks pppfcs16, eight bytes a round, against the byte-table loop it
+ * replaced on random data, lengths and offsets, and times both: make test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fcs.h"
+
+#define TEST_FRAMES 100000
+#define TEST_MAXLEN 1100      /* a reply of several frames, as ReadStream checks it */
+#define TEST_BYTES  (16L*1024*1024) /* timed through each of them */
+
+static u_int16_t old_fcstab[256];
+
+/* fcstab as RFC 1662 makes it, for polynomial 0x8408 */
+static void old_make_fcstab( void )
+{
+    u_int16_t v;
+    int b, i;
+
+    for( b=0; b<256; b++ ) {
+      v = b;
+      for( i=0; i<8; i++ )
+        v = ( v & 1 ) ? ( v >> 1 ) ^ 0x8408 : v >> 1;
+      old_fcstab[b] = v;
+    }
+}
+
+/* pppfcs16 as it was, a byte a round */
+static u_int16_t old_pppfcs16( u_int16_t fcs, void *_cp, int len )
+{
+    register unsigned char *cp = (unsigned char *)_cp;
+
+    while (len--)
+        fcs = (fcs >> 8) ^ old_fcstab[(fcs ^ *cp++) & 0xff];
+    return (fcs);
+}
+
+static int failed( int frame, const char * what, int offset, int len )
+{
+    printf("ERROR: frame %d of %d bytes at offset %d: %s\n", frame, len, offset, what );
+    return( 1 );
+}
+
+static double seconds( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+/*
+ * Time fcs over TEST_BYTES of buf in frames of len, each going on from the
+ * fcs of the one before, so none can be left out.  Returns ns a byte
+ */
+static double timed( u_int16_t (* volatile fcs)( u_int16_t, void *, int ), unsigned char *buf, int len, u_int16_t *sum )
+{
+    double start = seconds();
+    long done;
+
+    for( done=0; done<TEST_BYTES; done+=len )
+      *sum = fcs( *sum, buf+( done & 7 ), len );
+    return(( seconds() - start ) * 1e9 / done );
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char buf[TEST_MAXLEN+2+8];
+    unsigned int seed = ( argc > 1 ) ? (unsigned int)atoi( argv[1] ) : 1;
+    static const int lengths[4] = { 24, 60, 300, 1100 };
+    int frame, offset, len, split, i, errors=0;
+    u_int16_t init, fcs, sum=PPPINITFCS16;
+    double old_ns, new_ns;
+
+    old_make_fcstab();
+    srand( seed );
+    for( frame=0; ( frame<TEST_FRAMES )&&( errors<10 ); frame++ ) {
+      len = ( frame < 40 ) ? frame : rand() % ( TEST_MAXLEN+1 );
+      offset = rand() % 8;
+      for( i=0; i<len+2+offset; i++ )
+        buf[i] = rand() & 0xff;
+      init = ( frame % 2 ) ? PPPINITFCS16 : rand() & 0xffff;
+      fcs = old_pppfcs16( init, buf+offset, len );
+      if( pppfcs16( init, buf+offset, len ) != fcs )
+        errors += failed( frame, "pppfcs16 differs from the byte loop", offset, len );
+
+      // taken in two parts, as ReadStream does over the frames of a reply
+      split = ( len > 0 ) ? rand() % len : 0;
+      if( pppfcs16( pppfcs16( init, buf+offset, split ), buf+offset+split, len-split ) != fcs )
+        errors += failed( frame, "pppfcs16 in two parts differs", offset, len );
+
+      // a packet with its own fcs after it is good, with a bit flipped not
+      fcs = old_pppfcs16( PPPINITFCS16, buf+offset, len ) ^ 0xffff;
+      buf[offset+len] = fcs & 0xff;
+      buf[offset+len+1] = fcs >> 8;
+      if( goodfcs16( buf+offset, len+2 ) != ( len > 0 ))
+        errors += failed( frame, "goodfcs16 does not take the packet", offset, len );
+      buf[offset+rand()%(len+2)] ^= 1 << ( rand() % 8 );
+      if( goodfcs16( buf+offset, len+2 ))
+        errors += failed( frame, "goodfcs16 takes a packet with a bit flipped", offset, len );
+    }
+    if( errors > 0 )
+      return( 1 );
+    printf("%d frames, pppfcs16 and goodfcs16 as the byte loop\n", frame );
+
+    for( i=0; i<sizeof(buf); i++ )
+      buf[i] = rand() & 0xff;
+    for( i=0; i<4; i++ ) {
+      old_ns = timed( old_pppfcs16, buf, lengths[i], &sum );
+      new_ns = timed( pppfcs16, buf, lengths[i], &sum );
+      printf("%4d byte frames: byte loop %.2f ns/byte, eight a round %.2f ns/byte, %.1fx\n", lengths[i], old_ns, new_ns, old_ns / new_ns );
+    }
+    return( 0 );
+}
@@ -0,0 +1,267 @@
+/* tool to read power production data for SMA solar power convertors
+   Copyright Wim Hofman 2010
+   Copyright Stephen Collier 2010,2011
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+/*
+ * A Speedwire stand-in for smatool to talk to on 127.0.0.1, used by
+ * test_speedwire.sh: test_speedwire PORT.  It answers the Data2+ requests
+ * of sma.in.new as one inverter would: the login, the value ranges with the
+ * values in spot_values[], and the archive with a record every 5 minutes
+ * whose total grows by 150 Wh.  Once bound it goes into the background and
+ * prints its pid, and it exits when nothing has come for TEST_IDLE seconds
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TEST_IDLE 60
+#define TEST_SUSYID 0x0083
+#define TEST_SERIAL 2100000000UL
+#define TEST_ARCHIVE_MAX 500  /* records in one reply, as an inverter */
+#define TEST_ARCHIVE_CHUNK 30 /* records in one of its packets */
+#define TEST_TOTAL 1000000ULL /* Wh at the first archive record */
+
+#define CMD_LOGIN   0xfffd040c
+#define CMD_LOGOFF  0xfffd010e
+#define CMD_ARCHIVE 0x70000200
+
+/* The values the inverter has, by LRI, in LRI order */
+static const struct {
+    int lri;                  /* key2 << 8 | key1 */
+    int size;                 /* of its record */
+    int kind;                 /* 0 a number, 1 a status attribute, 2 a time, 3 the name */
+    unsigned long value;
+} spot_values[] = {
+    { 0x2148, 40, 2, 0 },
+    { 0x251e, 28, 0, 1300 },
+    { 0x2601, 16, 0, 12345678 },
+    { 0x2622, 16, 0, 4321 },
+    { 0x263f, 28, 0, 1234 },
+    { 0x4057, 28, 0, 35000 },
+    { 0x411e, 28, 0, 3000 },
+    { 0x411f, 28, 0, 3000 },
+    { 0x4120, 28, 0, 3000 },
+    { 0x4164, 28, 0, 3000 },
+    { 0x451f, 28, 0, 32000 },
+    { 0x4521, 28, 0, 31000 },
+    { 0x4640, 28, 0, 1200 },
+    { 0x4641, 28, 0, 0xffffffff },
+    { 0x4642, 28, 0, 0xffffffff },
+    { 0x4648, 28, 0, 23012 },
+    { 0x4649, 28, 0, 0xffffffff },
+    { 0x464a, 28, 0, 0xffffffff },
+    { 0x4650, 28, 0, 5123 },
+    { 0x4651, 28, 0, 0xffffffff },
+    { 0x4652, 28, 0, 0xffffffff },
+    { 0x4656, 28, 0, 777 },
+    { 0x4657, 28, 0, 5001 },
+    { 0x821e, 40, 3, 0 },
+    { 0x821f, 40, 1, 18 },
+    { 0x8220, 40, 1, 19 },
+    { 0x8234, 40, 0, 0x02304f04 },
+    { 0x832a, 28, 0, 3000 },
+    { 0xa21e, 40, 2, 0 },
+};
+
+static int sock;
+static struct sockaddr_in peer;
+
+static void put16( unsigned char * p, unsigned int v )
+{
+    p[0] = v & 0xff;
+    p[1] = ( v >> 8 ) & 0xff;
+}
+
+static void put32( unsigned char * p, unsigned long v )
+{
+    put16( p, v & 0xffff );
+    put16( p+2, ( v >> 16 ) & 0xffff );
+}
+
+static unsigned long get32( unsigned char * p )
+{
+    return( p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (unsigned long)p[3] << 24 ));
+}
+
+/*
+ * Send a reply to request req: its packet id, cmd with the reply bit and
+ * the payload, as a Speedwire datagram
+ */
+static void reply( unsigned char * req, int togo, unsigned char * payload, int len )
+{
+    unsigned char packet[1500];
+    unsigned char * body = packet+18;
+    int n = 28+len;
+
+    if( 18+n+3+4 > sizeof(packet) )
+      return;
+    while( n % 4 ) body[n++] = 0;
+    memcpy( packet, "SMA\0\0\x04\x02\xa0\0\0\0\x01", 12 );
+    packet[12] = ( n+2 ) >> 8;
+    packet[13] = ( n+2 ) & 0xff;
+    memcpy( packet+14, "\x00\x10\x60\x65", 4 );
+    body[0] = n/4;
+    body[1] = 0xa0;
+    memset( body+2, 0xff, 6 );
+    put16( body+8, 0 );
+    put16( body+10, TEST_SUSYID );
+    put32( body+12, TEST_SERIAL );
+    put16( body+16, 0 );
+    put16( body+18, 0 );
+    put16( body+20, togo );
+    memcpy( body+22, req+22, 2 );                // packet id
+    put32( body+24, get32( req+24 ) | 1 );
+    memcpy( body+28, payload, len );
+    memset( packet+18+n, 0, 4 );
+    sendto( sock, packet, 18+n+4, 0, (struct sockaddr *)&peer, sizeof(peer) );
+}
+
+/* The values from LRI first to last, each record as big as the first's */
+static int records( unsigned char * out, int first, int last )
+{
+    unsigned long now = time(NULL);
+    unsigned char * rec;
+    int i, size=0, len=0;
+
+    for( i=0; i<sizeof(spot_values)/sizeof(spot_values[0]); i++ ) {
+      if(( spot_values[i].lri < first )||( spot_values[i].lri > last ))
+        continue;
+      if( size == 0 )
+        size = spot_values[i].size;
+      rec = out+len;
+      memset( rec, 0, size );
+      rec[0] = 0x01;
+      rec[1] = spot_values[i].lri & 0xff;
+      rec[2] = spot_values[i].lri >> 8;
+      put32( rec+4, now );
+      switch( spot_values[i].kind ) {
+        case 0: put32( rec+8, spot_values[i].value ); break;
+        case 1: put32( rec+8, 0x01000000 | spot_values[i].value ); break;
+        case 2: put32( rec+8, now - 3600 ); break;
+        case 3: sprintf( (char *)rec+8, "SN: %lu", TEST_SERIAL ); break;
+      }
+      len += size;
+    }
+    return( len );
+}
+
+/* Answer one Data2+ request, the body after 00 10 60 65 */
+static void answer( unsigned char * req, int len )
+{
+    unsigned char payload[12*TEST_ARCHIVE_CHUNK+8];
+    unsigned long cmd, now, from, to, t;
+    unsigned long long total;
+    int chunks, n, i;
+
+    if( len < 36 )
+      return;
+    cmd = get32( req+24 );
+    now = time(NULL);
+    switch( cmd ) {
+      case CMD_LOGIN:
+        put32( payload, now );
+        put32( payload+4, 0 );
+        put32( payload+8, now );
+        reply( req, 0, payload, 12 );
+        break;
+
+      case CMD_LOGOFF:
+        break;
+
+      case CMD_ARCHIVE:
+        from = get32( req+28 );
+        to = get32( req+32 );
+        from -= from % 300;
+        n = ( to >= from ) ? ( to - from ) / 300 + 1 : 0;
+        if( n > TEST_ARCHIVE_MAX ) n = TEST_ARCHIVE_MAX;
+        chunks = ( n > 0 ) ? ( n + TEST_ARCHIVE_CHUNK - 1 ) / TEST_ARCHIVE_CHUNK : 1;
+        t = from;
+        total = TEST_TOTAL;
+        for( ; chunks > 0; chunks-- ) {
+          memcpy( payload, req+28, 8 );
+          for( i=0; ( i<TEST_ARCHIVE_CHUNK )&&( n>0 ); i++, n-- ) {
+            put32( payload+8+12*i, t );
+            put32( payload+8+12*i+4, total & 0xffffffff );
+            put32( payload+8+12*i+8, total >> 32 );
+            t += 300;
+            total += 150;
+          }
+          reply( req, chunks-1, payload, 8+12*i );
+        }
+        break;
+
+      default:
+        {
+          unsigned char values[8+40*sizeof(spot_values)/sizeof(spot_values[0])];
+
+          memcpy( values, req+28, 8 );
+          n = records( values+8, req[29] | ( req[30] << 8 ), req[33] | ( req[34] << 8 ));
+          reply( req, 0, values, 8+n );
+        }
+        break;
+    }
+}
+
+int main( int argc, char ** argv )
+{
+    struct sockaddr_in addr;
+    struct timeval idle = { TEST_IDLE, 0 };
+    socklen_t peerlen;
+    unsigned char packet[1500];
+    pid_t pid;
+    int n, len;
+
+    if( argc < 2 ) {
+      printf("usage: %s PORT\n", argv[0] );
+      return( 2 );
+    }
+    if(( sock = socket( AF_INET, SOCK_DGRAM, 0 )) < 0 ) {
+      printf("ERROR: Cannot open a socket\n");
+      return( 1 );
+    }
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( atoi( argv[1] ));
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if( bind( sock, (struct sockaddr *)&addr, sizeof(addr) ) < 0 ) {
+      printf("ERROR: Cannot bind to port %s\n", argv[1] );
+      return( 1 );
+    }
+    setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle) );
+    // bound, smatool can start now
+    if(( pid = fork()) != 0 ) {
+      printf("%d\n", (int)pid );
+      return(( pid > 0 ) ? 0 : 1 );
+    }
+    fclose( stdout );
+    for(;;) {
+      peerlen = sizeof(peer);
+      if(( n = recvfrom( sock, packet, sizeof(packet), 0, (struct sockaddr *)&peer, &peerlen )) < 0 )
+        return( 0 );
+      len = packet[12]*256 + packet[13] - 2;
+      if(( n < 18 )||( memcmp( packet, "SMA\0", 4 ) != 0 )||( memcmp( packet+14, "\x00\x10\x60\x65", 4 ) != 0 )||( len <= 0 )||( 18+len > n ))
+        continue;
+      answer( packet+18, len );
+    }
+}
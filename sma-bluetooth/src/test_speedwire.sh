@@ -0,0 +1,46 @@
+#!/bin/sh
+# Poll test_speedwire, the Speedwire stand-in, over speedwire://127.0.0.1:PORT
+# and check the live values and the six hours of archive that come back.
+# usage: test_speedwire.sh [SMATOOL [PORT]], run from src by make test
+
+SMATOOL=${1:-./smatool}
+PORT=${2:-19522}
+DIR=$(mktemp -d) || exit 1
+PID=$(./test_speedwire $PORT) || exit 1
+trap 'kill $PID 2>/dev/null; rm -rf $DIR' EXIT
+
+cat > $DIR/smatool.conf <<EOF
+BTAddress 00:00:00:00:00:00
+BTTimeout 2
+Password 0000
+File sma.in.new
+Transport speedwire://127.0.0.1:$PORT
+StateDir $DIR
+EOF
+
+$SMATOOL -c $DIR/smatool.conf -n -from "2000-01-01 00:00:00" -to "2000-01-01 05:55:00" > $DIR/out 2>&1
+rc=$?
+errors=0
+check() {
+  if ! grep -q "$1" $DIR/out; then
+    echo "test_speedwire: no '$1' in the output"
+    errors=1
+  fi
+}
+[ $rc -eq 0 ] || { echo "test_speedwire: smatool ended with $rc"; errors=1; }
+check 'Total Energy  *= 12345.678'
+check 'Grid Frequency  *= 50.01'
+check 'Output Phase 1  *= 1200'
+check '2000-01-01 00:00:00  total=1000.150 kWh'
+check '2000-01-01 05:55:00  total=1010.800 kWh'
+records=$(grep -c 'kWh current=' $DIR/out)
+[ $records -eq 72 ] || { echo "test_speedwire: $records archive records instead of 72"; errors=1; }
+if grep -q ERROR $DIR/out; then
+  grep ERROR $DIR/out
+  errors=1
+fi
+if [ $errors -ne 0 ]; then
+  tail -20 $DIR/out
+  exit 1
+fi
+echo "Speedwire on 127.0.0.1:$PORT, live values and $records archive records"
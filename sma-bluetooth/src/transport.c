@@ -0,0 +1,1164 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE /* getline from stdio needs this */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#include <errno.h>
+#include "sma_struct.h"
+#include "transport.h"
+#include "escape.h"
+#include "fcs.h"
+
+/* One line of a Capture file, bytes we sent (S) or received (R) */
+struct ReplayRecord{
+  char direction;
+  int  len;
+  unsigned char * data;
+};
+
+/* Milliseconds on the monotonic clock */
+long monotonic_ms( void )
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+/*
+ * The links file in StateDir remembers, per BTAddress, the RFCOMM channel
+ * and local adapter of the last connect that worked:
+ *   00:11:22:33:44:55 1 00:1A:7D:DA:71:13
+ * Returns 0 if address was found, -1 if not
+ */
+int link_state_load( ConfType * conf, const char * address, int * channel, char * adapter )
+{
+  FILE *fp;
+  char path[200];
+  char line[200], addr[40], ad[40];
+  int ch;
+  int found=-1;
+
+  sprintf( path, "%s/links", conf->StateDir );
+  if(( fp = fopen( path, "r" )) == NULL )
+    return( -1 );
+  while( fgets( line, sizeof(line), fp ) != NULL ) {
+    if( sscanf( line, "%39s %d %39s", addr, &ch, ad ) != 3 )
+      continue;
+    if( strcasecmp( addr, address ) == 0 ) {
+      (*channel) = ch;
+      strncpy( adapter, ad, 19 );
+      adapter[19] = '\0';
+      found = 0;
+    }
+  }
+  fclose( fp );
+  return( found );
+}
+
+/* Record the channel and adapter that worked for address in the links file */
+void link_state_save( ConfType * conf, FlagType * flag, const char * address, int channel, const char * adapter )
+{
+  FILE *fp, *out;
+  char path[200], tmppath[210];
+  char line[200], addr[40];
+
+  sprintf( path, "%s/links", conf->StateDir );
+  sprintf( tmppath, "%s.tmp", path );
+  if(( out = fopen( tmppath, "w" )) == NULL ) {
+    if( flag->debug == 1 ) printf("Cannot write %s, not caching the link\n", tmppath );
+    return;
+  }
+  if(( fp = fopen( path, "r" )) != NULL ) {
+    while( fgets( line, sizeof(line), fp ) != NULL ) {
+      if(( sscanf( line, "%39s", addr ) == 1 )&&( strcasecmp( addr, address ) == 0 ))
+        continue;
+      fputs( line, out );
+    }
+    fclose( fp );
+  }
+  fprintf( out, "%s %d %s\n", address, channel, adapter );
+  fclose( out );
+  if( rename( tmppath, path ) < 0 )
+    printf("ERROR: Cannot update %s\n", path );
+}
+
+/*
+ * RFCOMM to the inverter, the normal way of talking to it.  Every other
+ * attempt goes to the channel and adapter that worked last time, the rest
+ * to channel 1 on any adapter.  Returns 0 when connected, 1 while the
+ * connect is in progress and -1 on error
+ */
+int rfcomm_open( TransportType * tp, ConfType * conf, FlagType * flag )
+{
+  struct sockaddr_rc addr = { 0 };
+  struct sockaddr_rc local = { 0 };
+  int cached;
+  int s;
+
+  if(( s = socket(AF_BLUETOOTH, SOCK_STREAM|SOCK_NONBLOCK, BTPROTO_RFCOMM)) < 0 )
+    return( -1 );
+  cached = (( tp->attempts%2 == 1 )&&( tp->cache_channel > 0 ));
+  tp->channel = cached ? tp->cache_channel : 1;
+  if( cached && ( strlen( tp->cache_adapter ) > 0 )) {
+    local.rc_family = AF_BLUETOOTH;
+    local.rc_channel = 0;
+    str2ba( tp->cache_adapter, &local.rc_bdaddr );
+    if(( bind( s, (struct sockaddr *)&local, sizeof(local) ) < 0 )&&( flag->debug == 1 ))
+      printf("Adapter %s not available, using any\n", tp->cache_adapter );
+  }
+  // set the connection parameters (who to connect to)
+  addr.rc_family = AF_BLUETOOTH;
+  addr.rc_channel = (uint8_t) tp->channel;
+  str2ba( tp->address, &addr.rc_bdaddr );
+  tp->fd = s;
+  if( connect( s, (struct sockaddr *)&addr, sizeof(addr) ) == 0 )
+    return( 0 );
+  if( errno == EINPROGRESS )
+    return( 1 );
+  close( s );
+  tp->fd = -1;
+  return( -1 );
+}
+
+/* Connected, remember how for next time */
+void rfcomm_up( TransportType * tp, FlagType * flag )
+{
+  struct sockaddr_rc local = { 0 };
+  socklen_t len = sizeof(local);
+  char adapter[20];
+
+  if( getsockname( tp->fd, (struct sockaddr *)&local, &len ) < 0 )
+    return;
+  ba2str( &local.rc_bdaddr, adapter );
+  if(( tp->channel != tp->cache_channel )||( strcmp( adapter, tp->cache_adapter ) != 0 )) {
+    tp->cache_channel = tp->channel;
+    strcpy( tp->cache_adapter, adapter );
+    link_state_save( tp->conf, flag, tp->address, tp->channel, adapter );
+  }
+}
+
+/*
+ * TCP stream carrying the same bytes as RFCOMM, host:port.  Connects
+ * without blocking like rfcomm_open
+ */
+int tcp_open( TransportType * tp, ConfType * conf, FlagType * flag )
+{
+  struct addrinfo hints, *ai, *p;
+  char host[80];
+  char *port;
+  int s=-1;
+  int status=-1;
+
+  strcpy( host, tp->address );
+  if(( port = strrchr( host, ':' )) == NULL ) {
+    printf("ERROR: No port in tcp transport %s\n", tp->address );
+    return( -2 );
+  }
+  *port++ = '\0';
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if( getaddrinfo( host, port, &hints, &ai ) != 0 ) {
+    printf("ERROR: Cannot resolve %s\n", tp->address );
+    return( -1 );
+  }
+  for( p=ai; p!=NULL; p=p->ai_next ) {
+    if(( s = socket( p->ai_family, p->ai_socktype|SOCK_NONBLOCK, p->ai_protocol )) < 0 )
+      continue;
+    if( connect( s, p->ai_addr, p->ai_addrlen ) == 0 )
+      status = 0;
+    else if( errno == EINPROGRESS )
+      status = 1;
+    else {
+      close( s );
+      s = -1;
+      continue;
+    }
+    break;
+  }
+  freeaddrinfo( ai );
+  if( s < 0 ) {
+    if( flag->debug == 1 ) printf("Cannot connect to %s\n", tp->address );
+    return( -1 );
+  }
+  tp->fd = s;
+  return( status );
+}
+
+/*
+ * Unix domain stream socket, /path/to/socket
+ */
+int unix_open( TransportType * tp, ConfType * conf, FlagType * flag )
+{
+  struct sockaddr_un addr = { 0 };
+  int s;
+
+  if(( s = socket( AF_UNIX, SOCK_STREAM, 0 )) < 0 )
+    return( -1 );
+  addr.sun_family = AF_UNIX;
+  strncpy( addr.sun_path, tp->address, sizeof(addr.sun_path)-1 );
+  if( connect( s, (struct sockaddr *)&addr, sizeof(addr) ) < 0 ) {
+    if( flag->debug == 1 ) printf("Cannot connect to %s\n", tp->address );
+    close( s );
+    return( -1 );
+  }
+  tp->fd = s;
+  return( 0 );
+}
+
+int socket_send( TransportType * tp, unsigned char * buf, int len )
+{
+  return send( tp->fd, buf, len, 0 );
+}
+
+int socket_recv( TransportType * tp, unsigned char * buf, int len, int flags )
+{
+  return recv( tp->fd, buf, len, flags );
+}
+
+void socket_close( TransportType * tp )
+{
+  close( tp->fd );
+}
+
+/*
+ * Push the next recorded reply into the socket pair, one recv() worth at a
+ * time so reads split exactly as they did when the capture was made
+ */
+void replay_feed( TransportType * tp )
+{
+  struct ReplayRecord * record;
+  int queued=0;
+
+  if(( ioctl( tp->fd, FIONREAD, &queued ) == 0 )&&( queued > 0 ))
+    return;
+  if( tp->next_record < tp->num_records ) {
+    record = tp->records+tp->next_record;
+    if( record->direction == 'S' )
+      return;
+    if( write( tp->peer, record->data, record->len ) != record->len )
+      printf("ERROR: Replay could not queue %d bytes\n", record->len );
+    tp->next_record++;
+  }
+}
+
+/*
+ * Play back a Capture file: every send consumes the next recorded S line and
+ * the R lines after it become readable on fd one by one.  No inverter needed.
+ */
+int replay_open( TransportType * tp, ConfType * conf, FlagType * flag )
+{
+  FILE *fp;
+  char *line = NULL;
+  char *token;
+  size_t len=0;
+  int sv[2];
+  struct ReplayRecord * record;
+
+  if(( fp = fopen( tp->address, "r" )) == NULL ) {
+    printf("ERROR: Cannot open replay file %s\n", tp->address );
+    return( -2 );
+  }
+  tp->records = NULL;
+  tp->num_records = 0;
+  tp->next_record = 0;
+  while( getline( &line, &len, fp ) != -1 ) {
+    if(( line[0] != 'S' )&&( line[0] != 'R' ))
+      continue;
+    tp->records = (struct ReplayRecord *)realloc( tp->records, sizeof(struct ReplayRecord)*(tp->num_records+1));
+    record = tp->records+tp->num_records;
+    record->direction = line[0];
+    record->len = 0;
+    record->data = (unsigned char *)malloc( strlen(line)/2+1 );
+    token = strtok( line+1, " \t\r\n" );
+    while( token != NULL ) {
+      record->data[record->len++] = (unsigned char)strtol( token, NULL, 16 );
+      token = strtok( NULL, " \t\r\n" );
+    }
+    tp->num_records++;
+  }
+  free( line );
+  fclose( fp );
+  if( flag->debug == 1 ) printf("Replaying %d records from %s\n", tp->num_records, tp->address );
+  if( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
+    return( -1 );
+  tp->fd = sv[0];
+  tp->peer = sv[1];
+  replay_feed( tp );
+  return( 0 );
+}
+
+int replay_send( TransportType * tp, unsigned char * buf, int len )
+{
+  if(( tp->next_record < tp->num_records )&&( tp->records[tp->next_record].direction == 'S' ))
+    tp->next_record++;
+  replay_feed( tp );
+  return len;
+}
+
+int replay_recv( TransportType * tp, unsigned char * buf, int len, int flags )
+{
+  int bytes_read;
+
+  bytes_read = recv( tp->fd, buf, len, flags );
+  if(( flags & MSG_PEEK ) == 0 )
+    replay_feed( tp );
+  return bytes_read;
+}
+
+void replay_close( TransportType * tp )
+{
+  int i;
+
+  close( tp->fd );
+  close( tp->peer );
+  for( i=0; i<tp->num_records; i++ )
+    free( tp->records[i].data );
+  free( tp->records );
+  tp->records = NULL;
+  tp->num_records = 0;
+}
+
+/*
+ * Speedwire, SMA's UDP protocol on the LAN, host[:port] with port 9522 by
+ * default.  It carries the same Data2+ packets as Bluetooth, only without
+ * the outer frame, escapes and FCS, so we translate at the edge: the Data2+
+ * part of every frame sent goes out as one datagram and every datagram that
+ * comes back is wrapped up in the Bluetooth frames sma.in and the extractors
+ * expect.  The Bluetooth handshake (hello, init and signal frames) has no
+ * Speedwire counterpart and is answered here.  Made up frames are queued on
+ * a socket pair and fd is an epoll set over that and the UDP socket, so it
+ * polls readable when either has something.
+ */
+
+/* Queue a Bluetooth frame from the inverter to us (all zero) for the reader */
+void speedwire_frame( TransportType * tp, unsigned char control, unsigned char * body, int len )
+{
+  unsigned char frame[RXMAXFRAME];
+  int n = 18+len;
+
+  frame[0] = 0x7e;
+  frame[1] = n & 0xff;
+  frame[2] = n >> 8;
+  frame[3] = frame[0]^frame[1]^frame[2];
+  memcpy( frame+4, tp->btaddr, 6 );
+  memset( frame+10, 0, 6 );
+  frame[16] = control;
+  frame[17] = 0x00;
+  memcpy( frame+18, body, len );
+  if( write( tp->peer, frame, n ) != n )
+    printf("ERROR: Speedwire could not queue %d bytes\n", n );
+}
+
+void speedwire_close( TransportType * tp )
+{
+  if( tp->fd >= 0 ) close( tp->fd );
+  if( tp->udp >= 0 ) close( tp->udp );
+  if( tp->local >= 0 ) close( tp->local );
+  if( tp->peer >= 0 ) close( tp->peer );
+  tp->udp = tp->local = tp->peer = -1;
+}
+
+int speedwire_open( TransportType * tp, ConfType * conf, FlagType * flag )
+{
+  unsigned char hello[] = { 0x00, 0x04, 0x70, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00 };
+  struct addrinfo hints, *ai, *p;
+  struct epoll_event ev = { 0 };
+  char host[80];
+  char *port;
+  int sv[2];
+
+  // sma.in still addresses the inverter by BTAddress, any value does
+  if( strlen( conf->BTAddress ) == 0 )
+    strcpy( conf->BTAddress, "00:00:00:00:00:00" );
+  if( sscanf( conf->BTAddress, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", tp->btaddr+5, tp->btaddr+4, tp->btaddr+3, tp->btaddr+2, tp->btaddr+1, tp->btaddr ) != 6 ) {
+    printf("ERROR: Bad BTAddress %s\n", conf->BTAddress );
+    return( -2 );
+  }
+  strcpy( host, tp->address );
+  if(( port = strrchr( host, ':' )) != NULL )
+    *port++ = '\0';
+  else
+    port = SPEEDWIRE_PORT;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if( getaddrinfo( host, port, &hints, &ai ) != 0 ) {
+    printf("ERROR: Cannot resolve %s\n", tp->address );
+    return( -1 );
+  }
+  for( p=ai; p!=NULL; p=p->ai_next ) {
+    if(( tp->udp = socket( p->ai_family, p->ai_socktype, p->ai_protocol )) < 0 )
+      continue;
+    if( connect( tp->udp, p->ai_addr, p->ai_addrlen ) == 0 )
+      break;
+    close( tp->udp );
+    tp->udp = -1;
+  }
+  freeaddrinfo( ai );
+  if( tp->udp < 0 ) {
+    if( flag->debug == 1 ) printf("Cannot connect to %s\n", tp->address );
+    return( -1 );
+  }
+  if(( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )||(( tp->fd = epoll_create1( EPOLL_CLOEXEC )) < 0 )) {
+    speedwire_close( tp );
+    tp->fd = -1;
+    return( -1 );
+  }
+  tp->local = sv[0];
+  tp->peer = sv[1];
+  ev.events = EPOLLIN;
+  epoll_ctl( tp->fd, EPOLL_CTL_ADD, tp->udp, &ev );
+  epoll_ctl( tp->fd, EPOLL_CTL_ADD, tp->local, &ev );
+  // a Bluetooth inverter greets us first, sma.in init waits for that
+  speedwire_frame( tp, 0x02, hello, sizeof(hello) );
+  return( 0 );
+}
+
+/*
+ * Answer the Bluetooth handshake frames ourselves and send the Data2+
+ * packet of the others, unescaped and without FCS, as one datagram
+ */
+int speedwire_send( TransportType * tp, unsigned char * buf, int len )
+{
+  unsigned char init[16] = { 0 };
+  unsigned char signal[] = { 0x05, 0x00, 0x00, 0x00, 0xff, 0x00 };
+  unsigned char packet[SPEEDWIRE_MAX];
+  int n;
+
+  if( len < 18 )
+    return( len );
+  switch( buf[16] ) {
+    case 0x02: // init, reply with the inverter and (made up) our address
+      memcpy( init, tp->btaddr, 6 );
+      speedwire_frame( tp, 0x05, init, sizeof(init) );
+      return( len );
+    case 0x03: // signal strength, always full
+      speedwire_frame( tp, 0x04, signal, sizeof(signal) );
+      return( len );
+  }
+  if(( len < 26 )||( memcmp( buf+18, "\x7e\xff\x03\x60\x65", 5 ) != 0 ))
+    return( len );
+  memcpy( packet, "SMA\0\0\x04\x02\xa0\0\0\0\x01\0\0\0\x10\x60\x65", 18 );
+  // the packet after its header, up to the 7e that ends it
+  if(( n = unescape_frame( packet+18, SPEEDWIRE_MAX-4-18, buf+23, len-1-23 )) < 2 )
+    return( -1 );
+  n += 18-2; // FCS
+  packet[12] = ( n-16 ) >> 8;
+  packet[13] = ( n-16 ) & 0xff;
+  memset( packet+n, 0, 4 );
+  if( send( tp->udp, packet, n+4, 0 ) != n+4 )
+    return( -1 );
+  return( len );
+}
+
+/*
+ * Wrap every Data2+ datagram waiting on the UDP socket in Bluetooth frames
+ * as an inverter would send them: 7e, the packet with its FCS escaped, 7e,
+ * split into frames of SPEEDWIRE_CHUNK bytes, marked 08 up to the last,
+ * which is 01.  Anything else is dropped
+ */
+void speedwire_pump( TransportType * tp )
+{
+  unsigned char packet[SPEEDWIRE_MAX];
+  unsigned char raw[2*SPEEDWIRE_MAX+8];
+  unsigned char data[SPEEDWIRE_MAX+8];
+  u_int16_t fcs;
+  int n, len, pos, chunk;
+
+  while(( n = recv( tp->udp, packet, sizeof(packet), MSG_DONTWAIT )) > 0 ) {
+    len = packet[12]*256 + packet[13] - 2;
+    if(( n < 18 )||( memcmp( packet, "SMA\0", 4 ) != 0 )||( memcmp( packet+14, "\x00\x10\x60\x65", 4 ) != 0 )||( len <= 0 )||( 18+len > n ))
+      continue;
+    memcpy( data, "\xff\x03\x60\x65", 4 );
+    memcpy( data+4, packet+18, len );
+    len += 4;
+    fcs = pppfcs16( 0xffff, data, len ) ^ 0xffff;
+    data[len++] = fcs & 0xff;
+    data[len++] = fcs >> 8;
+    raw[0] = 0x7e;
+    n = 1+escape_frame( raw+1, sizeof(raw)-2, data, len );
+    raw[n++] = 0x7e;
+    for( pos=0; pos<n; pos+=chunk ) {
+      chunk = ( n-pos > SPEEDWIRE_CHUNK ) ? SPEEDWIRE_CHUNK : n-pos;
+      if(( pos+chunk < n )&&( raw[pos+chunk-1] == 0x7d ))
+        chunk--; // never split an escape
+      speedwire_frame( tp, ( pos+chunk < n ) ? 0x08 : 0x01, raw+pos, chunk );
+    }
+  }
+}
+
+int speedwire_recv( TransportType * tp, unsigned char * buf, int len, int flags )
+{
+  struct pollfd pfd;
+  int queued=0;
+
+  for(;;) {
+    speedwire_pump( tp );
+    if(( flags & MSG_DONTWAIT )||(( ioctl( tp->local, FIONREAD, &queued ) == 0 )&&( queued > 0 )))
+      return recv( tp->local, buf, len, flags );
+    // woken by a datagram that was not for us, wait for the real thing
+    pfd.fd = tp->fd;
+    pfd.events = POLLIN;
+    if( poll( &pfd, 1, tp->timeout*1000 ) <= 0 ) {
+      errno = ETIMEDOUT;
+      return( -1 );
+    }
+  }
+}
+
+static const TransportOps transports[] = {
+  { "rfcomm", rfcomm_open, socket_send, socket_recv, socket_close, rfcomm_up },
+  { "tcp",    tcp_open,    socket_send, socket_recv, socket_close, NULL },
+  { "unix",   unix_open,   socket_send, socket_recv, socket_close, NULL },
+  { "speedwire", speedwire_open, speedwire_send, speedwire_recv, speedwire_close, NULL },
+  { "replay", replay_open, replay_send, replay_recv, replay_close, NULL },
+};
+
+/* Write one S or R line to the Capture file */
+void capture_bytes( TransportType * tp, char direction, unsigned char * buf, int len )
+{
+  int i;
+
+  fputc( direction, tp->capture );
+  for( i=0; i<len; i++ )
+    fprintf( tp->capture, " %02x", buf[i] );
+  fputc( '\n', tp->capture );
+  fflush( tp->capture );
+}
+
+/*
+ * Set tp up for the link named by the Transport config key, e.g.
+ * tcp://127.0.0.1:9000, without connecting yet.  Without one we use RFCOMM
+ * to BTAddress.  Returns 0 on success and -1 on error
+ */
+int transport_init( TransportType * tp, ConfType * conf, FlagType * flag )
+{
+  char *address;
+  int i;
+
+  memset( tp, 0, sizeof(TransportType) );
+  tp->fd = -1;
+  tp->peer = -1;
+  tp->local = -1;
+  tp->udp = -1;
+  tp->conf = conf;
+  tp->timeout = conf->bt_timeout;
+  if( strlen( conf->Transport ) == 0 )
+    sprintf( conf->Transport, "rfcomm://%s", conf->BTAddress );
+  if(( address = strstr( conf->Transport, "://" )) == NULL ) {
+    printf("ERROR: Bad Transport %s, expected scheme://address\n", conf->Transport );
+    return( -1 );
+  }
+  for( i=0; i < sizeof(transports)/sizeof(*transports); i++ ) {
+    if(( strlen( transports[i].scheme ) == address-conf->Transport )&&( strncmp( conf->Transport, transports[i].scheme, address-conf->Transport ) == 0 ))
+      tp->ops = transports+i;
+  }
+  if( tp->ops == NULL ) {
+    printf("ERROR: Unknown Transport %s\n", conf->Transport );
+    return( -1 );
+  }
+  strcpy( tp->address, address+3 );
+  if(( tp->ops->up != NULL )&&( link_state_load( conf, tp->address, &tp->cache_channel, tp->cache_adapter ) == 0 )) {
+    if( flag->debug == 1 ) printf("Last connected to %s on channel %d from %s\n", tp->address, tp->cache_channel, tp->cache_adapter );
+  }
+  return( 0 );
+}
+
+/* The link is up: blocking from here on, start capturing */
+void link_up( TransportType * tp, FlagType * flag )
+{
+  int flags;
+
+  tp->state = LINK_UP;
+  if(( flags = fcntl( tp->fd, F_GETFL )) >= 0 )
+    fcntl( tp->fd, F_SETFL, flags & ~O_NONBLOCK );
+  if( tp->ops->up != NULL )
+    tp->ops->up( tp, flag );
+  if( flag->verbose == 1 ) printf("Connected to %s (attempt %d)\n", tp->address, tp->attempts );
+  if( strlen( tp->conf->Capture ) > 0 ) {
+    if(( tp->capture = fopen( tp->conf->Capture, "a" )) == NULL )
+      printf("ERROR: Cannot open capture file %s\n", tp->conf->Capture );
+  }
+}
+
+/*
+ * That attempt failed, try again after an exponential backoff of
+ * CONNECT_BACKOFF ms doubling up to CONNECT_BACKOFF_MAX, jittered so
+ * several links do not retry in step
+ */
+void link_retry( TransportType * tp, long now )
+{
+  long delay;
+
+  if( tp->fd >= 0 )
+    close( tp->fd );
+  tp->fd = -1;
+  tp->state = LINK_DOWN;
+  printf("Trying to connect to %s (attempt %d failed)\n", tp->address, tp->attempts );
+  delay = CONNECT_BACKOFF << ( tp->attempts < 8 ? tp->attempts-1 : 7 );
+  if( delay > CONNECT_BACKOFF_MAX )
+    delay = CONNECT_BACKOFF_MAX;
+  tp->due = now + delay/2 + random()%( delay/2+1 );
+}
+
+/*
+ * Connect all num links at once.  Each attempt is a non-blocking connect
+ * given ConnectTimeout ms, failed ones are retried with backoff until
+ * ConnectBudget seconds have gone, or the deadline of the poll.  Returns the number of links up, the
+ * others are left with fd -1
+ */
+int transport_connect( TransportType ** tps, int num, FlagType * flag )
+{
+  struct pollfd *pfd;
+  TransportType *tp;
+  int *pidx;
+  int i, n, up, left, err, status;
+  socklen_t len;
+  long now, wait, budget_end;
+
+  if( num <= 0 )
+    return( 0 );
+  pfd = (struct pollfd *)malloc( sizeof(struct pollfd)*num );
+  pidx = (int *)malloc( sizeof(int)*num );
+  srandom( time(NULL) ^ getpid() );
+  now = monotonic_ms();
+  budget_end = now + tps[0]->conf->connect_budget*1000L;
+  if(( tps[0]->conf->deadline > 0 )&&( tps[0]->conf->deadline < budget_end ))
+    budget_end = tps[0]->conf->deadline;
+  for( i=0; i<num; i++ ) {
+    tps[i]->state = ( tps[i]->fd >= 0 ) ? LINK_UP : LINK_DOWN;
+    tps[i]->attempts = 0;
+    tps[i]->due = now;
+  }
+  for(;;) {
+    now = monotonic_ms();
+    wait = budget_end - now;
+    n = 0;
+    up = 0;
+    left = 0;
+    for( i=0; i<num; i++ ) {
+      tp = tps[i];
+      if(( tp->state == LINK_DOWN )&&( now >= tp->due )&&(( now < budget_end )||( tp->attempts == 0 ))) {
+        tp->attempts++;
+        if( flag->debug == 1 ) printf("Opening %s transport to %s (attempt %d)\n", tp->ops->scheme, tp->address, tp->attempts );
+        status = tp->ops->open( tp, tp->conf, flag );
+        if( status == 0 )
+          link_up( tp, flag );
+        else if( status == 1 ) {
+          tp->state = LINK_CONNECTING;
+          tp->due = now + tp->conf->connect_timeout;
+          if( tp->due > budget_end )
+            tp->due = budget_end;
+        } else if( status == -2 )
+          tp->state = LINK_FAILED; // retrying will not help
+        else
+          link_retry( tp, now );
+      }
+      if(( tp->state == LINK_CONNECTING )&&( now >= tp->due ))
+        link_retry( tp, now ); // took longer than ConnectTimeout
+      if( tp->state == LINK_UP )
+        up++;
+      if(( tp->state == LINK_UP )||( tp->state == LINK_FAILED ))
+        continue;
+      left++;
+      if( tp->state == LINK_CONNECTING ) {
+        pfd[n].fd = tp->fd;
+        pfd[n].events = POLLOUT;
+        pidx[n++] = i;
+      }
+      if( tp->due - now < wait )
+        wait = tp->due - now;
+    }
+    if(( left == 0 )||(( n == 0 )&&( now >= budget_end )))
+      break;
+    if( wait < 0 )
+      wait = 0;
+    if( poll( pfd, n, wait ) < 0 ) {
+      if( errno == EINTR )
+        continue;
+      printf("ERROR: poll error has occurred\n");
+      break;
+    }
+    now = monotonic_ms();
+    for( i=0; i<n; i++ ) {
+      if( pfd[i].revents == 0 )
+        continue;
+      tp = tps[pidx[i]];
+      err = 0;
+      len = sizeof(err);
+      if(( getsockopt( tp->fd, SOL_SOCKET, SO_ERROR, &err, &len ) == 0 )&&( err == 0 ))
+        link_up( tp, flag );
+      else
+        link_retry( tp, now );
+    }
+  }
+  for( i=0; i<num; i++ ) {
+    if( tps[i]->state != LINK_UP ) {
+      if( tps[i]->fd >= 0 )
+        close( tps[i]->fd );
+      tps[i]->fd = -1;
+      printf("ERROR: Cannot connect to %s after %d attempts\n", tps[i]->address, tps[i]->attempts );
+    }
+  }
+  free( pfd );
+  free( pidx );
+  return( up );
+}
+
+/*
+ * Open the link named by the Transport config key.
+ * Returns 0 on success and -1 on error
+ */
+int transport_open( TransportType * tp, ConfType * conf, FlagType * flag )
+{
+  if( transport_init( tp, conf, flag ) < 0 )
+    return( -1 );
+  if( transport_connect( &tp, 1, flag ) != 1 )
+    return( -1 );
+  return( 0 );
+}
+
+int transport_send( TransportType * tp, unsigned char * buf, int len )
+{
+  if( tp->capture != NULL ) capture_bytes( tp, 'S', buf, len );
+  return tp->ops->send( tp, buf, len );
+}
+
+int transport_recv( TransportType * tp, unsigned char * buf, int len, int flags )
+{
+  int bytes_read;
+
+  bytes_read = tp->ops->recv( tp, buf, len, flags );
+  if(( tp->capture != NULL )&&( bytes_read > 0 )) capture_bytes( tp, 'R', buf, bytes_read );
+  return bytes_read;
+}
+
+/* Could p be the start of a frame: 7e, good checkbit and a sane length */
+int frame_header_ok( unsigned char * p )
+{
+  int len = p[1] + p[2]*256;
+
+  return(( p[0] == 0x7e )&&(( p[0]^p[1]^p[2] ) == p[3] )&&( len >= 18 )&&( len <= RXMAXFRAME ));
+}
+
+/*
+ * After a bad header skip forward to the next 7e that starts a valid header,
+ * or to a 7e too near the end of the data to check yet.  memchr is a word at
+ * a time or SIMD search in the C libraries we build against, so line noise
+ * is skipped at several GB/s.  Noise bytes dropped are counted in rx_skipped.
+ */
+void transport_resync( TransportType * tp )
+{
+  unsigned char *p, *end;
+
+  p = tp->rx+tp->rx_start+1;
+  end = tp->rx+tp->rx_end;
+  while(( p < end )&&(( p = memchr( p, 0x7e, end-p )) != NULL )) {
+    if(( end-p < 4 )||( frame_header_ok( p )))
+      break;
+    p++;
+  }
+  if(( p == NULL )||( p > end ))
+    p = end;
+  tp->rx_skipped += p-(tp->rx+tp->rx_start);
+  tp->rx_start = p-tp->rx;
+}
+
+/*
+ * Length of the complete frame at rx_start, skipping any noise in front of
+ * it, or 0 if the buffer does not hold one yet
+ */
+int rx_frame_len( TransportType * tp )
+{
+  unsigned char *p;
+  int avail, len;
+
+  for(;;) {
+    avail = tp->rx_end - tp->rx_start;
+    p = tp->rx+tp->rx_start;
+    if(( avail > 0 )&&(( p[0] != 0x7e )||(( avail >= 4 )&&( !frame_header_ok( p ))))) {
+      transport_resync( tp );
+      continue;
+    }
+    if( avail >= 4 ) {
+      len = p[1] + p[2]*256;
+      if( avail >= len )
+        return( len );
+    }
+    return( 0 );
+  }
+}
+
+/* Make room behind the data in rx, keeping a partial frame contiguous */
+void rx_compact( TransportType * tp )
+{
+  int avail = tp->rx_end - tp->rx_start;
+
+  // only ever moves less than one frame
+  if( avail == 0 )
+    tp->rx_start = tp->rx_end = 0;
+  else if( tp->rx_end > RXBUFSIZE-RXMAXFRAME ) {
+    memmove( tp->rx, tp->rx+tp->rx_start, avail );
+    tp->rx_start = 0;
+    tp->rx_end = avail;
+  }
+}
+
+/*
+ * Hand out the next complete frame, reading whatever the link has into the
+ * receive buffer until one is there.  Several frames from one recv() are
+ * returned one by one without going back to the socket, a frame split over
+ * several recv()s is put back together and noise between frames is skipped.
+ * *frame points into the buffer and stays valid until the next call.
+ * Waits at most timeout seconds (0 just polls).  Returns the frame length,
+ * 0 on timeout and -1 if the link failed.
+ */
+int transport_frame( TransportType * tp, int timeout, unsigned char ** frame )
+{
+  int len, bytes_read, maxfd;
+  struct timeval tv, now, deadline;
+  fd_set readfds;
+
+  gettimeofday( &deadline, NULL );
+  deadline.tv_sec += timeout;
+  for(;;) {
+    if(( len = rx_frame_len( tp )) > 0 ) {
+      *frame = tp->rx+tp->rx_start;
+      tp->rx_start += len;
+      return( len );
+    }
+    rx_compact( tp );
+    gettimeofday( &now, NULL );
+    timersub( &deadline, &now, &tv );
+    if( tv.tv_sec < 0 )
+      timerclear( &tv );
+    FD_ZERO( &readfds );
+    FD_SET( tp->fd, &readfds );
+    maxfd = tp->fd;
+    if( tp->link != NULL ) {
+      // a lane, its frames come in on the link
+      FD_SET( tp->link->fd, &readfds );
+      if( tp->link->fd > maxfd ) maxfd = tp->link->fd;
+    }
+    if( select( maxfd+1, &readfds, NULL, NULL, &tv ) < 0 ) {
+      if( errno == EINTR )
+        continue;
+      printf("ERROR: select error has occurred\n");
+      return( -1 );
+    }
+    if( !FD_ISSET( tp->fd, &readfds )&&(( tp->link == NULL )||( !FD_ISSET( tp->link->fd, &readfds )))) {
+      // a header that never completed was most likely noise, look past it next time
+      if(( timeout > 0 )&&( tp->rx_end > tp->rx_start ))
+        transport_resync( tp );
+      return( 0 );
+    }
+    bytes_read = transport_recv( tp, tp->rx+tp->rx_end, RXBUFSIZE-tp->rx_end, ( tp->link != NULL ) ? MSG_DONTWAIT : 0 );
+    if(( bytes_read < 0 )&&( tp->link != NULL )&&( errno == EAGAIN ))
+      continue; // what the link had was for another lane
+    if( bytes_read <= 0 )
+      return( -1 );
+    tp->rx_end += bytes_read;
+  }
+}
+
+/* Take in what the link has without waiting.  Returns 0, or -1 if it failed */
+int rx_fill( TransportType * tp )
+{
+  int bytes_read;
+
+  rx_compact( tp );
+  if( tp->rx_end == RXBUFSIZE )
+    return( 0 );
+  bytes_read = transport_recv( tp, tp->rx+tp->rx_end, RXBUFSIZE-tp->rx_end, MSG_DONTWAIT );
+  if( bytes_read > 0 )
+    tp->rx_end += bytes_read;
+  else if(( bytes_read == 0 )||(( errno != EAGAIN )&&( errno != EWOULDBLOCK )&&( errno != EINTR )))
+    return( -1 );
+  return( 0 );
+}
+
+/*
+ * Throw away what the link has for us without waiting, i.e. stale replies
+ * before a new request.  Reads with MSG_DONTWAIT straight into the receive
+ * buffer until the socket is empty, so a handful of recv()s however many
+ * frames are waiting.  A frame still arriving is kept for the reader.
+ * Returns the number of frames dropped, or -1 if the link failed
+ */
+int transport_drain( TransportType * tp, FlagType * flag )
+{
+  int frames=0, len, end;
+  long bytes=0;
+
+  do {
+    while(( len = rx_frame_len( tp )) > 0 ) {
+      frames++;
+      bytes += len;
+      tp->rx_start += len;
+    }
+    end = tp->rx_end - tp->rx_start;
+    if( rx_fill( tp ) < 0 )
+      return( -1 );
+  } while( tp->rx_end - tp->rx_start > end );
+  if(( flag->debug == 1 )&&( frames > 0 )) printf("Drained %d stale frames (%ld bytes)\n", frames, bytes );
+  return( frames );
+}
+
+/*
+ * Is a complete frame waiting, so transport_frame will not block?
+ * Returns 1 if so, 0 if not yet and -1 if the link failed
+ */
+int transport_pending( TransportType * tp )
+{
+  if( rx_frame_len( tp ) > 0 )
+    return( 1 );
+  if( rx_fill( tp ) < 0 )
+    return( -1 );
+  return( rx_frame_len( tp ) > 0 );
+}
+
+/*
+ * Is the rest of a multi-frame reply waiting, i.e. a frame ending in 7e?
+ * Also 1 when the buffer is too full to wait for more.  Returns 1 if so,
+ * 0 if not yet and -1 if the link failed
+ */
+int transport_message( TransportType * tp )
+{
+  unsigned char *p;
+  int pos, len;
+
+  if( rx_fill( tp ) < 0 )
+    return( -1 );
+  if(( len = rx_frame_len( tp )) == 0 )
+    return( tp->rx_end - tp->rx_start > RXBUFSIZE-RXMAXFRAME );
+  for( pos = tp->rx_start; pos+4 <= tp->rx_end; pos += len ) {
+    p = tp->rx+pos;
+    if( !frame_header_ok( p ))
+      return( 1 ); // let the reader sort it out
+    len = p[1] + p[2]*256;
+    if( pos+len > tp->rx_end )
+      break;
+    if( p[len-1] == 0x7e )
+      return( 1 );
+  }
+  return( tp->rx_end - tp->rx_start > RXBUFSIZE-RXMAXFRAME );
+}
+
+/*
+ * Lanes: several commands in flight on one link, each reading only its own
+ * replies.  A lane sends straight on the link and notes the $CNT packet id
+ * of its request.  Whichever lane reads next pumps the link and hands every
+ * frame to the lane it is for through that lane's socket pair, like the
+ * frames Speedwire makes up, so a command reads its replies as if it had
+ * the link to itself and replies may come back in any order.
+ */
+
+/* The packet id of the Data2+ request or reply starting in frame, or -1 */
+int frame_pktid( unsigned char * frame, int len )
+{
+  unsigned char head[23];
+  int i, n=0;
+
+  if(( len < 23 )||( memcmp( frame+18, "\x7e\xff\x03\x60\x65", 5 ) != 0 ))
+    return( -1 );
+  // the header up to the packet id, which may be escaped
+  for( i=23; ( i<len )&&( n<sizeof(head) ); i++ )
+    head[n++] = (( frame[i] == 0x7d )&&( i+1 < len )) ? frame[++i]^0x20 : frame[i];
+  if( n < sizeof(head) )
+    return( -1 );
+  return( head[22] );
+}
+
+/*
+ * Hand every complete frame the link has to its lane: a Data2+ reply to
+ * the lane that sent its packet id and the rest of a multi-frame reply
+ * after it, whose fragments are marked 08 up to the last, which is 01.
+ * Other frames go to a lane whose request was not Data2+, or else the
+ * first.  A reply no lane is waiting for, e.g. a late one to a
+ * request sent again since, is dropped.
+ * Returns 0, or -1 if the link failed
+ */
+int transport_pump( TransportType * tp )
+{
+  unsigned char *frame;
+  int len, id, i, to;
+
+  while(( len = transport_frame( tp, 0, &frame )) > 0 ) {
+    id = frame_pktid( frame, len );
+    if(( id < 0 )&&( tp->lane_open != -1 )&&(( frame[16] == 0x08 )||( frame[16] == 0x01 ))) {
+      to = tp->lane_open;
+    } else if( id >= 0 ) {
+      for( to=-2, i=0; i<tp->num_lanes; i++ )
+        if( tp->lanes[i].pktid == id )
+          to = i;
+    } else {
+      for( to=0, i=tp->num_lanes-1; i>=0; i-- )
+        if( tp->lanes[i].pktid < 0 )
+          to = i;
+    }
+    tp->lane_open = ( frame[len-1] == 0x7e ) ? -1 : to;
+    if( to < 0 ) {
+      if( id >= 0 )
+        tp->rx_unclaimed++;
+      continue;
+    }
+    if( write( tp->lanes[to].peer, frame, len ) != len )
+      printf("ERROR: Could not queue %d bytes for lane %d\n", len, to );
+    tp->lane_last = monotonic_ms();
+  }
+  return( len );
+}
+
+/*
+ * Is tp a lane of a link that handed out replies in the last ms?  Then the
+ * inverter is still answering requests sent before the lane's
+ */
+int transport_busy( TransportType * tp, long ms )
+{
+  return(( tp->link != NULL )&&( monotonic_ms() - tp->link->lane_last < ms ));
+}
+
+/* Send on the link, noting the packet id the replies will carry */
+int lane_send( TransportType * tp, unsigned char * buf, int len )
+{
+  tp->pktid = frame_pktid( buf, len );
+  return transport_send( tp->link, buf, len );
+}
+
+int lane_recv( TransportType * tp, unsigned char * buf, int len, int flags )
+{
+  struct pollfd pfd[2];
+  int queued, failed;
+
+  for(;;) {
+    failed = ( transport_pump( tp->link ) < 0 );
+    queued = 0;
+    ioctl( tp->fd, FIONREAD, &queued );
+    if(( queued == 0 )&&( failed ))
+      return( 0 );
+    if(( flags & MSG_DONTWAIT )||( queued > 0 ))
+      return recv( tp->fd, buf, len, flags );
+    // wait for the link, what comes may well be for another lane
+    pfd[0].fd = tp->fd;
+    pfd[1].fd = tp->link->fd;
+    pfd[0].events = pfd[1].events = POLLIN;
+    if( poll( pfd, 2, tp->timeout*1000 ) <= 0 ) {
+      errno = ETIMEDOUT;
+      return( -1 );
+    }
+  }
+}
+
+void lane_close( TransportType * tp )
+{
+  close( tp->fd );
+  close( tp->peer );
+  tp->peer = -1;
+}
+
+static const TransportOps lane_ops = { "lane", NULL, lane_send, lane_recv, lane_close, NULL };
+
+/*
+ * Split the link in tp into num lanes for that many commands at once, each
+ * lane to be used like a link of its own until transport_unlane.
+ * Returns 0 on success and -1 on error
+ */
+int transport_lanes( TransportType * tp, TransportType * lanes, int num, FlagType * flag )
+{
+  TransportType *lane;
+  int i, sv[2];
+
+  if( tp->ops->send == replay_send ) {
+    // a capture plays back in the order it was recorded
+    if( flag->debug == 1 ) printf("Not pipelining replay %s\n", tp->address );
+    return( -1 );
+  }
+  for( i=0; i<num; i++ ) {
+    lane = lanes+i;
+    memset( lane, 0, sizeof(TransportType) );
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 ) {
+      printf("ERROR: Cannot create lane %d of %s\n", i, tp->address );
+      while( --i >= 0 )
+        transport_close( lanes+i );
+      return( -1 );
+    }
+    lane->ops = &lane_ops;
+    lane->fd = sv[0];
+    lane->peer = sv[1];
+    lane->local = -1;
+    lane->udp = -1;
+    lane->link = tp;
+    lane->conf = tp->conf;
+    lane->state = LINK_UP;
+    lane->timeout = tp->timeout;
+    lane->pktid = -1;
+    strcpy( lane->address, tp->address );
+  }
+  tp->lanes = lanes;
+  tp->num_lanes = num;
+  tp->lane_open = -1;
+  if( flag->debug == 1 ) printf("Split %s into %d lanes\n", tp->address, num );
+  return( 0 );
+}
+
+/* Join the lanes up again, whatever they have not read is dropped */
+void transport_unlane( TransportType * tp, FlagType * flag )
+{
+  int i;
+
+  for( i=0; i<tp->num_lanes; i++ )
+    transport_close( tp->lanes+i );
+  if(( flag->debug == 1 )&&( tp->rx_unclaimed > 0 )) printf("%ld replies on %s were for no lane\n", tp->rx_unclaimed, tp->address );
+  tp->lanes = NULL;
+  tp->num_lanes = 0;
+  tp->lane_open = -1;
+}
+
+int transport_fd( TransportType * tp )
+{
+  return tp->fd;
+}
+
+void transport_close( TransportType * tp )
+{
+  if( tp->fd < 0 )
+    return;
+  tp->ops->close( tp );
+  tp->fd = -1;
+  if( tp->capture != NULL )
+    fclose( tp->capture );
+  tp->capture = NULL;
+}
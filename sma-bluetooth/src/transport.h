@@ -0,0 +1,103 @@
+/* tool to read power production data for SMA solar power convertors 
+   Copyright Wim Hofman 2010 
+   Copyright Stephen Collier 2010,2011 
+   Copyright Edwin Zuidema 2020, 2021
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef H_TRANSPORT
+  #define H_TRANSPORT
+
+#include <stdio.h>
+#include "sma_struct.h"
+
+typedef struct TransportType TransportType;
+
+#define RXBUFSIZE  4096       /* receive buffer, room for several frames */
+#define RXMAXFRAME 1024       /* longest frame we accept, size of received[] */
+
+#define SPEEDWIRE_PORT  "9522"  /* default UDP port of Speedwire devices */
+#define SPEEDWIRE_MAX   2048    /* longest datagram we send or take in */
+#define SPEEDWIRE_CHUNK 200     /* Data2+ bytes per made up Bluetooth frame */
+
+#define CONNECT_BACKOFF     250   /* ms before the first connect retry */
+#define CONNECT_BACKOFF_MAX 8000  /* ms, longest wait between connect attempts */
+
+#define LINK_DOWN       0
+#define LINK_CONNECTING 1
+#define LINK_UP         2
+#define LINK_FAILED     3       /* gave up, e.g. a bad address */
+
+/* One backend per url scheme of the Transport config key */
+typedef struct{
+  const char * scheme;                                            /* rfcomm, tcp, unix, speedwire or replay */
+  int  (*open)( TransportType *, ConfType *, FlagType * );         /* connect, returns 0, 1 in progress or -1 */
+  int  (*send)( TransportType *, unsigned char *, int );           /* like send() */
+  int  (*recv)( TransportType *, unsigned char *, int, int );      /* like recv() */
+  void (*close)( TransportType * );
+  void (*up)( TransportType *, FlagType * );                      /* connected, may be NULL */
+} TransportOps;
+
+struct TransportType{
+  const TransportOps * ops;
+  int  fd;                    /* descriptor to select() on for incoming data */
+  ConfType * conf;            /* settings the link was set up with */
+  int  state;                 /* LINK_* */
+  int  attempts;              /* connect attempts so far */
+  long due;                   /* ms, connect deadline or time of the next attempt */
+  int  channel;               /* rfcomm: channel being connected to */
+  int  cache_channel;         /* rfcomm: channel that worked last time, 0 if unknown */
+  char cache_adapter[20];     /* rfcomm: local adapter that worked last time */
+  int  timeout;               /* seconds read_bluetooth waits for a frame */
+  char address[80];           /* Transport url without the scheme:// */
+  FILE * capture;             /* Capture file, NULL when not capturing */
+  int  peer;                  /* replay, speedwire: our end of the socket pair behind fd */
+  int  local;                 /* speedwire: the reading end of that pair, fd is an epoll set */
+  int  udp;                   /* speedwire: socket to the device */
+  unsigned char btaddr[6];    /* speedwire: BTAddress as sma.in has it, source of made up frames */
+  int  num_records;           /* replay: records in the capture file */
+  int  next_record;           /* replay: next record to play back */
+  struct ReplayRecord * records;
+  int  rx_start;              /* first unread byte in rx */
+  int  rx_end;                /* end of the data read into rx */
+  long rx_skipped;            /* noise bytes dropped finding the next frame */
+  TransportType * link;       /* lane: the link it shares with the other lanes */
+  TransportType * lanes;      /* link: split into these while commands overlap, NULL if not */
+  int  num_lanes;
+  int  lane_open;             /* link: lane getting the rest of a multi-frame reply, -1 none, -2 dropped */
+  int  pktid;                 /* lane: $CNT packet id of its last request, -1 if not Data2+ */
+  long rx_unclaimed;          /* link: replies no lane was waiting for */
+  long lane_last;             /* link: ms, when a frame was last handed to a lane */
+  int  send_count;            /* link: $CNT packet ids, kept over sessions as late replies may still come */
+  unsigned char rx[RXBUFSIZE];
+};
+
+extern long monotonic_ms( void );
+extern int  transport_init( TransportType * tp, ConfType * conf, FlagType * flag );
+extern int  transport_connect( TransportType ** tps, int num, FlagType * flag );
+extern int  transport_open( TransportType * tp, ConfType * conf, FlagType * flag );
+extern int  transport_send( TransportType * tp, unsigned char * buf, int len );
+extern int  transport_recv( TransportType * tp, unsigned char * buf, int len, int flags );
+extern int  transport_frame( TransportType * tp, int timeout, unsigned char ** frame );
+extern int  transport_drain( TransportType * tp, FlagType * flag );
+extern int  transport_pending( TransportType * tp );
+extern int  transport_message( TransportType * tp );
+extern int  transport_lanes( TransportType * tp, TransportType * lanes, int num, FlagType * flag );
+extern void transport_unlane( TransportType * tp, FlagType * flag );
+extern int  transport_pump( TransportType * tp );
+extern int  transport_busy( TransportType * tp, long ms );
+extern int  transport_fd( TransportType * tp );
+extern void transport_close( TransportType * tp );
+
+#endif